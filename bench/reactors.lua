@@ -0,0 +1,32 @@
+-- wrk script for the front end, a mix of what readers usually request
+-- keep-alive GETs of the home page, a static resource and optionally an article, in turn per connection
+--
+--   wrk -t4 -c64 -d20s -s bench/reactors.lua http://localhost:8080 [article path]
+--
+-- see reactors.sh to run it against 1, 2, 4... event loops
+
+local paths = {"/", "/main.css"}
+local next_path = 1
+
+function init(args)
+	if args[1] then
+		table.insert(paths, "/wiki/" .. args[1])
+	end
+end
+
+function request()
+	local path = paths[next_path]
+	next_path = next_path % #paths + 1
+
+	return wrk.format("GET", path)
+end
+
+-- non 2xx/3xx responses count as errors, a broken run shouldnt look fast
+function done(summary, latency, requests)
+	local errors = summary.errors.connect + summary.errors.read + summary.errors.write
+		+ summary.errors.status + summary.errors.timeout
+
+	io.write(string.format("%.0f req/s, p50 %.2fms, p99 %.2fms, %d errors\n",
+		summary.requests / (summary.duration / 1e6),
+		latency:percentile(50) / 1e3, latency:percentile(99) / 1e3, errors))
+end
@@ -0,0 +1,41 @@
+#!/bin/sh
+# throughput against the number of event loops, see reactors.lua
+#
+#   bench/reactors.sh ./ranch templates [article path]
+#
+# run from the data directory of a wiki, the server is restarted for each count
+# LOOPS, PORT, CONNECTIONS, DURATION and WRK_THREADS override the defaults below
+
+set -e
+
+RANCH=${1:?ranch binary}
+TEMPLATES=${2:?templates directory}
+ARTICLE=$3
+
+LOOPS=${LOOPS:-"1 2 4 8"}
+PORT=${PORT:-8089}
+CONNECTIONS=${CONNECTIONS:-256}
+DURATION=${DURATION:-20s}
+WRK_THREADS=${WRK_THREADS:-4}
+
+SCRIPT=$(dirname "$0")/reactors.lua
+
+# the console is a fifo, so each run ends with quit and saves like it normally would
+CONSOLE=$(mktemp -u)
+mkfifo "$CONSOLE"
+trap 'rm -f "$CONSOLE"' EXIT
+
+for n in $LOOPS; do
+	"$RANCH" "$TEMPLATES" "$PORT" "$n" <"$CONSOLE" >/dev/null 2>&1 &
+	pid=$!
+	exec 3>"$CONSOLE"
+
+	sleep 2
+	printf "%s loops: " "$n"
+	wrk -t"$WRK_THREADS" -c"$CONNECTIONS" -d"$DURATION" -s "$SCRIPT" "http://localhost:$PORT" $ARTICLE | tail -n 1
+
+	# held open until it exits, the console shouldnt see eof while saving
+	echo quit >&3
+	wait "$pid" || true
+	exec 3>&-
+done
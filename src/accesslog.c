@@ -0,0 +1,154 @@
+// access log, one record per request
+// producers never block, a background thread formats and writes batches
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
+
+#include "util.h"
+
+#define LOG_RING 4096 //records, power of two
+#define LOG_PATH_MAX 256 //longer paths are truncated
+#define LOG_INTERVAL 100 //ms between drains when idle
+
+typedef struct {
+	atomic_ulong seq; //position it can be written at, +1 once readable
+
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	time_t time;
+	char method[8];
+	char path[LOG_PATH_MAX];
+
+	int status;
+	unsigned long bytes;
+	unsigned long latency; //microseconds
+} log_record;
+
+typedef struct {
+	log_record* ring;
+
+	atomic_ulong head; //next position to claim
+	unsigned long tail; //drain thread only
+
+	atomic_ulong dropped; //ring full
+	unsigned long dropped_reported;
+
+	FILE* out;
+	atomic_int stop;
+	thrd_t thread;
+} accesslog_t;
+
+//bounded mpsc queue, sequence numbers per slot
+//https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+void accesslog_push(accesslog_t* log, log_record* rec) {
+	unsigned long pos = atomic_load_explicit(&log->head, memory_order_relaxed);
+	log_record* slot;
+
+	while (1) {
+		slot = &log->ring[pos & (LOG_RING-1)];
+		unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		long diff = (long)(seq - pos);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&log->head, &pos, pos+1,
+					memory_order_relaxed, memory_order_relaxed)) break;
+		} else if (diff < 0) {
+			atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+			return;
+		} else {
+			pos = atomic_load_explicit(&log->head, memory_order_relaxed);
+		}
+	}
+
+	//everything but the sequence
+	memcpy(&slot->addr, &rec->addr, sizeof(log_record) - offsetof(log_record, addr));
+
+	atomic_store_explicit(&slot->seq, pos+1, memory_order_release);
+}
+
+void accesslog_write(accesslog_t* log, log_record* rec) {
+	char host[NI_MAXHOST];
+	if (rec->addrlen==0 || getnameinfo((struct sockaddr*)&rec->addr, rec->addrlen,
+			host, NI_MAXHOST, NULL, 0, NI_NUMERICHOST)!=0)
+		strcpy(host, "-");
+
+	char date[32];
+	struct tm tm;
+	gmtime_r(&rec->time, &tm);
+	strftime(date, 32, "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+	fprintf(log->out, "%s %s %s /%s %i %lu %luus\n",
+			date, host, rec->method, rec->path, rec->status, rec->bytes, rec->latency);
+}
+
+//returns number of records written
+unsigned long accesslog_drain(accesslog_t* log) {
+	unsigned long n = 0;
+
+	while (1) {
+		log_record* slot = &log->ring[log->tail & (LOG_RING-1)];
+		unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq != log->tail+1) break;
+
+		accesslog_write(log, slot);
+		atomic_store_explicit(&slot->seq, log->tail+LOG_RING, memory_order_release);
+
+		log->tail++;
+		n++;
+	}
+
+	unsigned long dropped = atomic_load_explicit(&log->dropped, memory_order_relaxed);
+	if (dropped != log->dropped_reported) {
+		fprintf(log->out, "access log dropped %lu records\n", dropped - log->dropped_reported);
+		log->dropped_reported = dropped;
+	}
+
+	if (n > 0) fflush(log->out);
+	return n;
+}
+
+int accesslog_loop(void* arg) {
+	accesslog_t* log = arg;
+
+	while (!atomic_load(&log->stop)) {
+		if (accesslog_drain(log) == 0)
+			thrd_sleep(&(struct timespec){.tv_nsec=LOG_INTERVAL*1000000}, NULL);
+	}
+
+	accesslog_drain(log);
+	return 0;
+}
+
+void accesslog_start(accesslog_t* log, FILE* out) {
+	log->ring = heap(sizeof(log_record)*LOG_RING);
+	for (unsigned long i=0; i<LOG_RING; i++) {
+		atomic_init(&log->ring[i].seq, i);
+	}
+
+	atomic_init(&log->head, 0);
+	log->tail = 0;
+
+	atomic_init(&log->dropped, 0);
+	log->dropped_reported = 0;
+
+	log->out = out;
+	atomic_init(&log->stop, 0);
+
+	thrd_create(&log->thread, accesslog_loop, log);
+}
+
+//writes out whatever is left
+void accesslog_stop(accesslog_t* log) {
+	atomic_store(&log->stop, 1);
+	thrd_join(log->thread, NULL);
+
+	drop(log->ring);
+}
@@ -0,0 +1,43 @@
+// Automatically generated header.
+
+#pragma once
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "util.h"
+#define LOG_PATH_MAX 256 //longer paths are truncated
+typedef struct {
+	atomic_ulong seq; //position it can be written at, +1 once readable
+
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	time_t time;
+	char method[8];
+	char path[LOG_PATH_MAX];
+
+	int status;
+	unsigned long bytes;
+	unsigned long latency; //microseconds
+} log_record;
+typedef struct {
+	log_record* ring;
+
+	atomic_ulong head; //next position to claim
+	unsigned long tail; //drain thread only
+
+	atomic_ulong dropped; //ring full
+	unsigned long dropped_reported;
+
+	FILE* out;
+	atomic_int stop;
+	thrd_t thread;
+} accesslog_t;
+void accesslog_push(accesslog_t* log, log_record* rec);
+void accesslog_start(accesslog_t* log, FILE* out);
+void accesslog_stop(accesslog_t* log);
@@ -0,0 +1,196 @@
+// bump allocator for things that live as long as a request
+// everything is released at once instead of string by string
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+
+#include "util.h"
+
+#define ARENA_CHUNK 4096
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+typedef struct arena_chunk {
+	struct arena_chunk* next; //older chunk
+	unsigned long size;
+	unsigned long used;
+	_Alignas(max_align_t) char data[];
+} arena_chunk;
+
+typedef struct {
+	arena_chunk* head; //chunk being filled, NULL until first use
+	unsigned long allocs; //served since the last reset
+	unsigned long chunks; //heap allocations behind them
+} arena_t;
+
+#define ARENA_KINDS 32 //rows of arena_count
+#define ARENA_KIND_MAX 32
+
+//per kind of request, allocations are what used to go to the heap one by one, chunks what still does
+typedef struct {
+	char kind[ARENA_KIND_MAX];
+	unsigned long requests;
+	unsigned long allocs;
+	unsigned long chunks;
+} arena_kind_stats;
+
+mtx_t arena_kinds_lock;
+arena_kind_stats arena_kinds[ARENA_KINDS];
+unsigned long arena_kinds_len = 0;
+once_flag arena_kinds_once = ONCE_FLAG_INIT;
+
+void arena_kinds_init() {
+	mtx_init(&arena_kinds_lock, mtx_plain);
+}
+
+arena_t arena_new() {
+	return (arena_t){.head=NULL, .allocs=0, .chunks=0};
+}
+
+void* arena_alloc(arena_t* arena, unsigned long size) {
+	size = (size + ARENA_ALIGN-1) & ~(unsigned long)(ARENA_ALIGN-1);
+	arena->allocs++;
+
+	if (!arena->head || arena->head->size - arena->head->used < size) {
+		//big ones get their own chunk behind the current one so it keeps filling
+		int big = size > ARENA_CHUNK/4;
+
+		unsigned long chunk_size = big ? size : ARENA_CHUNK;
+		arena_chunk* chunk = heap(sizeof(arena_chunk) + chunk_size);
+		chunk->size = chunk_size;
+		chunk->used = 0;
+
+		if (big && arena->head) {
+			chunk->next = arena->head->next;
+			arena->head->next = chunk;
+		} else {
+			chunk->next = arena->head;
+			arena->head = chunk;
+		}
+
+		arena->chunks++;
+
+		chunk->used = size;
+		return chunk->data;
+	}
+
+	void* ptr = arena->head->data + arena->head->used;
+	arena->head->used += size;
+	return ptr;
+}
+
+void* arena_cpy(arena_t* arena, unsigned long size, const void* data) {
+	void* ptr = arena_alloc(arena, size);
+	memcpy(ptr, data, size);
+	return ptr;
+}
+
+char* arena_cpystr(arena_t* arena, const char* str) {
+	return arena_cpy(arena, strlen(str)+1, str);
+}
+
+char* arena_cpysubstr(arena_t* arena, const char* str, unsigned long len) {
+	char* res = arena_alloc(arena, len+1);
+	memcpy(res, str, len);
+	res[len] = 0;
+
+	return res;
+}
+
+char* arena_vstr(arena_t* arena, const char* fmt, va_list args) {
+	va_list len_args;
+	va_copy(len_args, args);
+	int len = vsnprintf(NULL, 0, fmt, len_args);
+	va_end(len_args);
+
+	char* res = arena_alloc(arena, len+1);
+	vsnprintf(res, len+1, fmt, args);
+
+	return res;
+}
+
+char* arena_str(arena_t* arena, const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	char* res = arena_vstr(arena, fmt, args);
+	va_end(args);
+
+	return res;
+}
+
+//keeps one regular chunk around for the next user
+void arena_reset(arena_t* arena) {
+	arena_chunk* keep = NULL;
+
+	arena_chunk* chunk = arena->head;
+	while (chunk) {
+		arena_chunk* next = chunk->next;
+
+		if (!keep && chunk->size == ARENA_CHUNK) keep = chunk;
+		else drop(chunk);
+
+		chunk = next;
+	}
+
+	if (keep) {
+		keep->next = NULL;
+		keep->used = 0;
+	}
+
+	arena->head = keep;
+	arena->allocs = 0;
+	arena->chunks = keep ? 1 : 0;
+}
+
+void arena_free(arena_t* arena) {
+	arena_chunk* chunk = arena->head;
+	while (chunk) {
+		arena_chunk* next = chunk->next;
+		drop(chunk);
+		chunk = next;
+	}
+
+	arena->head = NULL;
+	arena->allocs = 0;
+	arena->chunks = 0;
+}
+
+//adds what arena has served so far to the row for kind, called once per request before it is freed
+void arena_count(char* kind, arena_t* arena) {
+	call_once(&arena_kinds_once, arena_kinds_init);
+	mtx_lock(&arena_kinds_lock);
+
+	unsigned long i=0;
+	while (i<arena_kinds_len && strcmp(arena_kinds[i].kind, kind)!=0) i++;
+
+	//the last row is shared by every kind that didnt fit
+	if (i == ARENA_KINDS) {
+		i = ARENA_KINDS-1;
+	} else if (i == arena_kinds_len) {
+		snprintf(arena_kinds[i].kind, ARENA_KIND_MAX, "%s", i == ARENA_KINDS-1 ? "other" : kind);
+		arena_kinds_len++;
+	}
+
+	arena_kinds[i].requests++;
+	arena_kinds[i].allocs += arena->allocs;
+	arena_kinds[i].chunks += arena->chunks;
+
+	mtx_unlock(&arena_kinds_lock);
+}
+
+//allocations served by request arenas against the heap chunks behind them, per kind of request
+//vector_t and map_t storage isnt counted on either side
+void arena_stats(FILE* f) {
+	call_once(&arena_kinds_once, arena_kinds_init);
+	mtx_lock(&arena_kinds_lock);
+
+	for (unsigned long i=0; i<arena_kinds_len; i++) {
+		arena_kind_stats* row = &arena_kinds[i];
+		fprintf(f, "%s: %lu requests, %.1f allocations from %.1f chunks each\n", row->kind, row->requests,
+			(double)row->allocs/(double)row->requests, (double)row->chunks/(double)row->requests);
+	}
+
+	mtx_unlock(&arena_kinds_lock);
+}
@@ -0,0 +1,31 @@
+// Automatically generated header.
+
+#pragma once
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include "util.h"
+typedef struct arena_chunk {
+	struct arena_chunk* next; //older chunk
+	unsigned long size;
+	unsigned long used;
+	_Alignas(max_align_t) char data[];
+} arena_chunk;
+typedef struct {
+	arena_chunk* head; //chunk being filled, NULL until first use
+	unsigned long allocs; //served since the last reset
+	unsigned long chunks; //heap allocations behind them
+} arena_t;
+arena_t arena_new();
+void* arena_alloc(arena_t* arena, unsigned long size);
+void* arena_cpy(arena_t* arena, unsigned long size, const void* data);
+char* arena_cpystr(arena_t* arena, const char* str);
+char* arena_cpysubstr(arena_t* arena, const char* str, unsigned long len);
+char* arena_vstr(arena_t* arena, const char* fmt, va_list args);
+char* arena_str(arena_t* arena, const char* fmt, ...);
+void arena_reset(arena_t* arena);
+void arena_free(arena_t* arena);
+void arena_count(char* kind, arena_t* arena);
+void arena_stats(FILE* f);
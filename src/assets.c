@@ -0,0 +1,259 @@
+// templates and static resources, reloaded when the templates directory changes
+// a new set is built off the event loops and swapped in, the old one is freed after readers leave
+
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
+
+#include "tinydir.h"
+#include "util.h"
+#include "vector.h"
+#include "hashtable.h"
+
+#include "template.h"
+#include "context.h"
+#include "web.h"
+#include "rcu.h"
+
+#define ASSETS_SETTLE 100 //ms without events before reloading, editors write in bursts
+
+const char* TEMPLATE_EXT = ".html";
+
+#ifdef TEMPLATE_CODEGEN
+//from templategen, see CMakeLists.txt
+extern template_compiled compiled_templates[];
+extern unsigned long compiled_templates_len;
+#endif
+
+//NULL if it cant be read
+char* assets_read(char* path, unsigned long* len) {
+	FILE* f = fopen(path, "rb");
+	if (!f) return NULL;
+
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+
+	char* data = heap(*len+1);
+	fseek(f, 0, SEEK_SET);
+
+	if (fread(data, 1, *len, f) != *len) {
+		fclose(f);
+		drop(data);
+		return NULL;
+	}
+
+	data[*len] = 0;
+
+	fclose(f);
+	return data;
+}
+
+void assets_free(assets_t* assets) {
+	map_iterator iter = map_iterate(&assets->templates);
+	while (map_next(&iter)) {
+		template_t* template = iter.x;
+		vector_free(&template->text);
+		vector_free(&template->ops);
+	}
+
+	iter = map_iterate(&assets->resources);
+	while (map_next(&iter)) {
+		resource* res = iter.x;
+		drop(res->content);
+		if (res->gzip) drop(res->gzip);
+		if (res->br) drop(res->br);
+	}
+
+	map_free(&assets->templates);
+	map_free(&assets->resources);
+
+	if (assets->global) drop(assets->global);
+	drop(assets);
+}
+
+//NULL and a message if anything is missing or unreadable, the current set is kept then
+assets_t* assets_load(char* path) {
+	assets_t* assets = heap(sizeof(assets_t));
+	assets->global = NULL;
+	atomic_init(&assets->refs, 1);
+
+	assets->templates = map_new();
+	assets->templates.free = free_string;
+	map_configure_string_key(&assets->templates, sizeof(template_t));
+
+	assets->resources = map_new();
+	assets->resources.free = free_string;
+	map_configure_string_key(&assets->resources, sizeof(resource));
+
+	tinydir_dir dir;
+	if (tinydir_open(&dir, path) == -1) {
+		fprintf(stderr, "couldnt open templates directory %s\n", path);
+		assets_free(assets);
+		return NULL;
+	}
+
+	for (;dir.has_next; tinydir_next(&dir)) {
+		tinydir_file file;
+		tinydir_readfile(&dir, &file);
+
+		if (file.is_dir || file.name[0] == '.') continue;
+
+		unsigned long len;
+		char* data = assets_read(file.path, &len);
+
+		if (!data) {
+			fprintf(stderr, "couldnt read %s\n", file.path);
+			continue;
+		}
+
+		char* filename = heapcpystr(file.name);
+
+		if (strlen(filename) > strlen(TEMPLATE_EXT) &&
+				strcmp(filename + strlen(filename) - strlen(TEMPLATE_EXT),
+							 TEMPLATE_EXT) == 0) {
+			memset(filename + strlen(filename) - strlen(TEMPLATE_EXT), 0,
+						 strlen(TEMPLATE_EXT));
+
+			if (strcmp(filename, GLOBAL_TEMPLATE) == 0) {
+				//split around the title and content, pages are written around them
+				char* title = strstr(data, "%s");
+				char* content = title ? strstr(title+2, "%s") : NULL;
+
+				drop(filename);
+
+				if (!content) {
+					fprintf(stderr, "global template needs a title and content\n");
+					drop(data);
+					continue;
+				}
+
+				assets->global = data;
+				assets->global_len = title - data;
+				assets->global_mid = title+2;
+				assets->global_mid_len = content - (title+2);
+				assets->global_tail = content+2;
+				assets->global_tail_len = strlen(content+2);
+			} else {
+				template_t template = template_new(data);
+
+#ifdef TEMPLATE_CODEGEN
+				//generated functions replace the interpreter unless the template changed since the build
+				uint64_t hash = template_hash(data);
+
+				for (unsigned long i=0; i<compiled_templates_len; i++) {
+					template_compiled* compiled = &compiled_templates[i];
+
+					if (strcmp(compiled->name, filename)==0 && compiled->hash == hash) {
+						template.length = compiled->length;
+						template.run = compiled->run;
+					}
+				}
+#endif
+
+				map_insertcpy(&assets->templates, &filename, &template);
+				drop(data);
+			}
+		} else {
+			char* extension = ext(filename);
+			char* mime;
+
+			if (strcmp(extension, ".css") == 0) {
+				mime = "text/css";
+			} else if (strcmp(extension, ".png") == 0) {
+				mime = "image/png";
+			} else if (strcmp(extension, ".ico") == 0) {
+				mime = "image/x-icon";
+			} else {
+				mime = "application/octet-stream";
+			}
+
+			resource res = {.content = data, .len = len, .mime = mime};
+			resource_compress(&res);
+
+			map_insertcpy(&assets->resources, &filename, &res);
+		}
+	}
+
+	tinydir_close(&dir);
+
+	if (!assets->global) {
+		fprintf(stderr, "no usable global template in %s\n", path);
+		assets_free(assets);
+		return NULL;
+	}
+
+	return assets;
+}
+
+void assets_release(assets_t* assets) {
+	if (atomic_fetch_sub(&assets->refs, 1) == 1) assets_free(assets);
+}
+
+//evbuffer cleanup for referenced resource content
+void assets_release_ref(const void* data, size_t len, void* arg) {
+	assets_release(arg);
+}
+
+//current set, valid until assets_read_unlock, never blocks
+assets_t* assets_read_lock(ctx_t* ctx) {
+	rcu_read_lock(&ctx->rcu);
+	return atomic_load(&ctx->assets);
+}
+
+void assets_read_unlock(ctx_t* ctx) {
+	rcu_read_unlock(&ctx->rcu);
+}
+
+//new pages for every cached etag, the old set is freed once no reader or response holds it
+void assets_swap(ctx_t* ctx, assets_t* assets) {
+	assets_t* old = atomic_exchange(&ctx->assets, assets);
+
+	unsigned long version = (unsigned long)time(NULL);
+	unsigned long prev = atomic_load(&ctx->page_version);
+	while (!atomic_compare_exchange_weak(&ctx->page_version, &prev, version > prev ? version : prev+1));
+
+	rcu_synchronize(&ctx->rcu);
+	assets_release(old);
+}
+
+//reloads everything after changes settle, runs for the life of the process
+int assets_watch(void* udata) {
+	ctx_t* ctx = udata;
+
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd == -1 || inotify_add_watch(fd, ctx->assets_path,
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE) == -1) {
+		perror("couldnt watch templates, reload disabled");
+		return 1;
+	}
+
+	_Alignas(struct inotify_event) char buf[4096];
+
+	while (1) {
+		if (read(fd, buf, sizeof(buf)) <= 0) continue;
+
+		//drain the burst
+		struct pollfd pfd = {.fd=fd, .events=POLLIN};
+		while (poll(&pfd, 1, ASSETS_SETTLE) > 0) {
+			if (read(fd, buf, sizeof(buf)) <= 0) break;
+		}
+
+		assets_t* assets = assets_load(ctx->assets_path);
+		if (!assets) {
+			fprintf(stderr, "reload failed, keeping current templates\n");
+			continue;
+		}
+
+		assets_swap(ctx, assets);
+		printf("reloaded templates\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,30 @@
+// Automatically generated header.
+
+#pragma once
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "tinydir.h"
+#include "util.h"
+#include "vector.h"
+#include "hashtable.h"
+#include "template.h"
+#include "context.h"
+#include "web.h"
+#include "rcu.h"
+#define ASSETS_SETTLE 100 //ms without events before reloading, editors write in bursts
+extern char* TEMPLATE_EXT;
+void assets_free(assets_t* assets);
+assets_t* assets_load(char* path);
+void assets_release(assets_t* assets);
+void assets_release_ref(const void* data, size_t len, void* arg);
+assets_t* assets_read_lock(ctx_t* ctx);
+void assets_read_unlock(ctx_t* ctx);
+void assets_swap(ctx_t* ctx, assets_t* assets);
+int assets_watch(void* udata);
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdio.h>
 #include <threads.h>
 #include <time.h>
 #include <stdatomic.h>
@@ -10,16 +11,22 @@
 #include "hashtable.h"
 #include "locktable.h"
 #include "vector.h"
+#include "arena.h"
+#include "accesslog.h"
+#include "rcu.h"
+#include "pagecache.h"
+#include "textcache.h"
 #include "filemap.h"
 
 const char* ERROR_TEMPLATE = "error"; //name of error template
 const char* GLOBAL_TEMPLATE = "global"; //name of global template
 #define CONTENT_MAX 50*1024*1024 //50 mb
+#define FIELD_MAX 64*1024 //multipart fields that arent files
+#define RESOURCE_CACHE "public, max-age=604800" //a week, revalidated by etag after
+#define RANGES_MAX 16 //per request, more and the whole body is sent
 #define SESSION_TIMEOUT 3600*24*60 //60 days
 #define CLEANUP_INTERVAL 24*3600
 #define WCACHE_INTERVAL 5*60
-#define CACHE_EXPIRY 3600 //seconds after which to expire cache's weighting 
-#define CACHE_MIN 1000 //accesses per hour to qualify in cache
 #define AUTH_KEYSZ 128
 
 #define PAGE_SIZE 12
@@ -30,6 +37,10 @@ const char* GLOBAL_TEMPLATE = "global"; //name of global template
 #define WORD_LOCKS 32
 #define QUERY_MAX 32
 
+#define WORKERS 4 //threads running route handlers off the event loops
+#define PAGECACHE_BUDGET 64*1024*1024 //rendered article bodies
+#define TEXTCACHE_BUDGET 32*1024*1024 //current article text
+
 #define SECRET_PATH "secret"
 
 typedef enum {GET, POST} method_t;
@@ -40,10 +51,19 @@ typedef struct {
 	char* name;
 	char* mime;
 
-	char* content;
+	char* content; //fields without a mime are kept in memory
+	char* spill; //files go to a temporary in DATA_PATH, NULL once renamed into place
 	unsigned long len;
 } multipart_data;
 
+typedef enum {
+	multipart_preamble,
+	multipart_delim, //after a boundary, either --/end or a newline
+	multipart_headers,
+	multipart_body,
+	multipart_epilogue
+} multipart_state;
+
 typedef struct {
 	method_t method;
 
@@ -57,12 +77,28 @@ typedef struct {
 	unsigned long content_length;
 	content_type ctype;
 	char* content;
+
+	arena_t arena; //strings above, freed with the request
+	char* target; //path as requested, without the query
+	struct timespec start; //request line arrived, for the access log
+
+	//parse errors are queued like requests so they go out in order, 0 otherwise
+	int err_stat;
+	char* err;
 } request;
 
 typedef struct {
 	char* mime;
 	char* content;
 	unsigned long len;
+
+	//precompressed at startup, NULL if not worth it
+	char* gzip;
+	unsigned long gzip_len;
+	char* br;
+	unsigned long br_len;
+
+	char etag[12]; //quoted crc of the content
 } resource;
 
 typedef struct {
@@ -105,23 +141,37 @@ typedef struct __attribute__((__packed__)) {
 	article_tok tok[WORD_LIMIT];
 } word_index;
 
+//everything read from the templates directory, replaced as a whole when it changes
 typedef struct {
-	atomic_ulong accessors;
-	atomic_ulong accesses;
-	time_t first_cache;
+	//global template split at load around the title and content
+	char* global; //up to the title
+	unsigned long global_len;
+	char* global_mid; //between the title and content
+	unsigned long global_mid_len;
+	char* global_tail; //after the content
+	unsigned long global_tail_len;
+	map_t templates;
+	map_t resources; //without slashes
 
-	char* data;
-	unsigned long len;
-} cached;
+	atomic_ulong refs; //responses referencing resource content, plus one while current
+} assets_t;
 
 typedef struct {
-	struct event_base *evbase;
+	mtx_t lock;
+	cnd_t cnd;
 
-	char* global;
-	map_t templates;
-	map_t resources; //without slashes
+	vector_t queue; //work_t, fifo
+	vector_t threads; //thrd_t
+	int stop;
+} workqueue_t;
+
+typedef struct {
+	struct event_base *evbase;
+	vector_t reactors; //reactor_t*, first shares evbase with main loop
 
-	EVP_MD_CTX* digest_ctx;
+	char* assets_path; //watched for changes
+	_Atomic(assets_t*) assets; //read under rcu, see assets_read_lock
+	rcu_t rcu;
 
 	filemap_t user_fmap;
 	filemap_list_t user_id;
@@ -148,9 +198,24 @@ typedef struct {
 
 	map_t article_lock;
 
-	map_t cached; //maps to file name of cached portion
+	textcache_t cached; //current article text by file name
+
+	atomic_ulong page_version; //part of page etags, changes when templates do
+	pagecache_t pages; //rendered article bodies, see pagecache.c
+
+	workqueue_t work;
+	accesslog_t log;
 } ctx_t;
 
+//one event loop and listener per thread, kernel balances with SO_REUSEPORT
+typedef struct {
+	ctx_t* ctx;
+
+	struct event_base* evbase;
+	struct evconnlistener* listener;
+	thrd_t thread;
+} reactor_t;
+
 typedef struct {
 	ctx_t *ctx;
 	struct bufferevent *bev; //buffered socket
@@ -165,15 +230,39 @@ typedef struct {
 		char has_content;
 		char content_parsing; //set after first newline
 
-		char* multipart_boundary;
+		char* multipart_boundary; //\r\n--boundary, first one may come without the newline
+
+		//incremental multipart state, content is never held whole
+		multipart_state mstate;
+		unsigned long remaining; //unread content
+		multipart_data part; //current part, pushed to req.files when its boundary is found
+		FILE* spill;
+		vector_t field;
 
 		request req;
 	} parser;
 
-	vector_t requests;
+	mtx_t lock; //guards requests, busy and closed between event loop and workers
+	vector_t requests; //parsed, not yet handed to a worker
+	char busy; //a request is being routed, later ones wait to keep responses in order
+	char continue_pending; //100 continue owed to the request being read, sent when nothing is ahead of it
 	int closed;
+
+	atomic_ulong refs; //connection and in flight work
+
+	struct sockaddr_storage addr; //peer, resolved when the log is written
+	socklen_t addrlen;
+
+	//last response, logged once its request is handled
+	atomic_int status;
+	atomic_ulong bytes;
 } session_t;
 
+typedef struct {
+	session_t* session;
+	request req;
+} work_t;
+
 void uses_free(user_session* uses) {
 	mtx_destroy(&uses->lock);
 	drop(uses);
@@ -211,97 +300,6 @@ void cleanup_sessions(ctx_t* ctx) {
 	}
 }
 
-cached* ctx_cache_find(ctx_t* ctx, char* name) {
-	rwlock_read(ctx->cached.lock);
-	cached* cache = map_find_unlocked(&ctx->cached, &name);
-	
-	if (cache) atomic_fetch_add(&cache->accessors, 1);
-	rwlock_unread(ctx->cached.lock);
-	
-	return cache;
-}
-
-cached* ctx_cache_new(ctx_t* ctx, char* name, char* data, unsigned long len) {
-	cached new = {.data=data, .len=len};
-	new.first_cache = time(NULL);
-	atomic_init(&new.accesses, 0);
-	atomic_init(&new.accessors, 1);
-
-	map_insert_result insres = map_insertcpy_noexist(&ctx->cached, &name, &new);
-
-	//in case of high traffic, use map lock as synchronization
-	//hah! high traffic!??! never lmao
-	if (insres.exists) {
-		drop(data);
-		drop(name);
-	}
-
-	return insres.val;
-	//oh boy i am much pious with my shitey sitey
-}
-
-void ctx_cache_done(ctx_t* ctx, cached* cache, char* name) {
-	time_t t = time(NULL);
-
-	unsigned long accs = atomic_fetch_add(&cache->accesses, 1)+1;
-
-	int delete = accs*3600/difftime(t, cache->first_cache) < CACHE_MIN;
-	if (delete) rwlock_write(ctx->cached.lock);
-	
-	unsigned long acc = atomic_fetch_sub(&cache->accessors, 1);
-
-	//small race...
-	if (acc == 1 && difftime(t, cache->first_cache) >= CACHE_EXPIRY) {
-		cache->first_cache = t;
-		atomic_store(&cache->accesses, 1);
-
-	} else if (delete && acc==1) {
-		drop(cache->data);
-		map_remove_unlocked(&ctx->cached, &name);
-	}
-	
-	if (delete) rwlock_unwrite(ctx->cached.lock);
-}
-
-void ctx_cache_remove(ctx_t* ctx, char* name) {
-	cached* cache = map_find(&ctx->cached, &name);
-	if (cache) {
-		atomic_fetch_add(&cache->accessors, 1);
-
-		rwlock_write(ctx->cached.lock);
-		unsigned long acc = atomic_fetch_sub(&cache->accessors, 1);
-
-		if (acc == 1) {
-			drop(cache->data);
-			map_remove_unlocked(&ctx->cached, &name);
-		}
-		
-		rwlock_unwrite(ctx->cached.lock);
-	}
-}
-
-cached* ctx_fopen(ctx_t* ctx, char* name) {
-	cached* cache = ctx_cache_find(ctx, name);
-
-	if (!cache) {
-		FILE* f = fopen(name, "r");
-		if (!f) return NULL;
-		
-		fseek(f, 0, SEEK_END);
-		unsigned long len = ftell(f);
-
-		char* data = heap(len);
-		fseek(f, 0, SEEK_SET);
-		fread(data, len, 1, f);
-
-		fclose(f);
-
-		cache = ctx_cache_new(ctx, heapcpystr(name), data, len);
-	}
-
-	return cache;
-}
-
 //lock by key, to ensure it is one to one with list index
 void lock_article(ctx_t* ctx, char* path, unsigned long sz) {
 	//read lock
@@ -354,6 +352,18 @@ typedef struct __attribute__((__packed__)) {
 
 typedef filemap_object filemap_object;
 
+//digest contexts arent thread safe, so make one per hash
+void hash_password(char* password, int32_t salt, unsigned char* hash) {
+	EVP_MD_CTX* digest_ctx = EVP_MD_CTX_create();
+
+	EVP_DigestInit_ex(digest_ctx, EVP_sha256(), NULL);
+	EVP_DigestUpdate(digest_ctx, password, strlen(password));
+	EVP_DigestUpdate(digest_ctx, &salt, 4);
+
+	EVP_DigestFinal_ex(digest_ctx, hash, NULL);
+	EVP_MD_CTX_destroy(digest_ctx);
+}
+
 char* user_password_error(char* password) {
 	if (strlen(password) < MIN_PASSWORD)
 		return "Password have at least four characters";
@@ -2,6 +2,7 @@
 
 #pragma once
 #include <stdint.h>
+#include <stdio.h>
 #include <threads.h>
 #include <time.h>
 #include <stdatomic.h>
@@ -10,9 +11,17 @@
 #include "hashtable.h"
 #include "locktable.h"
 #include "vector.h"
+#include "arena.h"
+#include "accesslog.h"
+#include "rcu.h"
+#include "pagecache.h"
+#include "textcache.h"
 extern char* ERROR_TEMPLATE;
 extern char* GLOBAL_TEMPLATE;
 #define CONTENT_MAX 50*1024*1024 //50 mb
+#define FIELD_MAX 64*1024 //multipart fields that arent files
+#define RESOURCE_CACHE "public, max-age=604800" //a week, revalidated by etag after
+#define RANGES_MAX 16 //per request, more and the whole body is sent
 #define CLEANUP_INTERVAL 24*3600
 #define WCACHE_INTERVAL 5*60
 #define AUTH_KEYSZ 128
@@ -22,6 +31,9 @@ extern char* GLOBAL_TEMPLATE;
 #define WORD_LIMIT 64 //articles per word before overflow
 #define WORD_LOCKS 32
 #define QUERY_MAX 32
+#define WORKERS 4 //threads running route handlers off the event loops
+#define PAGECACHE_BUDGET 64*1024*1024 //rendered article bodies
+#define TEXTCACHE_BUDGET 32*1024*1024 //current article text
 #define SECRET_PATH "secret"
 typedef enum {GET, POST} method_t;
 typedef enum {url_formdata, multipart_formdata} content_type;
@@ -29,9 +41,18 @@ typedef struct {
 	char* name;
 	char* mime;
 
-	char* content;
+	char* content; //fields without a mime are kept in memory
+	char* spill; //files go to a temporary in DATA_PATH, NULL once renamed into place
 	unsigned long len;
 } multipart_data;
+
+typedef enum {
+	multipart_preamble,
+	multipart_delim, //after a boundary, either --/end or a newline
+	multipart_headers,
+	multipart_body,
+	multipart_epilogue
+} multipart_state;
 typedef struct {
 	method_t method;
 
@@ -45,11 +66,27 @@ typedef struct {
 	unsigned long content_length;
 	content_type ctype;
 	char* content;
+
+	arena_t arena; //strings above, freed with the request
+	char* target; //path as requested, without the query
+	struct timespec start; //request line arrived, for the access log
+
+	//parse errors are queued like requests so they go out in order, 0 otherwise
+	int err_stat;
+	char* err;
 } request;
 typedef struct {
 	char* mime;
 	char* content;
 	unsigned long len;
+
+	//precompressed at startup, NULL if not worth it
+	char* gzip;
+	unsigned long gzip_len;
+	char* br;
+	unsigned long br_len;
+
+	char etag[12]; //quoted crc of the content
 } resource;
 #include "filemap.h"
 typedef struct {
@@ -85,22 +122,35 @@ typedef struct __attribute__((__packed__)) {
 typedef struct __attribute__((__packed__)) {
 	article_tok tok[WORD_LIMIT];
 } word_index;
+//everything read from the templates directory, replaced as a whole when it changes
 typedef struct {
-	atomic_ulong accessors;
-	atomic_ulong accesses;
-	time_t first_cache;
+	//global template split at load around the title and content
+	char* global; //up to the title
+	unsigned long global_len;
+	char* global_mid; //between the title and content
+	unsigned long global_mid_len;
+	char* global_tail; //after the content
+	unsigned long global_tail_len;
+	map_t templates;
+	map_t resources; //without slashes
 
-	char* data;
-	unsigned long len;
-} cached;
+	atomic_ulong refs; //responses referencing resource content, plus one while current
+} assets_t;
 typedef struct {
-	struct event_base *evbase;
+	mtx_t lock;
+	cnd_t cnd;
 
-	char* global;
-	map_t templates;
-	map_t resources; //without slashes
+	vector_t queue; //work_t, fifo
+	vector_t threads; //thrd_t
+	int stop;
+} workqueue_t;
+typedef struct {
+	struct event_base *evbase;
+	vector_t reactors; //reactor_t*, first shares evbase with main loop
 
-	EVP_MD_CTX* digest_ctx;
+	char* assets_path; //watched for changes
+	_Atomic(assets_t*) assets; //read under rcu, see assets_read_lock
+	rcu_t rcu;
 
 	filemap_t user_fmap;
 	filemap_list_t user_id;
@@ -127,8 +177,21 @@ typedef struct {
 
 	map_t article_lock;
 
-	map_t cached; //maps to file name of cached portion
+	textcache_t cached; //current article text by file name
+
+	atomic_ulong page_version; //part of page etags, changes when templates do
+	pagecache_t pages; //rendered article bodies, see pagecache.c
+
+	workqueue_t work;
+	accesslog_t log;
 } ctx_t;
+typedef struct {
+	ctx_t* ctx;
+
+	struct event_base* evbase;
+	struct evconnlistener* listener;
+	thrd_t thread;
+} reactor_t;
 typedef struct {
 	ctx_t *ctx;
 	struct bufferevent *bev; //buffered socket
@@ -143,21 +206,39 @@ typedef struct {
 		char has_content;
 		char content_parsing; //set after first newline
 
-		char* multipart_boundary;
+		char* multipart_boundary; //\r\n--boundary, first one may come without the newline
+
+		//incremental multipart state, content is never held whole
+		multipart_state mstate;
+		unsigned long remaining; //unread content
+		multipart_data part; //current part, pushed to req.files when its boundary is found
+		FILE* spill;
+		vector_t field;
 
 		request req;
 	} parser;
 
-	vector_t requests;
+	mtx_t lock; //guards requests, busy and closed between event loop and workers
+	vector_t requests; //parsed, not yet handed to a worker
+	char busy; //a request is being routed, later ones wait to keep responses in order
+	char continue_pending; //100 continue owed to the request being read, sent when nothing is ahead of it
 	int closed;
+
+	atomic_ulong refs; //connection and in flight work
+
+	struct sockaddr_storage addr; //peer, resolved when the log is written
+	socklen_t addrlen;
+
+	//last response, logged once its request is handled
+	atomic_int status;
+	atomic_ulong bytes;
 } session_t;
+typedef struct {
+	session_t* session;
+	request req;
+} work_t;
 void uses_free(user_session* uses);
 void cleanup_sessions(ctx_t* ctx);
-cached* ctx_cache_find(ctx_t* ctx, char* name);
-cached* ctx_cache_new(ctx_t* ctx, char* name, char* data, unsigned long len);
-void ctx_cache_done(ctx_t* ctx, cached* cache, char* name);
-void ctx_cache_remove(ctx_t* ctx, char* name);
-cached* ctx_fopen(ctx_t* ctx, char* name);
 void lock_article(ctx_t* ctx, char* path, unsigned long sz);
 void unlock_article(ctx_t* ctx, char* path, unsigned long sz);
 #define PERMS_CREATE 1
@@ -173,6 +254,7 @@ typedef struct __attribute__((__packed__)) {
 	unsigned char perms;
 } userdata_t;
 typedef filemap_object filemap_object;
+void hash_password(char* password, int32_t salt, unsigned char* hash);
 char* user_password_error(char* password);
 char* user_error(char* username, char* email);
 int setrank(ctx_t* ctx, filemap_partial_object* list_user, filemap_object* user, unsigned char maxperm, unsigned char setperm);
@@ -18,11 +18,10 @@
 #include "web.h"
 #include "router.h"
 #include "wiki.h"
+#include "assets.h"
 
 ctx_t* global_ctx;
 
-const char* TEMPLATE_EXT = ".html";
-
 void save_ctx(ctx_t* ctx) {
 	printf("Saving...\n");
 	filemap_free(&ctx->user_fmap);
@@ -68,6 +67,324 @@ void sighandler(int sig, siginfo_t* info, void* arg) {
 	save_ctx(global_ctx);
 }
 
+//find_changes on a synthetic article of lines lines, with about edits lines replaced, inserted or removed
+void diff_bench(unsigned long lines, unsigned long edits) {
+	vector_t from = vector_new(1);
+	vector_t to = vector_new(1);
+
+	srand(1);
+	for (unsigned long i=0; i<lines; i++) {
+		char* line = heapstr("line %lu of the article, %d\n", i, rand());
+		vector_stockstr(&from, line);
+
+		if ((unsigned long)rand() % lines < edits) {
+			switch (rand()%3) {
+				case 0: break;
+				case 1: vector_stockstr(&to, line); //fallthrough
+				default: {
+					char* changed = heapstr("changed %d\n", rand());
+					vector_stockstr(&to, changed);
+					drop(changed);
+				}
+			}
+		} else {
+			vector_stockstr(&to, line);
+		}
+
+		drop(line);
+	}
+
+	vector_pushcpy(&from, "\0");
+	vector_pushcpy(&to, "\0");
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	diff_t d = find_changes(from.data, to.data);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	char* applied = diff_apply(from.data, &d);
+	int ok = strcmp(applied, to.data)==0;
+
+	printf("%lu lines, %lu additions and %lu deletions in %.2fms%s\n", lines, d.additions.length, d.deletions.length,
+		(double)(end.tv_sec-start.tv_sec)*1e3 + (double)(end.tv_nsec-start.tv_nsec)/1e6, ok ? "" : ", DOES NOT APPLY");
+
+	drop(applied);
+	diff_free(&d);
+	vector_free(&from);
+	vector_free(&to);
+}
+
+//render_article on a synthetic article of about kb kilobytes, with every kind of markup in it
+void render_bench(ctx_t* ctx, unsigned long kb) {
+	vector_t src = vector_new(1);
+
+	srand(1);
+	for (unsigned long i=0; src.length < kb*1024; i++) {
+		char* para;
+
+		switch (rand()%6) {
+			case 0: para = heapstr("# heading %lu\n", i); break;
+			case 1: para = heapstr("some *bold text %d* with \"quotes\" & <brackets>\n\n", rand()); break;
+			case 2: para = heapstr("links to [https://example.com/%d] and [!bench/page %c]\n\n", rand(), 'a'+rand()%26); break;
+			case 3: para = heapstr("```\nif (x < %d && y > 0) return;\n```\n", rand()); break;
+			default: para = heapstr("paragraph %lu of the article, %d and some plain words after it\n\n", i, rand());
+		}
+
+		vector_stockstr(&src, para);
+		drop(para);
+	}
+
+	vector_pushcpy(&src, "\0");
+
+	char* html = heapcpystr(src.data);
+	vector_t refs = vector_new(sizeof(vector_t));
+	vector_t words = vector_new(sizeof(search_token));
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int col = render_article(ctx, &html, 1, &refs, &words);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double ms = (double)(end.tv_sec-start.tv_sec)*1e3 + (double)(end.tv_nsec-start.tv_nsec)/1e6;
+	printf("%lu bytes rendered to %lu in %.2fms (%.1f MB/s), %lu refs and %lu words%s\n", src.length-1, strlen(html), ms,
+		(double)(src.length-1)/1e3/ms, refs.length, words.length, col ? ", SYNTAX ERROR" : "");
+
+	drop(html);
+	refs_free(&refs);
+	vector_free(&refs);
+	article_words_free(&words);
+	vector_free(&src);
+}
+
+double ms_since(struct timespec* start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (double)(end.tv_sec-start->tv_sec)*1e3 + (double)(end.tv_nsec-start->tv_nsec)/1e6;
+}
+
+//byte at a time versions of the escaping in web.c, what the block scans are measured against
+unsigned long escape_bytewise(char* str, char* out) {
+	unsigned long len = 0;
+
+	for (; *str; str++) {
+		char* entity = html_entity(*str);
+
+		if (entity) {
+			memcpy(out+len, entity, strlen(entity));
+			len += strlen(entity);
+		} else {
+			out[len++] = *str;
+		}
+	}
+
+	return len;
+}
+
+char* percent_encode_bytewise(char* data, unsigned long sz) {
+	char* buffer = heap(sz*3+1);
+	char* cursor = buffer;
+
+	for (char* end = data+sz; data < end; data++) {
+		if (*data == ' ') {
+			*cursor++ = '+';
+		} else if (*data < 33 || *data > 126 || strchr("%+\",;\\", *data)) {
+			*cursor++ = '%';
+			charhex((unsigned char)*data, cursor);
+			cursor += 2;
+		} else {
+			*cursor++ = *data;
+		}
+	}
+
+	*cursor = 0;
+	return buffer;
+}
+
+unsigned long percent_decode_bytewise(char* data, char* out) {
+	unsigned long len = 0;
+
+	for (; *data; data++) {
+		if (*data == '+') {
+			out[len++] = ' ';
+		} else if (*data == '%' && data[1] && data[2]) {
+			out[len++] = (char)(hexchar(data[1])*16 + hexchar(data[2]));
+			data += 2;
+		} else {
+			out[len++] = *data;
+		}
+	}
+
+	out[len] = 0;
+	return len;
+}
+
+//html escaping of an article body and percent coding of a form post, both about mb megabytes
+void escape_bench(unsigned long mb) {
+	unsigned long len = mb*1024*1024;
+
+	//both prose with the odd quote, ampersand or tag in the body and punctuation in the form, as a textarea would send it
+	char* body = heap(len+1);
+	char* form = heap(len+1);
+
+	srand(1);
+	for (unsigned long i=0; i<len; i++) {
+		int r = rand();
+		body[i] = r%64==0 ? "<>&\"'"[r/64%5] : (r%7==0 ? ' ' : (char)('a' + r/7%26));
+		form[i] = r%7==0 ? ' ' : (r%97==0 ? "!,;&=/?%"[r/97%8] : (char)('a' + r/7%26));
+	}
+
+	body[len] = 0;
+	form[len] = 0;
+
+	struct timespec start;
+
+	//as templates do it, sized first then written
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	unsigned long escaped_len = escaped_length(body, body+len);
+	char* escaped = heap(escaped_len+1);
+
+	template_out out = {.vec={{.iov_base=escaped, .iov_len=escaped_len}}, .vec_len=1};
+	template_escape(&out, body);
+	double escape_ms = ms_since(&start);
+
+	char* escaped_ref = heap(len*6+1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	unsigned long escaped_ref_len = escape_bytewise(body, escaped_ref);
+	double escape_ref_ms = ms_since(&start);
+
+	int escape_ok = escaped_len == escaped_ref_len && memcmp(escaped, escaped_ref, escaped_len)==0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	char* encoded = percent_encode(form, len);
+	double encode_ms = ms_since(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	char* encoded_ref = percent_encode_bytewise(form, len);
+	double encode_ref_ms = ms_since(&start);
+
+	int encode_ok = strcmp(encoded, encoded_ref)==0;
+	unsigned long encoded_len = strlen(encoded);
+
+	//decoded in place like query strings are, so each gets its own copy
+	char* decoded_ref = heapcpystr(encoded);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	percent_decode_to(encoded, encoded);
+	double decode_ms = ms_since(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	percent_decode_bytewise(decoded_ref, decoded_ref);
+	double decode_ref_ms = ms_since(&start);
+
+	int decode_ok = strcmp(encoded, decoded_ref)==0 && strcmp(encoded, form)==0;
+
+	printf("escape %lu bytes in %.2fms, byte at a time %.2fms%s\n", len, escape_ms, escape_ref_ms, escape_ok ? "" : ", DOES NOT MATCH");
+	printf("encode %lu bytes in %.2fms, byte at a time %.2fms%s\n", len, encode_ms, encode_ref_ms, encode_ok ? "" : ", DOES NOT MATCH");
+	printf("decode %lu bytes in %.2fms, byte at a time %.2fms%s\n", encoded_len, decode_ms, decode_ref_ms, decode_ok ? "" : ", DOES NOT MATCH");
+
+	drop(body);
+	drop(form);
+	drop(escaped);
+	drop(escaped_ref);
+	drop(encoded);
+	drop(encoded_ref);
+	drop(decoded_ref);
+}
+
+//the home page with a directory of items entries and a text article, both through page_render like the routes
+//the home page with a directory of items entries and a text article, both through page_render like the routes
+//loop arguments are freed by the render, so they are built again each time as the routes do
+void template_bench(ctx_t* ctx, unsigned long items, unsigned long iters) {
+	int* is_group = heap(sizeof(int)*(items+1));
+	char* (*item_strs)[2] = heap(sizeof(char*[2])*(items+1));
+
+	for (unsigned long i=0; i<items; i++) {
+		is_group[i] = i%4==0;
+		item_strs[i][0] = heapstr("/wiki/bench/item %lu", i);
+		item_strs[i][1] = heapstr("item \"%lu\" & <more>", i);
+	}
+
+	char* path[3][2] = {{"/wiki/bench", "bench"}, {"/wiki/bench/group", "group"}, {"/wiki/bench/group/article", "article"}};
+	char* contribs[4] = {"alice", "bob", "carol <admin>", "dave"};
+
+	//rendered article html is substituted raw, so its length is what matters
+	vector_t html = vector_new(1);
+	while (html.length < 16*1024) vector_stockstr(&html, "<p>a paragraph of <b>rendered</b> article text</p>\n");
+	vector_pushcpy(&html, "\0");
+
+	char* names[2] = {"home", "article"};
+	for (int t=0; t<2; t++) {
+		unsigned long bytes = 0;
+
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (unsigned long i=0; i<iters; i++) {
+			unsigned long len;
+			char* page;
+
+			if (t==0) {
+				vector_t items_arg = vector_new(sizeof(template_args));
+				for (unsigned long j=0; j<items; j++)
+					vector_pushcpy(&items_arg, &(template_args){.cond_args=&is_group[j], .sub_args=item_strs[j]});
+
+				page = page_render(ctx, "home", "ranch", NULL, &len, 1, 1, &items_arg, "bench user");
+				if (!page) vector_free(&items_arg);
+			} else {
+				vector_t path_arg = vector_new(sizeof(template_args));
+				for (int j=0; j<3; j++) vector_pushcpy(&path_arg, &(template_args){.sub_args=path[j]});
+
+				vector_t contribs_arg = vector_new(sizeof(template_args));
+				for (int j=0; j<4; j++) vector_pushcpy(&contribs_arg, &(template_args){.sub_args=&contribs[j]});
+
+				page = page_render(ctx, "article", "article", NULL, &len, 1, 0, &path_arg, &contribs_arg,
+					"article", html.data, "bench/group/article", "");
+
+				if (!page) {
+					vector_free(&path_arg);
+					vector_free(&contribs_arg);
+				}
+			}
+
+			if (!page) {
+				fprintf(stderr, "no %s template\n", names[t]);
+				break;
+			}
+
+			bytes += len;
+			drop(page);
+		}
+
+		double ms = ms_since(&start);
+		printf("%s: %lu renders of %lu bytes in %.2fms, %.2fus each\n", names[t], iters,
+			iters ? bytes/iters : 0, ms, iters ? ms*1e3/(double)iters : 0);
+	}
+
+	for (unsigned long i=0; i<items; i++) {
+		drop(item_strs[i][0]);
+		drop(item_strs[i][1]);
+	}
+
+	drop(is_group);
+	drop(item_strs);
+	vector_free(&html);
+}
+
+#define CONSOLE_HELP \
+	"rank <user> <perms>\n" \
+	"rankall <perms>\n" \
+	"diff <path> <max diffs>\n" \
+	"bench-diff <lines> <edits>\n" \
+	"bench-render <kb>\n" \
+	"bench-escape <mb>\n" \
+	"bench-templates <items> <iterations>\n" \
+	"caches\n" \
+	"arena\n" \
+	"quit\n"
+
 int util_main(void* udata) {
 	printf("util started\n");
 
@@ -135,7 +452,7 @@ int util_main(void* udata) {
 			vector_t wpath = flatten_wikipath(&path);
 			vector_free_strings(&path);
 			
-			text_t txt = txt_new(wpath.data);
+			text_t txt = txt_open(wpath.data);
 			read_txt(&txt, 0, maxd);
 			
 			if (!txt.current) {
@@ -183,10 +500,31 @@ int util_main(void* udata) {
 			vector_free(&segs);
 			vector_free(&wpath);
 			
+		} else if (strcmp(vector_getstr(&arg, 0), "bench-diff")==0 && arg.length==3) {
+			diff_bench(strtoul(vector_getstr(&arg, 1), NULL, 10), strtoul(vector_getstr(&arg, 2), NULL, 10));
+
+		} else if (strcmp(vector_getstr(&arg, 0), "bench-render")==0 && arg.length==2) {
+			render_bench(ctx, strtoul(vector_getstr(&arg, 1), NULL, 10));
+
+		} else if (strcmp(vector_getstr(&arg, 0), "bench-escape")==0 && arg.length==2) {
+			escape_bench(strtoul(vector_getstr(&arg, 1), NULL, 10));
+
+		} else if (strcmp(vector_getstr(&arg, 0), "bench-templates")==0 && arg.length==3) {
+			template_bench(ctx, strtoul(vector_getstr(&arg, 1), NULL, 10), strtoul(vector_getstr(&arg, 2), NULL, 10));
+
+		} else if (strcmp(vector_getstr(&arg, 0), "caches")==0) {
+			pagecache_stats(&ctx->pages, stdout);
+			textcache_stats(&ctx->cached, stdout);
+
+		} else if (strcmp(vector_getstr(&arg, 0), "arena")==0) {
+			arena_stats(stdout);
+
 		} else if (strcmp(vector_getstr(&arg, 0), "quit")==0) {
 			event_base_loopbreak(ctx->evbase);
+		} else if (strcmp(vector_getstr(&arg, 0), "help")==0) {
+			printf("%s", CONSOLE_HELP);
 		} else {
-			fprintf(stderr, "Action %s not found\n", vector_getstr(&arg, 0));
+			fprintf(stderr, "Action %s not found, or wrong number of arguments (see help)\n", vector_getstr(&arg, 0));
 		}
 
 		vector_free(&arg);
@@ -196,6 +534,33 @@ int util_main(void* udata) {
 	return 0;
 }
 
+//converts older diff files under path, sidecars are skipped since article names cant have dots
+unsigned long convert_dir(char* path) {
+	unsigned long converted = 0;
+
+	tinydir_dir dir;
+	if (tinydir_open(&dir, path) == -1) {
+		fprintf(stderr, "couldnt open %s\n", path);
+		return 0;
+	}
+
+	for (;dir.has_next; tinydir_next(&dir)) {
+		tinydir_file file;
+		tinydir_readfile(&dir, &file);
+
+		if (file.name[0] == '.') continue;
+
+		if (file.is_dir) converted += convert_dir(file.path);
+		else if (!strchr(file.name, '.') && txt_convert(file.path)) {
+			printf("converted %s\n", file.path);
+			converted++;
+		}
+	}
+
+	tinydir_close(&dir);
+	return converted;
+}
+
 int main(int argc, char** argv) {
 	// filemap_t fmap = filemap_new("./test-fmap", 2, 1);
 	// filemap_ordered_list_t list =
@@ -241,12 +606,22 @@ int main(int argc, char** argv) {
 	setvbuf(stdout, NULL, _IOLBF, PIPE_BUF);
 	setvbuf(stderr, NULL, _IOLBF, PIPE_BUF); //needed for formatting for some reason, lest program crashes?? buf needs to match pipe buf??
 
+	//offline, nothing else may be writing to the files
+	if (argc > 1 && strcmp(argv[1], "--convert")==0) {
+		printf("converted %lu diff files\n", convert_dir(argc > 2 ? argv[2] : DATA_PATH));
+		return 0;
+	}
+
 	printf("starting ranch...\n");
 
 	if (argc < 3) {
-		errx(1, "need templates directory and port as arguments\n");
+		errx(1, "need templates directory and port as arguments, optionally number of event loops\n"
+			"or --convert and optionally a data directory to rewrite older diff files\n");
 	}
 
+	unsigned long reactors = argc > 3 ? strtoul(argv[3], NULL, 10) : 1;
+	if (reactors == 0) reactors = 1;
+
 	evthread_use_pthreads();
 
 	ctx_t ctx;
@@ -261,19 +636,11 @@ int main(int argc, char** argv) {
 	sigaction(SIGSEGV, &sact, NULL);
 	sigaction(SIGABRT, &sact, NULL);
 
-	ctx.digest_ctx = EVP_MD_CTX_create();
+	//pages from an earlier run may differ, bumped again when templates reload
+	atomic_init(&ctx.page_version, (unsigned long)time(NULL));
+	pagecache_init(&ctx.pages, PAGECACHE_BUDGET);
 
-	ctx.templates = map_new();
-	map_configure_string_key(&ctx.templates, sizeof(template_t));
-
-	ctx.resources = map_new();
-	map_configure_string_key(&ctx.resources, sizeof(resource));
-
-	ctx.cached = map_new();
-	ctx.cached.free = free_string;
-	
-	map_distribute(&ctx.cached);
-	map_configure_string_key(&ctx.cached, sizeof(cached));
+	textcache_init(&ctx.cached, TEXTCACHE_BUDGET);
 
 	// user, email, data, bio
 	ctx.user_id = filemap_list_new("./user_id", 0);
@@ -317,78 +684,29 @@ int main(int argc, char** argv) {
 
 	ctx.word_lock = locktable_new(WORD_LOCKS);
 	ctx.wordi_cache = map_new(sizeof(filemap_partial_object));
+	map_distribute(&ctx.wordi_cache); //shared between event loops
 	map_configure_string_key(&ctx.wordi_cache, sizeof(filemap_partial_object));
 
-	tinydir_dir dir;
-	tinydir_open(&dir, argv[1]);
+	//templates and resources, reloaded in the background when they change
+	ctx.assets_path = argv[1];
+	rcu_init(&ctx.rcu);
 
-	for (;dir.has_next; tinydir_next(&dir)) {
-		tinydir_file file;
-		tinydir_readfile(&dir, &file);
+	assets_t* assets = assets_load(argv[1]);
+	if (!assets) errx(1, "couldnt load templates from %s\n", argv[1]);
 
-		if (strcmp(file.name, ".")==0 || strcmp(file.name, "..")==0 || strcmp(file.name, "./")==0)
-			continue;
+	atomic_init(&ctx.assets, assets);
 
-		char* filename = heapcpystr(file.name);
-
-		//copypaste until C has tuples
-		FILE* f = fopen(file.path, "rb");
-		
-		fseek(f, 0, SEEK_END);
-		unsigned long len = ftell(f);
-
-		char* data = heap(len+1);
-		fseek(f, 0, SEEK_SET);
-		fread(data, len, 1, f);
-		
-		data[len] = 0;
-
-		fclose(f);
-
-		if (strlen(filename) > strlen(TEMPLATE_EXT) &&
-				strcmp(filename + strlen(filename) - strlen(TEMPLATE_EXT),
-							 TEMPLATE_EXT) == 0) {
-			memset(filename + strlen(filename) - strlen(TEMPLATE_EXT), 0,
-						 strlen(TEMPLATE_EXT));
-
-			if (strcmp(filename, GLOBAL_TEMPLATE) == 0) {
-				ctx.global = data;
-
-				drop(filename);
-			} else {
-				template_t template = template_new(data);
-				map_insertcpy(&ctx.templates, &filename, &template);
-				drop(data);
-			}
-		} else {
-			char* extension = ext(filename);
-			char* mime;
-
-			if (strcmp(extension, ".css") == 0) {
-				mime = "text/css";
-			} else if (strcmp(extension, ".png") == 0) {
-				mime = "image/png";
-			} else if (strcmp(extension, ".ico") == 0) {
-				mime = "image/x-icon";
-			} else {
-				mime = "application/octet-stream";
-			}
-
-			map_insertcpy(
-					&ctx.resources, &filename,
-					&(resource){
-							.content = data, .len = len, .mime = mime});
-		}
-	}
-
-	tinydir_close(&dir);
+	thrd_t watch;
+	thrd_create(&watch, assets_watch, &ctx);
 
 	printf("starting util...\n");
 
 	thrd_t util;
 	thrd_create(&util, util_main, &ctx);
 
-	start_listen(&ctx, argv[2]);
+	accesslog_start(&ctx.log, stdout);
+	start_workers(&ctx);
+	start_listen(&ctx, argv[2], reactors);
 
 	struct event* cleanup = event_new(ctx.evbase, -1, EV_PERSIST, cleanup_callback, &ctx);
 	event_add(cleanup, &(struct timeval){.tv_sec=CLEANUP_INTERVAL});
@@ -405,9 +723,12 @@ int main(int argc, char** argv) {
 #endif
 
 	event_base_loop(ctx.evbase, 0);
+
+	stop_listen(&ctx);
+	stop_workers(&ctx);
+	accesslog_stop(&ctx.log);
 	event_base_free(ctx.evbase);
 
-	EVP_MD_CTX_destroy(ctx.digest_ctx);
 	EVP_cleanup();
 
 	save_ctx(&ctx);
@@ -15,12 +15,30 @@
 #include "tinydir.h"
 #include "util.h"
 #include "vector.h"
-extern char* TEMPLATE_EXT;
 #include "context.h"
 void save_ctx(ctx_t* ctx);
 void cleanup_callback(int fd, short what, void* arg);
 void wcache_callback(int fd, short what, void* arg);
 void interrupt_callback(int signal, short events, void* arg);
 void sighandler(int sig, siginfo_t* info, void* arg);
+void diff_bench(unsigned long lines, unsigned long edits);
+void render_bench(ctx_t* ctx, unsigned long kb);
+double ms_since(struct timespec* start);
+unsigned long escape_bytewise(char* str, char* out);
+char* percent_encode_bytewise(char* data, unsigned long sz);
+unsigned long percent_decode_bytewise(char* data, char* out);
+void escape_bench(unsigned long mb);
+void template_bench(ctx_t* ctx, unsigned long items, unsigned long iters);
+#define CONSOLE_HELP \
+	"rank <user> <perms>\n" \
+	"rankall <perms>\n" \
+	"diff <path> <max diffs>\n" \
+	"bench-diff <lines> <edits>\n" \
+	"bench-render <kb>\n" \
+	"bench-escape <mb>\n" \
+	"bench-templates <items> <iterations>\n" \
+	"caches\n" \
+	"arena\n" \
+	"quit\n"
 int util_main(void* udata);
 int main(int argc, char** argv);
@@ -0,0 +1,180 @@
+// rendered article bodies, shared by every viewer
+// the only per viewer part is a small fragment, every variant of which is kept alongside
+// entries are dropped when their article or anything shown on it changes
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include <stdatomic.h>
+
+#include "util.h"
+#include "vector.h"
+#include "hashtable.h"
+
+#define PAGE_FRAGMENTS 4 //variants of the per viewer fragment, see article_controls
+
+typedef struct {
+	char* body; //page without the fragment, which goes at split
+	unsigned long split;
+	unsigned long len;
+
+	char* fragments[PAGE_FRAGMENTS]; //NULL if empty
+	unsigned long fragment_lens[PAGE_FRAGMENTS];
+	uint32_t fragment_crcs[PAGE_FRAGMENTS];
+
+	//the same as a gzip member, with fragments as stored blocks between the deflated halves
+	char* zhead; //gzip header and deflated body up to split
+	unsigned long zhead_len;
+	char* ztail; //deflated rest and final block, the trailer depends on the fragment
+	unsigned long ztail_len;
+	char* zfragments[PAGE_FRAGMENTS];
+	unsigned long zfragment_lens[PAGE_FRAGMENTS];
+
+	uint32_t head_crc;
+	uint32_t tail_crc;
+
+	unsigned long size; //everything above, counted against the budget
+	unsigned long page_version; //templates it was rendered with
+	atomic_ulong refs; //queued responses, plus one while cached
+} cached_page;
+
+typedef struct {
+	mtx_t lock;
+	map_t pages; //article index -> cached_page*
+	vector_t order; //indices, oldest first, evicted when over budget
+
+	unsigned long size; //bytes held by cached entries
+	unsigned long budget;
+
+	atomic_ulong generation; //bumped on invalidation, renders started before arent inserted
+	atomic_ulong hits;
+	atomic_ulong misses;
+} pagecache_t;
+
+void pagecache_init(pagecache_t* cache, unsigned long budget) {
+	mtx_init(&cache->lock, mtx_plain);
+
+	cache->pages = map_new();
+	map_configure_uint64_key(&cache->pages, sizeof(cached_page*));
+	cache->order = vector_new(sizeof(uint64_t));
+
+	cache->size = 0;
+	cache->budget = budget;
+
+	atomic_init(&cache->generation, 0);
+	atomic_init(&cache->hits, 0);
+	atomic_init(&cache->misses, 0);
+}
+
+void cached_page_release(cached_page* page) {
+	if (atomic_fetch_sub(&page->refs, 1) == 1) {
+		drop(page->body);
+		drop(page->zhead);
+		drop(page->ztail);
+
+		for (int i=0; i<PAGE_FRAGMENTS; i++) {
+			if (page->fragments[i]) drop(page->fragments[i]);
+			if (page->zfragments[i]) drop(page->zfragments[i]);
+		}
+
+		drop(page);
+	}
+}
+
+//evbuffer cleanup for each queued part
+void cached_page_release_ref(const void* data, size_t len, void* arg) {
+	cached_page_release(arg);
+}
+
+//caller holds the lock
+void pagecache_remove_locked(pagecache_t* cache, uint64_t idx) {
+	cached_page** page = map_find(&cache->pages, &idx);
+	if (!page) return;
+
+	cached_page* removed = *page;
+	map_remove(&cache->pages, &idx);
+
+	unsigned long i = vector_search(&cache->order, &idx);
+	if (i) vector_remove(&cache->order, i-1);
+
+	cache->size -= removed->size;
+	cached_page_release(removed);
+}
+
+//referenced page or NULL on a miss, release once queued
+cached_page* pagecache_find(pagecache_t* cache, uint64_t idx, unsigned long page_version) {
+	mtx_lock(&cache->lock);
+
+	cached_page** found = map_find(&cache->pages, &idx);
+	cached_page* page = found ? *found : NULL;
+
+	//rendered with templates since reloaded
+	if (page && page->page_version != page_version) {
+		pagecache_remove_locked(cache, idx);
+		page = NULL;
+	}
+
+	if (page) atomic_fetch_add(&page->refs, 1);
+	mtx_unlock(&cache->lock);
+
+	atomic_fetch_add(page ? &cache->hits : &cache->misses, 1);
+	return page;
+}
+
+//keeps a reference, generation must be read before the article was
+void pagecache_insert(pagecache_t* cache, uint64_t idx, unsigned long generation, cached_page* page) {
+	if (page->size > cache->budget) return;
+
+	mtx_lock(&cache->lock);
+
+	if (atomic_load(&cache->generation) != generation) {
+		mtx_unlock(&cache->lock);
+		return;
+	}
+
+	pagecache_remove_locked(cache, idx);
+
+	while (cache->size + page->size > cache->budget && cache->order.length > 0) {
+		pagecache_remove_locked(cache, *(uint64_t*)vector_get(&cache->order, 0));
+	}
+
+	atomic_fetch_add(&page->refs, 1);
+
+	map_insertcpy(&cache->pages, &idx, &page);
+	vector_pushcpy(&cache->order, &idx);
+	cache->size += page->size;
+
+	mtx_unlock(&cache->lock);
+}
+
+//call after anything shown on the article's page changes
+void pagecache_invalidate(pagecache_t* cache, uint64_t idx) {
+	mtx_lock(&cache->lock);
+	atomic_fetch_add(&cache->generation, 1);
+
+	pagecache_remove_locked(cache, idx);
+
+	mtx_unlock(&cache->lock);
+}
+
+//when something shown on every page changes, ie. a username
+void pagecache_clear(pagecache_t* cache) {
+	mtx_lock(&cache->lock);
+	atomic_fetch_add(&cache->generation, 1);
+
+	while (cache->order.length > 0) {
+		pagecache_remove_locked(cache, *(uint64_t*)vector_get(&cache->order, 0));
+	}
+
+	mtx_unlock(&cache->lock);
+}
+
+void pagecache_stats(pagecache_t* cache, FILE* f) {
+	mtx_lock(&cache->lock);
+	unsigned long pages = cache->order.length, size = cache->size;
+	mtx_unlock(&cache->lock);
+
+	fprintf(f, "page cache: %lu hits, %lu misses, %lu pages, %lu/%lu bytes\n",
+		atomic_load(&cache->hits), atomic_load(&cache->misses), pages, size, cache->budget);
+}
@@ -0,0 +1,56 @@
+// Automatically generated header.
+
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "util.h"
+#include "vector.h"
+#include "hashtable.h"
+#define PAGE_FRAGMENTS 4 //variants of the per viewer fragment, see article_controls
+typedef struct {
+	char* body; //page without the fragment, which goes at split
+	unsigned long split;
+	unsigned long len;
+
+	char* fragments[PAGE_FRAGMENTS]; //NULL if empty
+	unsigned long fragment_lens[PAGE_FRAGMENTS];
+	uint32_t fragment_crcs[PAGE_FRAGMENTS];
+
+	//the same as a gzip member, with fragments as stored blocks between the deflated halves
+	char* zhead; //gzip header and deflated body up to split
+	unsigned long zhead_len;
+	char* ztail; //deflated rest and final block, the trailer depends on the fragment
+	unsigned long ztail_len;
+	char* zfragments[PAGE_FRAGMENTS];
+	unsigned long zfragment_lens[PAGE_FRAGMENTS];
+
+	uint32_t head_crc;
+	uint32_t tail_crc;
+
+	unsigned long size; //everything above, counted against the budget
+	unsigned long page_version; //templates it was rendered with
+	atomic_ulong refs; //queued responses, plus one while cached
+} cached_page;
+typedef struct {
+	mtx_t lock;
+	map_t pages; //article index -> cached_page*
+	vector_t order; //indices, oldest first, evicted when over budget
+
+	unsigned long size; //bytes held by cached entries
+	unsigned long budget;
+
+	atomic_ulong generation; //bumped on invalidation, renders started before arent inserted
+	atomic_ulong hits;
+	atomic_ulong misses;
+} pagecache_t;
+void pagecache_init(pagecache_t* cache, unsigned long budget);
+void cached_page_release(cached_page* page);
+void cached_page_release_ref(const void* data, size_t len, void* arg);
+cached_page* pagecache_find(pagecache_t* cache, uint64_t idx, unsigned long page_version);
+void pagecache_insert(pagecache_t* cache, uint64_t idx, unsigned long generation, cached_page* page);
+void pagecache_invalidate(pagecache_t* cache, uint64_t idx);
+void pagecache_clear(pagecache_t* cache);
+void pagecache_stats(pagecache_t* cache, FILE* f);
@@ -0,0 +1,61 @@
+// read mostly pointers swapped without blocking readers
+// readers publish the epoch they started in, writers wait until every reader is past the swap
+
+#include <stdatomic.h>
+#include <threads.h>
+#include <time.h>
+#include <err.h>
+
+#define RCU_THREADS 256 //reactors, workers and anything else reading
+
+typedef struct {
+	atomic_ulong epoch; //starts at 1, 0 marks a thread outside any read section
+	atomic_ulong slots[RCU_THREADS]; //epoch each thread entered its read section in
+	atomic_int threads; //slots handed out
+} rcu_t;
+
+//one rcu_t per process, slots are per thread
+thread_local int rcu_slot = -1;
+thread_local int rcu_depth = 0;
+
+void rcu_init(rcu_t* rcu) {
+	atomic_init(&rcu->epoch, 1);
+	atomic_init(&rcu->threads, 0);
+
+	for (int i=0; i<RCU_THREADS; i++) {
+		atomic_init(&rcu->slots[i], 0);
+	}
+}
+
+void rcu_read_lock(rcu_t* rcu) {
+	if (rcu_depth++) return;
+
+	if (rcu_slot == -1) {
+		rcu_slot = atomic_fetch_add(&rcu->threads, 1);
+		if (rcu_slot >= RCU_THREADS) errx(1, "more than %i threads reading rcu pointers\n", RCU_THREADS);
+	}
+
+	//seq cst, the store is visible before any pointer is loaded
+	atomic_store(&rcu->slots[rcu_slot], atomic_load(&rcu->epoch));
+}
+
+void rcu_read_unlock(rcu_t* rcu) {
+	if (--rcu_depth) return;
+	atomic_store(&rcu->slots[rcu_slot], 0);
+}
+
+//call after swapping the pointer, returns once no reader can still hold the old one
+void rcu_synchronize(rcu_t* rcu) {
+	unsigned long epoch = atomic_fetch_add(&rcu->epoch, 1)+1;
+	int threads = atomic_load(&rcu->threads);
+
+	for (int i=0; i<threads && i<RCU_THREADS; i++) {
+		while (1) {
+			unsigned long slot = atomic_load(&rcu->slots[i]);
+			if (slot == 0 || slot >= epoch) break;
+
+			//read sections last a request, no point spinning
+			thrd_sleep(&(struct timespec){.tv_nsec=1000*1000}, NULL);
+		}
+	}
+}
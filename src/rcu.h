@@ -0,0 +1,17 @@
+// Automatically generated header.
+
+#pragma once
+#include <stdatomic.h>
+#include <threads.h>
+#include <time.h>
+#include <err.h>
+#define RCU_THREADS 256 //reactors, workers and anything else reading
+typedef struct {
+	atomic_ulong epoch; //starts at 1, 0 marks a thread outside any read section
+	atomic_ulong slots[RCU_THREADS]; //epoch each thread entered its read section in
+	atomic_int threads; //slots handed out
+} rcu_t;
+void rcu_init(rcu_t* rcu);
+void rcu_read_lock(rcu_t* rcu);
+void rcu_read_unlock(rcu_t* rcu);
+void rcu_synchronize(rcu_t* rcu);
@@ -1,3 +1,7 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <stdatomic.h>
@@ -14,6 +18,7 @@
 #include "vector.h"
 #include "web.h"
 #include "wiki.h"
+#include "assets.h"
 
 // boilerplate is intentional btw
 
@@ -30,20 +35,25 @@ unsigned char get_perms(session_t* session) {
 	return perms;
 }
 
-cached* article_current(ctx_t* ctx, vector_t* filepath) {
-	cached* current_cache = ctx_cache_find(ctx, filepath->data);
-	if (!current_cache) {
-		text_t txt = txt_new(filepath->data);
-		read_txt(&txt, 0, 0);
-		current_cache = ctx_cache_new(ctx, heapcpystr(filepath->data), heapcpystr(txt.current), strlen(txt.current));
+//textcache_loader for article_current
+char* article_load_current(char* filepath, unsigned long* len, void* arg) {
+	text_t txt = txt_open(filepath);
+	read_txt(&txt, 0, 0);
 
-		txt_free(&txt);
-	}
+	char* data = heapcpystr(txt.current ? txt.current : "");
+	*len = strlen(data);
 
-	return current_cache;
+	txt_free(&txt);
+	return data;
 }
 
-vector_t article_group_list(ctx_t* ctx, filemap_object* article, articledata_t* data, vector_t* item_strs) {
+//one disk read however many readers miss at once, release with cached_release
+cached* article_current(ctx_t* ctx, vector_t* filepath) {
+	return textcache_get(&ctx->cached, filepath->data, article_load_current, NULL);
+}
+
+//template arguments come from the arena
+vector_t article_group_list(ctx_t* ctx, arena_t* arena, filemap_object* article, articledata_t* data, vector_t* item_strs) {
 	vector_t items = {.data = article->fields[article_items_i],
 		.size = sizeof(uint64_t),
 		.length = data->items};
@@ -75,8 +85,8 @@ vector_t article_group_list(ctx_t* ctx, filemap_object* article, articledata_t*
 		vector_flatten_strings(&item_path, &url, "/", 1);
 		vector_pushcpy(&url, "\0");
 
-		vector_pushcpy(&items_arg, &(template_args){.cond_args=heapcpy(sizeof(int), &is_group),
-			.sub_args=heapcpy(sizeof(char*[2]), (char*[2]){url.data, item_end})});
+		vector_pushcpy(&items_arg, &(template_args){.cond_args=arena_cpy(arena, sizeof(int), &is_group),
+			.sub_args=arena_cpy(arena, sizeof(char*[2]), (char*[2]){url.data, item_end})});
 
 		vector_pushcpy(item_strs, &item_end);
 		vector_pushcpy(item_strs, &url.data);
@@ -111,84 +121,132 @@ vector_t flatten_wikipath(vector_t* path) {
 	return flattened;
 }
 
+//output of render_article, len counts what the unrendered text would be for error columns
+typedef struct {
+	vector_t html;
+	unsigned long len;
+	int render;
+} render_out;
+
+//markup, only written when rendering
+void render_tag(render_out* out, char* tag) {
+	if (!out->render) return;
+
+	vector_stockstr(&out->html, tag);
+	out->len += strlen(tag);
+}
+
+//article text, always counted
+void render_text(render_out* out, char* text, unsigned long len) {
+	if (out->render) vector_stockcpy(&out->html, len, text);
+	out->len += len;
+}
+
+void render_escaped(render_out* out, char* text, unsigned long len) {
+	char* run = text;
+
+	for (char* end = text+len; text < end; text++) {
+		char* entity = html_entity(*text);
+		if (!entity) continue;
+
+		render_text(out, run, text-run);
+		render_text(out, entity, strlen(entity));
+		run = text+1;
+	}
+
+	render_text(out, run, text-run);
+}
+
+typedef struct {
+	vector_t* words; //NULL if not collecting
+	char word[WORD_MAX];
+	unsigned long len; //keeps counting past WORD_MAX, then its too long to be a word
+	unsigned long wc;
+} render_tokens;
+
+void render_word_end(render_tokens* tok, unsigned char score) {
+	if (tok->words && tok->len >= WORD_MIN && tok->len <= WORD_MAX) {
+		search_token t = {.word=heapcpysubstr(tok->word, tok->len), .pos=tok->wc, .score=score};
+		vector_pushcpy(tok->words, &t);
+		tok->wc++;
+	}
+
+	tok->len = 0;
+}
+
+void render_word_feed(render_tokens* tok, char x, unsigned char score) {
+	if ((x >= 'a' && x <= 'z') || (x >= 'A' && x <= 'Z')) {
+		if (tok->len < WORD_MAX) tok->word[tok->len] = x;
+		tok->len++;
+	} else {
+		render_word_end(tok, score);
+	}
+}
+
+//single pass over the source, html is escaped as it is written
+//returns column (in the escaped text) of a syntax error or 0
 int render_article(ctx_t* ctx, char** article, int render, vector_t* refs, vector_t* words) {
-	escape_html(article);
-	vector_t vec = vector_from_string(*article);
+	render_out out = {.html=vector_new(1), .len=0, .render=render};
+	render_tokens tok = {.words=words, .len=0, .wc=0};
 
 	//bbbbbbb
 	int newline=1;
-	int escaped=0;
 	int bold=0;
 	int heading=0;
-	
-	unsigned long wc = 0;
 
-	if (render) vector_insertstr(&vec, 0, "<p>");
+	render_tag(&out, "<p>");
 
-	vector_iterator iter = vector_iterate(&vec);
-	if (render) iter.i = strlen("<p>");
-	
-	unsigned long word_begin = iter.i;
-	
-	while (vector_next(&iter)) {
-		if (escaped) {
-			escaped = 0;
-			continue;
-		}
-
-		char x = *(char*)iter.x;
-		
-		if (words && (x==0 || !((x >= 'a' && x <= 'z') || (x >= 'A' && x <= 'Z')))) {
-			unsigned long len = iter.i-1-word_begin;
-			if (len >= WORD_MIN && len <= WORD_MAX) {
-				search_token tok = {.word = heapcpysubstr(vector_get(&vec, word_begin), len), .pos=wc};
+	char* cur = *article;
 
-				if (heading) tok.score=3;
-				else if (bold) tok.score=2;
-				else tok.score=1;
+	while (1) {
+		char x = *cur;
+		unsigned char score = heading ? 3 : (bold ? 2 : 1);
 
-				vector_pushcpy(words, &tok);
-				wc++;
-			}
+		//entities are never markup, but their letters are still words
+		char* entity = html_entity(x);
+		if (entity) {
+			render_text(&out, entity, strlen(entity));
+			for (char* e = entity; *e; e++) render_word_feed(&tok, *e, score);
 
-			word_begin = iter.i;
+			newline = 0;
+			cur++;
+			continue;
 		}
 
+		render_word_feed(&tok, x, score);
+
 		if (x == '\n' || x == '\r' || x==0) {
 			if (heading) {
 				heading = 0;
-
-				if (render) {
-					vector_insertstr(&vec, iter.i-1, "</h2>");
-					iter.i += strlen("</h2>")-1;
-				}
-
-				continue;
+				render_tag(&out, "</h2>");
 			}
 
 			if (x==0) {
-				if (render) vector_insert_manycpy(&vec, iter.i-1, strlen("</p>")+1, "</p>");
+				render_tag(&out, "</p>");
 				break;
-			} else if (!newline && render) {
-				vector_insertstr(&vec, iter.i-1, "</p><p>");
-				iter.i += strlen("</p><p>")-1; //continue skips another
+			} else if (!newline) {
+				render_tag(&out, "</p><p>");
 			}
 
+			render_text(&out, cur, 1);
+
 			newline = 1;
+			cur++;
 			continue;
 
 		} else if (x == '#') {
+			if (newline && render) {
+				render_tag(&out, "<h2>");
+			} else {
+				render_text(&out, cur, 1);
+			}
+
 			if (newline) {
 				heading=1;
 				newline=0;
-
-				if (render) {
-					vector_remove(&vec, iter.i-1);
-					vector_insertstr(&vec, iter.i-1, "<h2>");
-					iter.i += strlen("<h2>")-1;
-				}
 			}
 
+			cur++;
 			continue;
 
 		} else {
@@ -196,14 +254,31 @@ int render_article(ctx_t* ctx, char** article, int render, vector_t* refs, vecto
 		}
 
 		switch (x) {
-			case '\\': escaped = 1; break;
+			case '\\': {
+				//next char is written as is
+				render_text(&out, cur, 1);
+				cur++;
+				if (!*cur) continue;
+
+				char* next_entity = html_entity(*cur);
+				if (next_entity) {
+					render_text(&out, next_entity, strlen(next_entity));
+					for (char* e = next_entity+1; *e; e++) render_word_feed(&tok, *e, score);
+				} else {
+					render_text(&out, cur, 1);
+					if (isalpha((unsigned char)*cur)) render_word_feed(&tok, *cur, score);
+				}
+
+				break;
+			}
+
 			case '*': {
-				if (bold && render) {
-					vector_insertstr(&vec, iter.i, "</b>");
-					iter.i += strlen("</b>");
-				} else if (render) {
-					vector_insertstr(&vec, iter.i-1, "<b>");
-					iter.i += strlen("<b>");
+				if (bold) {
+					render_text(&out, cur, 1);
+					render_tag(&out, "</b>");
+				} else {
+					render_tag(&out, "<b>");
+					render_text(&out, cur, 1);
 				}
 
 				bold=!bold;
@@ -211,33 +286,35 @@ int render_article(ctx_t* ctx, char** article, int render, vector_t* refs, vecto
 			}
 
 			case '[': {
-				unsigned long remove_from = iter.i-1;
-
-				vector_next(&iter);
-				int wiki = *(char*)iter.x == '!';
-				if (wiki) vector_next(&iter);
+				unsigned long link_col = out.len;
 
-				char* start = iter.x;
-				//wiki link
+				char* start = cur+1;
+				int wiki = *start == '!';
+				if (wiki) start++;
 
-				while (*(char*)iter.x != ']' && vector_next(&iter));
-				char* end = iter.x;
+				char* end = start;
+				while (*end && *end != ']') end++;
 
 				if (end == start) {
-					vector_free(&vec);
-					return start-vec.data+1;
+					vector_free(&out.html);
+					return link_col + (start-cur) + 1;
 				}
-				
-				char* url = heapcpy(end-start+1, start);
-				url[end-start] = 0;
-				
-				char* new_url;
+
+				//links are made of the escaped text
+				render_out url_out = {.html=vector_new(1), .len=0, .render=1};
+				render_escaped(&url_out, start, end-start);
+				vector_pushcpy(&url_out.html, "\0");
+				char* url = url_out.html.data;
+
+				char* new_url = NULL;
 
 				if (wiki) {
 					vector_t w_path = vector_new(sizeof(char*));
 					if (!parse_wiki_path(url, &w_path)) {
 						vector_free_strings(&w_path);
-						return start-vec.data+1;
+						vector_free(&url_out.html);
+						vector_free(&out.html);
+						return link_col + (start-cur) + 1;
 					}
 
 					if (refs) vector_pushcpy(refs, &w_path);
@@ -273,36 +350,56 @@ int render_article(ctx_t* ctx, char** article, int render, vector_t* refs, vecto
 				}
 
 				if (render) {
-					vector_removemany(&vec, remove_from, iter.i-remove_from);
-					vector_insertstr(&vec, remove_from, new_url);
-					iter.i = remove_from + strlen(new_url);
-
+					render_tag(&out, new_url);
 					drop(new_url);
+				} else {
+					render_escaped(&out, cur, (*end ? end+1 : end) - cur);
 				}
 
-				drop(url);
-				
+				vector_free(&url_out.html);
+
+				//link text isnt searchable
+				tok.len = 0;
+
+				cur = *end ? end : end-1;
 				break;
 			}
 
 			//...
-			default: if (vec.length-iter.i >= 3
-				&& strncmp(iter.x, "```", strlen("```"))==0) {
+			default: {
+				if (strncmp(cur, "```", strlen("```"))==0) {
+					char* pre = cur+strlen("```");
+					char* pre_end = strstr(pre, "```");
+					if (!pre_end) pre_end = pre+strlen(pre);
 
-				vector_removemany(&vec, iter.i-1, strlen("```"));
-				vector_insertstr(&vec, iter.i-1, "<pre>");
+					//written even when not rendering, error columns count them
+					render_text(&out, "<pre>", strlen("<pre>"));
+					render_escaped(&out, pre, pre_end-pre);
+					render_text(&out, "</pre>", strlen("</pre>"));
 
-				while (vector_next(&iter) && strncmp(iter.x, "```", strlen("```"))!=0);
+					tok.len = 0;
 
-				vector_removemany(&vec, iter.i-1, strlen("```"));
-				vector_insertstr(&vec, iter.i-1, "</pre>");
-				iter.i += strlen("</pre>") - strlen("```") - 1;
+					cur = *pre_end ? pre_end+strlen("```") : pre_end;
+					continue;
+				}
+
+				render_text(&out, cur, 1);
 				break;
 			}
 		}
+
+		cur++;
+	}
+
+	if (render) {
+		vector_pushcpy(&out.html, "\0");
+
+		drop(*article);
+		*article = out.html.data;
+	} else {
+		vector_free(&out.html);
 	}
 
-	*article = vec.data;
 	return 0;
 }
 
@@ -625,6 +722,12 @@ void refs_free(vector_t* refs) {
 	}
 }
 
+//edit times feed the validators, so they move on with every change to what is shown, even within a second
+uint64_t edit_time_next(uint64_t last) {
+	uint64_t now = (uint64_t)time(NULL);
+	return now > last ? now : last+1;
+}
+
 void rerender_articles(ctx_t* ctx, vector_t* articles, vector_t* from, char* to) {
 	vector_iterator iter = vector_iterate(articles);
 	while (vector_next(&iter)) {
@@ -645,6 +748,7 @@ void rerender_articles(ctx_t* ctx, vector_t* articles, vector_t* from, char* to)
 		text_t txt = txt_new(filepath.data);
 		read_txt(&txt, 0, 0);
 
+		int saved = 1; //links left as they were if the diff couldnt be written
 		if (from && to) {
 			diff_t d = {.additions=vector_new(sizeof(add_t)), .deletions=vector_new(sizeof(del_t))};
 			d.author = 0;
@@ -665,10 +769,12 @@ void rerender_articles(ctx_t* ctx, vector_t* articles, vector_t* from, char* to)
 				vector_t* w_path = iter.x;
 
 				if (vector_cmpstr(w_path, from)==0) {
-					long remove_from = offset + (long)(pos[1]-txt.current);
+					//diff positions are in the old text, the offset is only for editing current
+					uint64_t diff_pos = (uint64_t)(pos[1]-txt.current);
+					long remove_from = offset + (long)diff_pos;
 
-					vector_pushcpy(&d.deletions, &(del_t){.pos=remove_from, .txt=pos[0]});
-					vector_pushcpy(&d.additions, &(add_t){.pos=remove_from, .txt=to});
+					vector_pushcpy(&d.deletions, &(del_t){.pos=diff_pos, .txt=pos[0]});
+					vector_pushcpy(&d.additions, &(add_t){.pos=diff_pos, .txt=to});
 					vector_pushcpy(&url_strs, &pos[0]);
 
 					vector_removemany(&current, remove_from, pos[2]-pos[1]);
@@ -683,7 +789,8 @@ void rerender_articles(ctx_t* ctx, vector_t* articles, vector_t* from, char* to)
 			}
 
 			txt.current = current.data;
-			add_diff(&txt, &d, current.data);
+			saved = add_diff(&txt, &d, current.data);
+			if (saved) textcache_remove(&ctx->cached, filepath.data);
 			
 			vector_free_strings(&url_strs);
 			refs_free(&refs);
@@ -691,11 +798,21 @@ void rerender_articles(ctx_t* ctx, vector_t* articles, vector_t* from, char* to)
 
 		char* html_cache = heapcpystr(txt.current);
 
-		if (render_article(ctx, &html_cache, 1, NULL, NULL)==0) {
+		if (saved && render_article(ctx, &html_cache, 1, NULL, NULL)==0) {
+			articledata_t* data = (articledata_t*)obj.fields[article_data_i];
+
+			filemap_ordered_remove_id(&ctx->articles_newest, UINT64_MAX-data->edit_time, &partial);
+			data->edit_time = edit_time_next(data->edit_time);
+
 			filemap_object new_obj = filemap_push_updated(&ctx->article_fmap, &obj, (update_t[]){{.field=article_html_i, .new=html_cache, .len=strlen(html_cache)+1}}, 1);
 
 			filemap_list_update(&ctx->article_id, &partial, &new_obj);
+
+			filemap_object idx_obj = filemap_index_obj(&new_obj, &partial);
+			filemap_ordered_insert(&ctx->articles_newest, UINT64_MAX-data->edit_time, &idx_obj);
+
 			filemap_delete_object(&ctx->article_fmap, &obj);
+			pagecache_invalidate(&ctx->pages, partial.index);
 			
 			filemap_updated_free(&new_obj);
 		}
@@ -757,6 +874,49 @@ int article_lock_groups(ctx_t* ctx, vector_t* path, vector_t* flattened, vector_
 	return 1;
 }
 
+//for groups locked by article_lock_groups that wont be inserted into after all
+void article_unlock_groups(ctx_t* ctx, vector_t* groups, vector_t* path, vector_t* flattened) {
+	unsigned long key_len = flattened->length;
+
+	vector_iterator iter = vector_iterate(groups);
+	while (vector_next(&iter)) {
+		key_len -= strlen(vector_getstr(path, path->length-iter.i)) + 1;
+		unlock_article(ctx, flattened->data, key_len);
+	}
+}
+
+//what article_new saves before inserting, 0 if it couldnt be
+typedef int (*article_save_fn)(vector_t* path, uint64_t author, void* arg);
+
+//appends arg as the newest revision of the text at path
+int article_save_text(vector_t* path, uint64_t author, void* arg) {
+	char* content = arg;
+	vector_t out_path = make_path(path);
+
+	text_t txt = txt_new(out_path.data);
+	read_txt(&txt, 0, 0);
+
+	diff_t d = find_changes(txt.current, content);
+	d.author = author;
+	d.time = (uint64_t)time(NULL);
+
+	int saved = add_diff(&txt, &d, content);
+
+	diff_free(&d);
+	txt_free(&txt);
+	vector_free(&out_path);
+	return saved;
+}
+
+//moves the file field of the request arg into place, it stays spilled if that fails
+int article_save_upload(vector_t* path, uint64_t author, void* arg) {
+	vector_t out_path = make_path(path);
+	int saved = multipart_commit(arg, "file", out_path.data);
+
+	vector_free(&out_path);
+	return saved;
+}
+
 void article_group_insert(ctx_t* ctx, vector_t* groups, vector_t* path, vector_t* flattened, uint64_t user_idx, filemap_partial_object* item) {
 	vector_iterator iter = vector_iterate(groups);
 
@@ -822,6 +982,7 @@ void article_group_insert(ctx_t* ctx, vector_t* groups, vector_t* path, vector_t
 																							obj.fields, obj.lengths);
 				filemap_list_update(&ctx->article_id, new_group, &new_obj);
 				filemap_delete_object(&ctx->article_fmap, &obj);
+				pagecache_invalidate(&ctx->pages, new_group->index);
 			}
 
 			filemap_object_free(&ctx->article_fmap, &obj);
@@ -870,6 +1031,7 @@ void article_group_remove(ctx_t* ctx, vector_t* groups, vector_t* path, vector_t
 				filemap_list_update(&ctx->article_id, group,
 														&new_obj);
 				filemap_delete_object(&ctx->article_fmap, &obj);
+				pagecache_invalidate(&ctx->pages, group->index);
 			} else {
 				filemap_object_free(&ctx->article_fmap, &obj);
 				remove=0;
@@ -916,8 +1078,10 @@ uint64_t path_abc_order(char* name) {
 	return val;
 }
 
+//the text or file is saved once the path is known to be free and before anything is inserted
+//1 if created, 0 if the path is taken, -1 if it couldnt be saved
 int article_new(ctx_t* ctx, filemap_partial_object* article, article_type ty,
-	vector_t* path, vector_t* flattened, uint64_t user_idx, char* html_cache, uint64_t edit_time) {
+	vector_t* path, vector_t* flattened, uint64_t user_idx, char* html_cache, article_save_fn save, void* save_arg, uint64_t edit_time) {
 
 	filemap_object idx = filemap_findcpy(&ctx->article_by_name,
 			flattened->data, flattened->length);
@@ -945,6 +1109,14 @@ int article_new(ctx_t* ctx, filemap_partial_object* article, article_type ty,
 		return 0;
 	}
 
+	if (!save(path, user_idx, save_arg)) {
+		article_unlock_groups(ctx, &groups, path, flattened);
+
+		vector_free(&referenced_by);
+		vector_free(&groups);
+		return -1;
+	}
+
 	// insert blank, then update groups and finally insert real thing
 	*article = filemap_add(&ctx->article_id, NULL);
 
@@ -967,6 +1139,7 @@ int article_new(ctx_t* ctx, filemap_partial_object* article, article_type ty,
 				flattened->length, 8, strlen(html_cache)+1});
 
 	filemap_list_update(&ctx->article_id, article, &text);
+	pagecache_invalidate(&ctx->pages, article->index);
 
 	filemap_object text_ref = filemap_index_obj(&text, article);
 
@@ -984,19 +1157,68 @@ int article_new(ctx_t* ctx, filemap_partial_object* article, article_type ty,
 }
 
 void req_wiki_path(request* req) {
-	drop(vector_removeptr(&req->path, 0));
+	vector_remove(&req->path, 0);
 
+	//segments are in the request arena, decoding only ever shrinks them
 	vector_iterator iter = vector_iterate(&req->path);
 	while (vector_next(&iter)) {
-		//not very sanitary... TODO: dont implicit free
-		char* new = percent_decode(*(char**)iter.x, NULL);
-		
-		drop(*(char**)iter.x);
-		*(char**)iter.x = new;
+		percent_decode_to(*(char**)iter.x, *(char**)iter.x);
+	}
+}
+
+typedef struct {
+	int personal; //viewer is part of the etag
+	int valid; //set by route_article, 0 if the article has no validators
+
+	int cache; //answered from the page cache if there, with the viewer's controls
+	int gzip;
+	int vary; //the body is negotiated, 304s say so like the 200 does
+
+	char etag[96];
+	char modified[32];
+	char* headers[3][2]; //etag, last modified, cache control
+} validators;
+
+//etag and last modified from the data field, personal pages also depend on the viewer
+void article_validators(session_t* session, articledata_t* data, uint64_t idx, int personal, validators* v) {
+	if (personal) {
+		uint64_t viewer = session->user_ses ? session->user_ses->user.index+1 : 0;
+
+		snprintf(v->etag, sizeof(v->etag), "W/\"%lu-%lu-%lu-%lu\"",
+			idx, data->edit_time, atomic_load(&session->ctx->page_version), viewer);
+
+		v->headers[2][1] = session->user_ses ? "private, no-cache" : "no-cache";
+	} else {
+		snprintf(v->etag, sizeof(v->etag), "\"%lu-%lu\"", idx, data->edit_time);
+		v->headers[2][1] = "no-cache";
 	}
+
+	http_date((time_t)data->edit_time, v->modified);
+
+	v->headers[0][0] = "ETag";
+	v->headers[0][1] = v->etag;
+	v->headers[1][0] = "Last-Modified";
+	v->headers[1][1] = v->modified;
+	v->headers[2][0] = "Cache-Control";
+}
+
+#define CONTROLS_EDIT 1
+#define CONTROLS_DELETE 2
+
+//which of the PAGE_FRAGMENTS variants of the controls fragment the viewer gets
+int article_controls(session_t* session, articledata_t* data, vector_t* contribs) {
+	if (!session->user_ses || data->ty == article_group
+			|| vector_search(contribs, &session->user_ses->user.index)==0)
+		return 0;
+
+	unsigned char perms = get_perms(session);
+
+	return (data->ty == article_text && perms >= PERMS_EDIT ? CONTROLS_EDIT : 0)
+		| (perms >= PERMS_DELETE ? CONTROLS_DELETE : 0);
 }
 
-int route_article(session_t* session, request* req, filemap_object* obj) {
+//v is optional, if given conditional requests are answered here with 304
+int route_article(session_t* session, request* req, filemap_object* obj, uint64_t* idx, validators* v) {
 	req_wiki_path(req);
 	
 	filemap_partial_object article_ref;
@@ -1012,6 +1234,55 @@ int route_article(session_t* session, request* req, filemap_object* obj) {
 		vector_free(&flattened);
 	}
 
+	uint64_t article_idx = filemap_deref(&session->ctx->article_id, &article_ref).index;
+	if (idx) *idx = article_idx;
+
+	//only the data field is read until we know the body has to be sent
+	if (v) {
+		filemap_field data = filemap_cpyfield(&session->ctx->article_fmap, &article_ref, article_data_i);
+		articledata_t* d = (articledata_t*)data.val.data;
+
+		//groups list their items, which dont bump the group's edit time
+		if (data.exists && (d->ty == article_text || d->ty == article_img)) {
+			article_validators(session, d, article_idx, v->personal, v);
+
+			if (not_modified(req, v->etag, (time_t)d->edit_time)) {
+				vector_free(&data.val);
+
+				char* headers[3+EXTRA_HEADERS_MAX][2];
+				int headers_len = headers_join(headers, v->headers, 3, &(char*[2]){"Vary", "Accept-Encoding"}, v->vary);
+				respond(session, 304, NULL, 0, headers, headers_len);
+				return 0;
+			}
+
+			v->valid = 1;
+		} else {
+			v->valid = 0;
+		}
+
+		cached_page* page = v->cache && data.exists
+			? pagecache_find(&session->ctx->pages, article_idx, atomic_load(&session->ctx->page_version)) : NULL;
+
+		if (page) {
+			int controls = 0;
+
+			//only contributors see any
+			if (session->user_ses && d->ty != article_group) {
+				filemap_field contrib = filemap_cpyfield(&session->ctx->article_fmap, &article_ref, article_contrib_i);
+				vector_t contribs = {.data=contrib.val.data, .size=sizeof(uint64_t), .length=d->contributors};
+
+				controls = article_controls(session, d, &contribs);
+				vector_free(&contrib.val);
+			}
+
+			respond_page(session, 200, page, controls, v->gzip, v->headers, v->valid ? 3 : 0);
+			cached_page_release(page);
+		}
+
+		if (data.exists) vector_free(&data.val);
+		if (page) return 0;
+	}
+
 	*obj = filemap_cpyref(&session->ctx->article_fmap, &article_ref);
 
 	if (!obj->exists ||
@@ -1070,6 +1341,40 @@ void session_auth(session_t* session, filemap_partial_object idx) {
 	session->auth_tok = new_key;
 }
 
+//res belongs to assets, which the caller has read locked
+void respond_resource(session_t* session, request* req, assets_t* assets, resource* res) {
+	char* cache[2][2] = {{"ETag", res->etag}, {"Cache-Control", RESOURCE_CACHE}};
+
+	if (not_modified(req, res->etag, 0)) {
+		char* headers[2+EXTRA_HEADERS_MAX][2];
+		int headers_len = headers_join(headers, cache, 2, &(char*[2]){"Vary", "Accept-Encoding"}, res->br || res->gzip);
+		respond(session, 304, NULL, 0, headers, headers_len);
+		return;
+	}
+
+	//the response references content, so a reload frees it only after it is sent
+	atomic_fetch_add(&assets->refs, 1);
+
+	char* headers[3+EXTRA_HEADERS_MAX][2];
+
+	if (res->br && accepts_encoding(req, "br")) {
+		int headers_len = headers_join(headers, (char*[3][2]){{"Content-Type", res->mime},
+			{"Content-Encoding", "br"}, {"Vary", "Accept-Encoding"}}, 3, cache, 2);
+		respond_ref(session, 200, res->br, res->br_len, headers, headers_len, assets_release_ref, assets);
+	} else if (res->gzip && accepts_encoding(req, "gzip")) {
+		int headers_len = headers_join(headers, (char*[3][2]){{"Content-Type", res->mime},
+			{"Content-Encoding", "gzip"}, {"Vary", "Accept-Encoding"}}, 3, cache, 2);
+		respond_ref(session, 200, res->gzip, res->gzip_len, headers, headers_len, assets_release_ref, assets);
+	} else if (res->br || res->gzip) {
+		int headers_len = headers_join(headers, (char*[2][2]){{"Content-Type", res->mime},
+			{"Vary", "Accept-Encoding"}}, 2, cache, 2);
+		respond_ref(session, 200, res->content, res->len, headers, headers_len, assets_release_ref, assets);
+	} else {
+		int headers_len = headers_join(headers, &(char*[2]){"Content-Type", res->mime}, 1, cache, 2);
+		respond_ref(session, 200, res->content, res->len, headers, headers_len, assets_release_ref, assets);
+	}
+}
+
 void route(session_t* session, request* req) {
 	if (req->path.length == 0) {
 		filemap_object top = filemap_findcpy(&session->ctx->article_by_name, "", 0);
@@ -1079,7 +1384,7 @@ void route(session_t* session, request* req) {
 
 		if (top.exists) {
 			articledata_t* data = (articledata_t*)top.fields[article_data_i];
-			items_arg = article_group_list(session->ctx, &top, data, &item_strs);
+			items_arg = article_group_list(session->ctx, &req->arena, &top, data, &item_strs);
 		} else {
 			items_arg = vector_new(sizeof(template_args));
 		}
@@ -1150,11 +1455,7 @@ void route(session_t* session, request* req) {
 
 		RAND_bytes((unsigned char*)&data.salt, 4);
 		// lmao
-		EVP_DigestInit_ex(session->ctx->digest_ctx, EVP_sha256(), NULL);
-		EVP_DigestUpdate(session->ctx->digest_ctx, password, strlen(password));
-		EVP_DigestUpdate(session->ctx->digest_ctx, &data.salt, 4);
-
-		EVP_DigestFinal_ex(session->ctx->digest_ctx, data.password_hash, NULL);
+		hash_password(password, data.salt, data.password_hash);
 
 		filemap_object user = filemap_push(
 				&session->ctx->user_fmap, (char*[]){username, email, (char*)&data, ""},
@@ -1202,12 +1503,8 @@ void route(session_t* session, request* req) {
 
 		userdata_t* data = (userdata_t*)user.fields[article_path_i];
 
-		EVP_DigestInit_ex(session->ctx->digest_ctx, EVP_sha256(), NULL);
-		EVP_DigestUpdate(session->ctx->digest_ctx, password, strlen(password));
-		EVP_DigestUpdate(session->ctx->digest_ctx, &data->salt, 4);
-
 		unsigned char password_hash[HASH_LENGTH];
-		EVP_DigestFinal_ex(session->ctx->digest_ctx, password_hash, NULL);
+		hash_password(password, data->salt, password_hash);
 
 		if (memcmp(data->password_hash, password_hash, HASH_LENGTH) != 0) {
 			respond_template(session, 200, "login", "Login", 1,
@@ -1399,6 +1696,9 @@ void route(session_t* session, request* req) {
 		// delete old indices
 		if (name_change) {
 			filemap_remove(&session->ctx->user_by_name, user.fields[user_name_i], strlen(user.fields[user_name_i]) + 1);
+			//contributor lists, too many articles to touch each, so every page and its etag goes
+			atomic_fetch_add(&session->ctx->page_version, 1);
+			pagecache_clear(&session->ctx->pages);
 		}
 
 		if (email_change) {
@@ -1462,11 +1762,7 @@ void route(session_t* session, request* req) {
 
 		userdata_t* data = (userdata_t*)user.fields[user_data_i];
 
-		EVP_DigestInit_ex(session->ctx->digest_ctx, EVP_sha256(), NULL);
-		EVP_DigestUpdate(session->ctx->digest_ctx, password, strlen(password));
-		EVP_DigestUpdate(session->ctx->digest_ctx, &data->salt, 4);
-
-		EVP_DigestFinal_ex(session->ctx->digest_ctx, data->password_hash, NULL);
+		hash_password(password, data->salt, data->password_hash);
 
 		// no length changes, refer to old data and updated userdata_t
 		filemap_set(&session->ctx->user_fmap, &session->user_ses->user,
@@ -1559,10 +1855,12 @@ void route(session_t* session, request* req) {
 		lock_article(session->ctx, flattened.data, flattened.length);
 
 		filemap_partial_object article;
-		if (!article_new(session->ctx, &article, article_text,
-				&path, &flattened, session->user_ses->user.index, html_cache, (uint64_t)time(NULL))) {
+		int created = article_new(session->ctx, &article, article_text,
+				&path, &flattened, session->user_ses->user.index, html_cache, article_save_text, content, (uint64_t)time(NULL));
 
-			respond_template(session, 200, "new", "New article", 1, 1,
+		if (created <= 0) {
+			if (created < 0) respond_error(session, 500, "Failed to save article");
+			else respond_template(session, 200, "new", "New article", 1, 1,
 					"Article with that path already exists",
 					path_str, content);
 
@@ -1585,23 +1883,6 @@ void route(session_t* session, request* req) {
 		update_article_keywords(session->ctx, &keywords, NULL, article.index);
 		article_words_free(&keywords);
 		
-		// display/file path
-		vector_t out_path = make_path(&path);
-
-		//add diff
-
-		text_t txt = txt_new(out_path.data);
-		read_txt(&txt, 0, 0);
-		
-		diff_t d = find_changes(txt.current, content);
-		d.author = session->user_ses->user.index;
-		d.time = (uint64_t)time(NULL);
-
-		add_diff(&txt, &d, content);
-		diff_free(&d);
-		
-		txt_free(&txt);
-		
 		vector_t url = flatten_url(&path);
 		vector_insertstr(&url, 0, "wiki/");
 
@@ -1613,7 +1894,6 @@ void route(session_t* session, request* req) {
 		drop(html_cache);
 		vector_free_strings(&path);
 		vector_free(&flattened);
-		vector_free(&out_path);
 		vector_free(&params);
 		vector_free(&url);
 
@@ -1637,15 +1917,15 @@ void route(session_t* session, request* req) {
 		multipart_data* path_mp = vector_get(&params, 0);
 		multipart_data* content = vector_get(&params, 1);
 		
-		char* path_str = heapcpy(path_mp->len+1, path_mp->content);
-		path_str[path_mp->len] = 0;
-		
-		if (!content->mime) {
+		if (!content->mime || !content->spill || !path_mp->content) {
 			respond_error(session, 400, "Missing mime for file");
 			vector_free(&params);
 			return;
 		}
 
+		char* path_str = heapcpy(path_mp->len+1, path_mp->content);
+		path_str[path_mp->len] = 0;
+
 		vector_t path = vector_new(sizeof(char*));
 		if (!parse_wiki_path(path_str, &path)) {
 			respond_template(session, 200, "new", "New article", 1, 1, "Invalid path",
@@ -1662,11 +1942,14 @@ void route(session_t* session, request* req) {
 
 		lock_article(session->ctx, flattened.data, flattened.length);
 
+		//the file is moved into place before the article is inserted, see article_new
 		filemap_partial_object article;
-		if (!article_new(session->ctx, &article, article_img,
-				&path, &flattened, session->user_ses->user.index, content->mime, (uint64_t)time(NULL))) {
+		int created = article_new(session->ctx, &article, article_img,
+				&path, &flattened, session->user_ses->user.index, content->mime, article_save_upload, req, (uint64_t)time(NULL));
 
-			respond_template(session, 200, "new", "New article", 1, 1,
+		if (created <= 0) {
+			if (created < 0) respond_error(session, 500, "Failed to save upload");
+			else respond_template(session, 200, "new", "New article", 1, 1,
 					"Article with that path already exists",
 					path_str, "");
 
@@ -1679,13 +1962,6 @@ void route(session_t* session, request* req) {
 			return;
 		}
 
-		
-		vector_t out_path = make_path(&path);
-
-		FILE* f = fopen(out_path.data, "w");
-		fwrite(content->content, content->len, 1, f);
-		fclose(f);
-
 		unlock_article(session->ctx, flattened.data, flattened.length);
 
 		vector_t url = flatten_url(&path);
@@ -1696,7 +1972,6 @@ void route(session_t* session, request* req) {
 		
 		drop(path_str);
 
-		vector_free(&out_path);
 		vector_free_strings(&path);
 		vector_free(&flattened);
 		vector_free(&params);
@@ -1728,7 +2003,7 @@ void route(session_t* session, request* req) {
 		vector_t path = flatten_url(&req->path);
 		respond_template(session, 200, "edit", "Edit article", 1, 0, "", path.data, path.data, current->data);
 
-		ctx_cache_done(session->ctx, current, wpath.data);
+		cached_release(current);
 
 		vector_free(&flattened);
 		vector_free(&wpath);
@@ -1895,9 +2170,49 @@ void route(session_t* session, request* req) {
 
 		int content_change = strcmp(txt.current, content)!=0;
 
+		//the diff goes first, nothing else is changed if it couldnt be saved
+		if (content_change) {
+			diff_t d = find_changes(txt.current, content);
+			d.author = session->user_ses->user.index;
+			d.time = (uint64_t)time(NULL);
+
+			int saved = add_diff(&txt, &d, content);
+			diff_free(&d);
+
+			if (!saved) {
+				respond_error(session, 500, "Failed to save article");
+
+				filemap_object_free(&session->ctx->article_fmap, &obj);
+
+				unlock_article(session->ctx, flattened.data, flattened.length);
+				if (path_change) {
+					if (!new_article.exists) {
+						article_unlock_groups(session->ctx, &new_groups, &new_path, &new_flattened);
+						vector_free(&new_groups);
+					}
+
+					unlock_article(session->ctx, new_flattened.data, new_flattened.length);
+					vector_free(&new_flattened);
+				}
+
+				drop(html_cache);
+				refs_free(&refs);
+				vector_free(&new_referenced_by);
+				article_words_free(&keywords);
+
+				txt_free(&txt);
+				vector_free(&wpath);
+				vector_free(&flattened);
+				vector_free_strings(&new_path);
+				vector_free_strings(&path);
+				vector_free(&params);
+				return;
+			}
+		}
+
 		vector_t* flattened_path = path_change ? &new_flattened : &flattened;
 
-		//revise refs / add diff
+		//revise refs
 		if (content_change) {
 			vector_t old_refs = vector_new(sizeof(vector_t));
 			vector_t old_keywords = vector_new(sizeof(search_token));
@@ -1910,14 +2225,6 @@ void route(session_t* session, request* req) {
 
 			update_article_keywords(session->ctx, &keywords, &old_keywords, article.index);
 			article_words_free(&old_keywords);
-			
-			diff_t d = find_changes(txt.current, content);
-			d.author = session->user_ses->user.index;
-			d.time = (uint64_t)time(NULL);
-
-			add_diff(&txt, &d, content);
-
-			diff_free(&d);
 		}
 
 		article_words_free(&keywords);
@@ -1925,7 +2232,7 @@ void route(session_t* session, request* req) {
 		//move diff file
 		if (path_change) {
 			vector_t new_wpath = make_path(&new_path);
-			rename(wpath.data, new_wpath.data);
+			txt_rename(wpath.data, new_wpath.data);
 			
 			vector_free(&new_wpath);
 		}
@@ -1938,7 +2245,7 @@ void route(session_t* session, request* req) {
 
 			filemap_ordered_remove_id(&session->ctx->articles_newest, UINT64_MAX-data->edit_time, &article_ref);
 
-			data->edit_time = (uint64_t)time(NULL);
+			data->edit_time = edit_time_next(data->edit_time);
 			data->referenced_by = new_referenced_by.length;
 			data->path_length = new_path.length;
 
@@ -1964,6 +2271,12 @@ void route(session_t* session, request* req) {
 			filemap_ordered_insert(&session->ctx->articles_newest, UINT64_MAX-data->edit_time, &idx_obj);
 
 			filemap_delete_object(&session->ctx->article_fmap, &obj);
+
+			pagecache_invalidate(&session->ctx->pages, article.index);
+
+			if (path_change) {
+				pagecache_invalidate(&session->ctx->pages, new_article.index);
+			}
 		}
 
 		vector_t url;
@@ -1995,7 +2308,7 @@ void route(session_t* session, request* req) {
 			url = flatten_url(&path);
 		}
 		
-		ctx_cache_remove(session->ctx, wpath.data);
+		textcache_remove(&session->ctx->cached, wpath.data);
 
 		unlock_article(session->ctx, flattened.data, flattened.length);
 		if (path_change)
@@ -2086,7 +2399,7 @@ void route(session_t* session, request* req) {
 		if (!user_obj.exists) {
 			respond_template(session, 200, "edit", "Edit article", 1, 1,
 					"User does not exist", path, path, cache->data);
-			ctx_cache_done(session->ctx, cache, wikipath.data);
+			cached_release(cache);
 
 			filemap_object_free(&session->ctx->user_fmap, &user_obj);
 			filemap_object_free(&session->ctx->article_fmap, &obj);
@@ -2103,7 +2416,7 @@ void route(session_t* session, request* req) {
 
 		if (perms < PERMS_ADMIN && vector_search(&contribs, &session->user_ses->user.index)==0) {
 			respond_template(session, 200, "edit", "Edit article", 0, 0, "", "", "", "");
-			ctx_cache_done(session->ctx, cache, wikipath.data);
+			cached_release(cache);
 
 			filemap_object_free(&session->ctx->article_fmap, &obj);
 			unlock_article(session->ctx, flattened.data, flattened.length);
@@ -2121,7 +2434,7 @@ void route(session_t* session, request* req) {
 					add ? "That user is already a contributor" : "That user is not a contributor",
 					path, path, cache->data);
 
-			ctx_cache_done(session->ctx, cache, wikipath.data);
+			cached_release(cache);
 
 			filemap_object_free(&session->ctx->article_fmap, &obj);
 			filemap_object_free(&session->ctx->user_fmap, &user_obj);
@@ -2144,9 +2457,17 @@ void route(session_t* session, request* req) {
 			data->contributors--;
 		}
 
+		filemap_ordered_remove_id(&session->ctx->articles_newest, UINT64_MAX-data->edit_time, &article_ref);
+		data->edit_time = edit_time_next(data->edit_time);
+
 		filemap_object new_obj = filemap_push(&session->ctx->article_fmap, obj.fields, obj.lengths);
 		filemap_list_update(&session->ctx->article_id, &article, &new_obj);
+
+		filemap_object idx_obj = filemap_index_obj(&new_obj, &article);
+		filemap_ordered_insert(&session->ctx->articles_newest, UINT64_MAX-data->edit_time, &idx_obj);
+
 		filemap_delete_object(&session->ctx->article_fmap, &obj);
+		pagecache_invalidate(&session->ctx->pages, article.index); //contributor list
 
 		unlock_article(session->ctx, flattened.data, flattened.length);
 
@@ -2157,7 +2478,7 @@ void route(session_t* session, request* req) {
 		respond_redirect(session, redir.data);
 
 		vector_free(&redir);
-		ctx_cache_done(session->ctx, cache, wikipath.data);
+		cached_release(cache);
 
 		filemap_object_free(&session->ctx->article_fmap, &obj);
 		filemap_object_free(&session->ctx->user_fmap, &user_obj);
@@ -2211,11 +2532,43 @@ void route(session_t* session, request* req) {
 		}
 
 		int img = data->ty == article_img;
+		vector_t wpath = flatten_wikipath(&req->path);
+
+		//the text is emptied first, the article is left alone if that couldnt be saved
+		text_t txt;
+		if (!img) {
+			txt = txt_new(wpath.data);
+			read_txt(&txt, 0, 0);
+
+			diff_t d = {.additions=vector_new(sizeof(add_t)), .deletions=vector_new(sizeof(del_t))};
+			d.author = session->user_ses->user.index;
+			d.time = (uint64_t)time(NULL);
+
+			vector_pushcpy(&d.deletions, &(del_t){.txt=txt.current, .pos=0});
+
+			int saved = add_diff(&txt, &d, "");
+
+			vector_free(&d.additions);
+			vector_free(&d.deletions);
+
+			if (!saved) {
+				respond_error(session, 500, "Failed to save article");
+				unlock_article(session->ctx, flattened.data, flattened.length);
+
+				txt_free(&txt);
+				filemap_object_free(&session->ctx->article_fmap, &obj);
+				vector_free(&flattened);
+				vector_free(&wpath);
+				return;
+			}
+		}
+
 		data->ty = article_dead;
 		
 		filemap_object new_obj = filemap_push(&session->ctx->article_fmap, obj.fields, obj.lengths);
 		filemap_list_update(&session->ctx->article_id, &article, &new_obj);
 		filemap_delete_object(&session->ctx->article_fmap, &obj);
+		pagecache_invalidate(&session->ctx->pages, article.index);
 		
 		vector_t referenced_by = {.data=obj.fields[article_items_i], .size=8, .length=data->referenced_by};
 		rerender_articles(session->ctx, &referenced_by, NULL, NULL);
@@ -2228,13 +2581,9 @@ void route(session_t* session, request* req) {
 		//remove from alphabetical listing
 		filemap_ordered_remove_id(&session->ctx->articles_alphabetical, path_abc_order(vector_getstr(&req->path, req->path.length-1)), &article);
 		
-		vector_t wpath = flatten_wikipath(&req->path);
-		ctx_cache_remove(session->ctx, wpath.data);
+		textcache_remove(&session->ctx->cached, wpath.data);
 
 		if (!img) {
-			text_t txt = txt_new(wpath.data);
-			read_txt(&txt, 0, 0);
-
 			vector_t refs = vector_new(sizeof(vector_t));
 			vector_t keywords = vector_new(sizeof(search_token));
 
@@ -2245,23 +2594,12 @@ void route(session_t* session, request* req) {
 
 			refs_free(&refs);
 			article_words_free(&keywords);
-
-			diff_t d = {.additions=vector_new(sizeof(add_t)), .deletions=vector_new(sizeof(del_t))};
-			d.author = session->user_ses->user.index;
-			d.time = (uint64_t)time(NULL);
-
-			vector_pushcpy(&d.deletions, &(del_t){.txt=txt.current, .pos=0});
-
-			add_diff(&txt, &d, "");
-
-			vector_free(&d.additions);
-			vector_free(&d.deletions);
 			txt_free(&txt);
 		}
 		
 		unlock_article(session->ctx, flattened.data, flattened.length);
 		
-		drop(vector_popptr(&req->path));
+		vector_popptr(&req->path);
 
 		vector_t redir = flatten_url(&req->path);
 		vector_insertstr(&redir, 0, "/wiki/");
@@ -2274,8 +2612,14 @@ void route(session_t* session, request* req) {
 		vector_free(&redir);
 
 	} else if (strcmp(base, "wiki") == 0) {
+		//before the article is read
+		unsigned long page_generation = atomic_load(&session->ctx->pages.generation);
+		unsigned long page_version = atomic_load(&session->ctx->page_version);
+
 		filemap_object obj;
-		if (!route_article(session, req, &obj)) return;
+		uint64_t idx;
+		validators v = {.personal=1, .cache=req->method == GET, .gzip=accepts_encoding(req, "gzip"), .vary=1};
+		if (!route_article(session, req, &obj, &idx, &v)) return;
 
 		articledata_t* data = (articledata_t*)obj.fields[article_data_i];
 		vector_t path = vector_from_strings(obj.fields[article_path_i], data->path_length);
@@ -2290,7 +2634,7 @@ void route(session_t* session, request* req) {
 
 		vector_iterator iter = vector_iterate(&path);
 		while (vector_next(&iter)) {
-			char** sub_args = heap(sizeof(char*[2]));
+			char** sub_args = arena_alloc(&req->arena, sizeof(char*[2]));
 
 			sub_args[0] = vector_getstr(&urls, iter.i-1);
 			sub_args[1] = *(char**)iter.x;
@@ -2298,6 +2642,16 @@ void route(session_t* session, request* req) {
 			vector_pushcpy(&path_arg, &(template_args){.sub_args=sub_args});
 		}
 
+		//rendered once for every viewer, the controls are spliced in per request
+		char* body = NULL;
+		unsigned long body_len;
+		char controls_slot[1] = "";
+		template_splice splice = {.arg=controls_slot, .at=-1};
+
+		char* fragments[PAGE_FRAGMENTS] = {NULL};
+		unsigned long fragment_lens[PAGE_FRAGMENTS] = {0};
+		int controls = 0;
+
 		switch (data->ty) {
 			case article_img:
 			case article_text: {
@@ -2305,8 +2659,7 @@ void route(session_t* session, request* req) {
 					.size = sizeof(uint64_t),
 					.length = data->contributors};
 
-				int is_contrib =
-					session->user_ses ? vector_search(&contribs, &session->user_ses->user.index)>0 : 0;
+				controls = article_controls(session, data, &contribs);
 				
 				vector_t contribs_arg = vector_new(sizeof(template_args));
 				vector_t contribs_strs = vector_new(sizeof(char*));
@@ -2317,27 +2670,23 @@ void route(session_t* session, request* req) {
 					if (!list_user.exists) continue;
 
 					filemap_field uname = filemap_cpyfield(&session->ctx->user_fmap, &list_user, user_name_i);
-					vector_pushcpy(&contribs_arg, &(template_args){.sub_args=heapcpy(sizeof(char**), &uname.val.data)});
+					vector_pushcpy(&contribs_arg, &(template_args){.sub_args=arena_cpy(&req->arena, sizeof(char**), &uname.val.data)});
 					vector_pushcpy(&contribs_strs, &uname.val.data);
 				}
 
-				unsigned char perms = get_perms(session);
-
 				vector_t url = flatten_url(&path);
+				int img = data->ty == article_img;
 
-				if (data->ty == article_img) {
-					respond_template(session, 200, "article", title, 1, 1,
-							0, //cannot edit image
-							is_contrib && (perms >= PERMS_DELETE),
-							&path_arg, &contribs_arg, title, NULL, url.data);
+				body = page_render(session->ctx, "article", title, &splice, &body_len, 1, img,
+						&path_arg, &contribs_arg, title, img ? NULL : obj.fields[article_html_i], url.data, splice.arg);
 
-				} else {
-					respond_template(session, 200, "article", title, 1, 0,
-							is_contrib && (perms >= PERMS_EDIT),
-							is_contrib && (perms >= PERMS_DELETE),
-							&path_arg, &contribs_arg, title, obj.fields[article_html_i], url.data);
+				for (int i=0; body && i<PAGE_FRAGMENTS; i++) {
+					fragments[i] = template_render(session->ctx, "controls", &fragment_lens[i],
+							(i & CONTROLS_EDIT) != 0, (i & CONTROLS_DELETE) != 0, url.data);
 				}
 
+				if (!body) respond(session, 500, "", 0, NULL, 0);
+
 				vector_free(&url);
 				vector_free_strings(&contribs_strs);
 
@@ -2346,9 +2695,13 @@ void route(session_t* session, request* req) {
 
 			case article_group: {
 				vector_t item_strs = vector_new(sizeof(char*));
-				vector_t items_arg = article_group_list(session->ctx, &obj, data, &item_strs);
+				vector_t items_arg = article_group_list(session->ctx, &req->arena, &obj, data, &item_strs);
+
+				body = page_render(session->ctx, "article", title, NULL, &body_len, 0, 0,
+						&path_arg, &items_arg, title, NULL, NULL, NULL);
+
+				if (!body) respond(session, 500, "", 0, NULL, 0);
 
-				respond_template(session, 200, "article", title, 0,0,0,0, &path_arg, &items_arg, title, NULL, NULL);
 				vector_free_strings(&item_strs);
 				break;
 			}
@@ -2359,6 +2712,16 @@ void route(session_t* session, request* req) {
 			}
 		}
 
+		if (body) {
+			cached_page* page = page_new(body, body_len, splice.at >= 0 ? (unsigned long)splice.at : body_len,
+					fragments, fragment_lens, page_version);
+
+			if (v.cache) pagecache_insert(&session->ctx->pages, idx, page_generation, page);
+
+			respond_page(session, 200, page, controls, v.gzip, v.headers, v.valid ? 3 : 0);
+			cached_page_release(page);
+		}
+
 		filemap_object_free(&session->ctx->article_fmap, &obj);
 
 		vector_free(&path); //references obj
@@ -2366,7 +2729,8 @@ void route(session_t* session, request* req) {
 
 	} else if (strcmp(base, "wikisrc")==0) {
 		filemap_object obj;
-		if (!route_article(session, req, &obj)) return;
+		validators v = {.personal=0};
+		if (!route_article(session, req, &obj, NULL, &v)) return;
 
 		articledata_t* data = (articledata_t*)obj.fields[article_data_i];
 		vector_t path = vector_from_strings(obj.fields[article_path_i], data->path_length);
@@ -2375,18 +2739,82 @@ void route(session_t* session, request* req) {
 
 		switch (data->ty) {
 			case article_img: {
-				cached* cache = ctx_fopen(session->ctx, wpath.data);
+				//straight from disk, images can be large
+				int fd = open(wpath.data, O_RDONLY);
+				struct stat st;
+
+				if (fd < 0 || fstat(fd, &st) != 0) {
+					if (fd >= 0) close(fd);
+					respond_error(session, 404, "Image is missing");
+					break;
+				}
+
+				char* mime = obj.fields[article_html_i];
+				unsigned long size = (unsigned long)st.st_size;
 
-				respond(session, 200, cache->data, cache->len, &(char*[2]){"Content-Type", obj.fields[article_html_i]}, 1);
+				vector_t ranges = vector_new(sizeof(byte_range));
+				int nranges = parse_ranges(req, v.etag, v.modified, size, &ranges);
 
-				ctx_cache_done(session->ctx, cache, wpath.data);
+				if (nranges == -1) {
+					char* headers[2+EXTRA_HEADERS_MAX][2];
+					int headers_len = headers_join(headers, (char*[2][2]){{"Content-Type", mime}, {"Accept-Ranges", "bytes"}}, 2, v.headers, 3);
+
+					respond_file(session, 200, fd, size, headers, headers_len);
+				} else if (nranges == 0) {
+					close(fd);
+					respond_unsatisfiable(session, size);
+				} else {
+					respond_ranges(session, &ranges, size, mime, NULL, fd, v.headers, 3);
+				}
+
+				vector_free(&ranges);
 
 				break;
 			}
 			case article_text: {
+				vector_t params = query_find(&req->query, (char*[]){"rev"}, 1, 1);
+
+				//an old revision, rebuilt from the nearest keyframe
+				if (params.length == 1) {
+					char* rev_str = vector_getstr(&params, 0);
+					char* rev_end;
+					uint64_t rev = (uint64_t)strtoull(rev_str, &rev_end, 10);
+
+					char* text = *rev_str && !*rev_end ? txt_revision(wpath.data, rev) : NULL;
+
+					if (text) {
+						respond(session, 200, text, strlen(text), (char*[2][2]){{"Content-Type", "text/plain"}}, 1);
+						drop(text);
+					} else {
+						respond_error(session, 404, "No such revision");
+					}
+
+					vector_free(&params);
+					break;
+				}
+
+				vector_free(&params);
+
 				cached* current = article_current(session->ctx, &wpath);
-				respond(session, 200, current->data, current->len, &(char*[2]){"Content-Type", "text/plain"}, 1);
-				ctx_cache_done(session->ctx, current, wpath.data);
+
+				vector_t ranges = vector_new(sizeof(byte_range));
+				int nranges = parse_ranges(req, v.etag, v.modified, current->len, &ranges);
+
+				if (nranges == -1) {
+					char* headers[2+EXTRA_HEADERS_MAX][2];
+					int headers_len = headers_join(headers, (char*[2][2]){{"Content-Type", "text/plain"}, {"Accept-Ranges", "bytes"}}, 2, v.headers, 3);
+
+					//straight from the cache entry, released once sent
+					atomic_fetch_add(&current->refs, 1);
+					respond_ref(session, 200, current->data, current->len, headers, headers_len, cached_release_ref, current);
+				} else if (nranges == 0) {
+					respond_unsatisfiable(session, current->len);
+				} else {
+					respond_ranges(session, &ranges, current->len, "text/plain", current->data, -1, v.headers, 3);
+				}
+
+				vector_free(&ranges);
+				cached_release(current);
 				break;
 			}
 
@@ -2399,6 +2827,98 @@ void route(session_t* session, request* req) {
 		vector_free(&wpath);
 		vector_free(&path);
 	
+	} else if (strcmp(base, "history")==0) {
+		filemap_object obj;
+		if (!route_article(session, req, &obj, NULL, NULL)) return;
+
+		articledata_t* data = (articledata_t*)obj.fields[article_data_i];
+		if (data->ty != article_text) {
+			respond_error(session, 422, "Only text articles have a history");
+			filemap_object_free(&session->ctx->article_fmap, &obj);
+			return;
+		}
+
+		vector_t path = vector_from_strings(obj.fields[article_path_i], data->path_length);
+		vector_t wpath = flatten_wikipath(&path);
+		vector_t url = flatten_url(&path);
+
+		uint64_t page = 0;
+		vector_t params = query_find(&req->query, (char*[]){"page"}, 1, 1);
+		if (params.length == 1) page = (uint64_t)strtoull(vector_getstr(&params, 0), NULL, 10);
+		vector_free(&params);
+
+		vector_t revs = vector_new(sizeof(rev_summary));
+		uint64_t total;
+
+		//files from before the index get one on their first view
+		if (!txt_history(wpath.data, page*PAGE_SIZE, PAGE_SIZE, &revs, &total)) {
+			vector_t flattened = flatten_path(&path);
+
+			lock_article(session->ctx, flattened.data, flattened.length);
+			rev_index_build(wpath.data);
+			unlock_article(session->ctx, flattened.data, flattened.length);
+
+			txt_history(wpath.data, page*PAGE_SIZE, PAGE_SIZE, &revs, &total);
+			vector_free(&flattened);
+		}
+
+		//everyone on the page is looked up once, however many rows are theirs
+		vector_t authors = vector_new(sizeof(uint64_t));
+		vector_t author_names = vector_new(sizeof(char*));
+
+		vector_t rows = vector_new(sizeof(template_args));
+
+		vector_iterator iter = vector_iterate(&revs);
+		while (vector_next(&iter)) {
+			rev_summary* rev = iter.x;
+
+			unsigned long author_i = vector_search(&authors, &rev->author);
+			if (!author_i) {
+				filemap_partial_object list_user = filemap_get_idx(&session->ctx->user_id, rev->author);
+				filemap_field uname = list_user.exists ? filemap_cpyfield(&session->ctx->user_fmap, &list_user, user_name_i)
+					: (filemap_field){.exists=0};
+
+				char* name = uname.exists ? uname.val.data : heapcpystr("nobody");
+
+				vector_pushcpy(&authors, &rev->author);
+				vector_pushcpy(&author_names, &name);
+				author_i = authors.length;
+			}
+
+			char date[32];
+			struct tm tm;
+			time_t made = (time_t)rev->time;
+			gmtime_r(&made, &tm);
+			strftime(date, 32, "%Y-%m-%d %H:%M", &tm);
+
+			char** sub_args = arena_alloc(&req->arena, sizeof(char*[6]));
+			sub_args[0] = url.data;
+			sub_args[1] = arena_str(&req->arena, "%llu", (unsigned long long)rev->rev);
+			sub_args[2] = vector_getstr(&author_names, author_i-1);
+			sub_args[3] = arena_cpystr(&req->arena, date);
+			sub_args[4] = arena_str(&req->arena, "%llu", (unsigned long long)rev->added);
+			sub_args[5] = arena_str(&req->arena, "%llu", (unsigned long long)rev->deleted);
+
+			vector_pushcpy(&rows, &(template_args){.sub_args=sub_args});
+		}
+
+		char* title = vector_getstr(&path, path.length-1);
+		char* older = arena_str(&req->arena, "%llu", (unsigned long long)page+1);
+		char* newer = arena_str(&req->arena, "%llu", (unsigned long long)(page > 0 ? page-1 : 0));
+
+		respond_template(session, 200, "history", "History", rows.length > 0, (page+1)*PAGE_SIZE < total, page > 0,
+				&rows, url.data, title ? title : "root", older, newer);
+
+		vector_free(&rows);
+		vector_free_strings(&author_names);
+		vector_free(&authors);
+		vector_free(&revs);
+
+		filemap_object_free(&session->ctx->article_fmap, &obj);
+		vector_free(&url);
+		vector_free(&wpath);
+		vector_free(&path);
+
 	} else if (strcmp(base, "users")==0) {
 		
 		filemap_iterator iter = filemap_list_iterate(&session->ctx->user_id);
@@ -2424,7 +2944,7 @@ void route(session_t* session, request* req) {
 				filemap_partial_object* list_user = resiter.x;
 
 				filemap_field uname = filemap_cpyfield(&session->ctx->user_fmap, list_user, user_name_i);
-				vector_pushcpy(&user_args, &(template_args){.sub_args=heapcpy(sizeof(char**), &uname.val.data)});
+				vector_pushcpy(&user_args, &(template_args){.sub_args=arena_cpy(&req->arena, sizeof(char**), &uname.val.data)});
 				vector_pushcpy(&unames, &uname.val.data);
 			}
 
@@ -2438,15 +2958,30 @@ void route(session_t* session, request* req) {
 		}
 
 	} else {
-		resource* res = map_find(&session->ctx->resources,
+		assets_t* assets = assets_read_lock(session->ctx);
+		resource* res = map_find(&assets->resources,
 														 vector_get(&req->path, req->path.length - 1));
 
 		if (!res) {
+			assets_read_unlock(session->ctx);
 			respond_error(session, 404, "Page not found");
 			return;
 		}
 
-		respond(session, 200, res->content, res->len,
-						&(char*[2]){"Content-Type", res->mime}, 1);
+		respond_resource(session, req, assets, res);
+		assets_read_unlock(session->ctx);
 	}
 }
+
+//resources dont touch disk or locks, so they are answered without a worker
+int route_static(session_t* session, request* req) {
+	if (req->method != GET || req->path.length != 1) return 0;
+
+	assets_t* assets = assets_read_lock(session->ctx);
+
+	resource* res = map_find(&assets->resources, vector_get(&req->path, 0));
+	if (res) respond_resource(session, req, assets, res);
+
+	assets_read_unlock(session->ctx);
+	return res != NULL;
+}
@@ -12,4 +12,8 @@
 #include "locktable.h"
 #include "util.h"
 #include "vector.h"
+#include "context.h"
 vector_t flatten_wikipath(vector_t* path);
+int render_article(ctx_t* ctx, char** article, int render, vector_t* refs, vector_t* words);
+void article_words_free(vector_t* toks);
+void refs_free(vector_t* refs);
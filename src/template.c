@@ -0,0 +1,234 @@
+// templates compiled into flat op programs, shared with templategen
+
+#include <stdint.h>
+#include <string.h>
+
+#include "event2/buffer.h"
+
+#include "util.h"
+#include "vector.h"
+
+typedef enum {
+	op_literal, //len bytes of the template text at offset
+	op_escape, //argument, html escaped
+	op_raw, //argument as is
+	op_cond, //jumps past its block if the condition doesnt hold
+	op_loop //runs its block once per item, then jumps past it
+} template_opcode;
+
+typedef struct {
+	template_opcode code;
+
+	unsigned long idx; //argument, condition or loop
+	char inverted; //inverted condition
+
+	unsigned long offset; //literal, into template text
+	unsigned long len;
+
+	unsigned long jump; //first op after the block
+} template_op;
+
+typedef struct {
+	int* cond_args;
+	vector_t** loop_args;
+	char** sub_args;
+} template_args;
+
+//unescaped argument left out of the output, to be spliced in precompressed
+typedef struct {
+	char* arg;
+	long at; //offset it would have been written at, -1 if never substituted
+} template_splice;
+
+//reserved space the page is written into, possibly over several chunks
+typedef struct {
+	struct evbuffer_iovec vec[2];
+	int vec_len;
+	int i; //current chunk
+	unsigned long fill; //of the current chunk
+	unsigned long at; //total written
+} template_out;
+
+void template_write(template_out* out, char* data, unsigned long len) {
+	out->at += len;
+
+	while (len) {
+		struct evbuffer_iovec* vec = &out->vec[out->i];
+		unsigned long room = vec->iov_len - out->fill;
+
+		if (room == 0) {
+			out->i++;
+			out->fill = 0;
+			continue;
+		}
+
+		unsigned long n = len < room ? len : room;
+		memcpy((char*)vec->iov_base + out->fill, data, n);
+
+		out->fill += n;
+		data += n;
+		len -= n;
+	}
+}
+
+//render functions generated by templategen, see TEMPLATE_CODEGEN
+typedef unsigned long (*template_length_fn)(template_args* args, template_splice* splice);
+typedef void (*template_run_fn)(template_out* out, template_args* args, template_splice* splice);
+
+typedef struct {
+	char* name;
+	uint64_t hash; //of the source, stale entries are ignored
+	template_length_fn length;
+	template_run_fn run;
+} template_compiled;
+
+//compiled at load, rendered in one pass over ops
+typedef struct {
+	vector_t text; //literals, with %% and !!% already unescaped
+	vector_t ops; //template_op
+
+	unsigned long max_args; //required arguments
+	unsigned long max_cond;
+	unsigned long max_loop;
+
+	//generated render functions, NULL to interpret ops
+	template_length_fn length;
+	template_run_fn run;
+} template_t;
+
+typedef struct {
+	unsigned long max_args;
+	unsigned long max_cond;
+	unsigned long max_loop;
+} template_maxes;
+
+void template_literal(template_t* template, unsigned long* lit_start) {
+	if (template->text.length > *lit_start) {
+		template_op op = {.code=op_literal, .offset=*lit_start, .len=template->text.length - *lit_start};
+		vector_pushcpy(&template->ops, &op);
+	}
+
+	*lit_start = template->text.length;
+}
+
+//returns length read including the closing !%, 0 if the template ended first
+//maxes are per block and merged upwards, the number of arguments callers pass depends on it
+unsigned long template_compile(template_t* template, char* data, template_maxes* max) {
+	char* read_cursor = data;
+	unsigned long lit_start = template->text.length;
+
+	while (*read_cursor) {
+		if (strncmp(read_cursor, "!%", 2)==0) {
+			if (read_cursor > data && *(read_cursor-1)=='!') {
+				read_cursor++;
+				vector_pushcpy(&template->text, "%");
+			} else {
+				template_literal(template, &lit_start);
+				return (read_cursor+2)-data;
+			}
+			
+		} else if (*read_cursor == '%') {
+			read_cursor++;
+
+			//escape
+			if (*read_cursor == '%') {
+				vector_pushcpy(&template->text, "%");
+
+			//condition
+			} else if (*read_cursor == '!') {
+				read_cursor++;
+				template_literal(template, &lit_start);
+
+				template_op cond = {.code=op_cond, .inverted=0};
+
+				if (*read_cursor == '*') {
+					cond.code = op_loop;
+					read_cursor++;
+				} else if (*read_cursor == '!') {
+					cond.inverted = 1;
+					read_cursor++;
+				}
+
+				cond.idx = *read_cursor - '0';
+				if (cond.code==op_loop && cond.idx >= max->max_loop)
+					max->max_loop = cond.idx+1;
+				else if (cond.idx >= max->max_cond)
+					max->max_cond = cond.idx+1;
+
+				unsigned long cond_at = template->ops.length;
+				vector_pushcpy(&template->ops, &cond);
+
+				char* cond_start = ++read_cursor;
+
+				template_maxes insertion = {0};
+				read_cursor += template_compile(template, cond_start, &insertion);
+
+				if (insertion.max_args > max->max_args)
+					max->max_args = insertion.max_args;
+				
+				if (insertion.max_cond > max->max_cond)
+					max->max_cond = insertion.max_cond;
+
+				if (insertion.max_loop > max->max_loop)
+					max->max_loop = insertion.max_loop;
+
+				((template_op*)vector_get(&template->ops, cond_at))->jump = template->ops.length;
+
+				lit_start = template->text.length;
+				continue;
+				
+			//index subsitution
+			} else {
+				template_literal(template, &lit_start);
+
+				template_op sub = {.code=op_escape};
+
+				if (*read_cursor == '#') {
+					sub.code = op_raw;
+					read_cursor++;
+				}
+
+				sub.idx = *read_cursor - '0';
+				if (sub.idx >= max->max_args) max->max_args = sub.idx+1;
+
+				vector_pushcpy(&template->ops, &sub);
+
+				read_cursor++;
+				lit_start = template->text.length;
+				continue;
+			}
+		} else {
+			vector_pushcpy(&template->text, read_cursor);
+		}
+			
+		read_cursor++;
+	}
+
+	template_literal(template, &lit_start);
+	return 0;
+}
+
+template_t template_new(char* data) {
+	template_t template = {.text=vector_new(1), .ops=vector_new(sizeof(template_op))};
+
+	template_maxes max = {0};
+	template_compile(&template, data, &max);
+
+	template.max_args = max.max_args;
+	template.max_cond = max.max_cond;
+	template.max_loop = max.max_loop;
+
+	return template;
+}
+
+//fnv-1a, matches generated functions to the templates they were built from
+uint64_t template_hash(char* data) {
+	uint64_t hash = 0xcbf29ce484222325;
+
+	for (; *data; data++) {
+		hash ^= (unsigned char)*data;
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
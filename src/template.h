@@ -0,0 +1,65 @@
+// Automatically generated header.
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "event2/buffer.h"
+#include "util.h"
+#include "vector.h"
+typedef enum {
+	op_literal, //len bytes of the template text at offset
+	op_escape, //argument, html escaped
+	op_raw, //argument as is
+	op_cond, //jumps past its block if the condition doesnt hold
+	op_loop //runs its block once per item, then jumps past it
+} template_opcode;
+typedef struct {
+	template_opcode code;
+
+	unsigned long idx; //argument, condition or loop
+	char inverted; //inverted condition
+
+	unsigned long offset; //literal, into template text
+	unsigned long len;
+
+	unsigned long jump; //first op after the block
+} template_op;
+typedef struct {
+	int* cond_args;
+	vector_t** loop_args;
+	char** sub_args;
+} template_args;
+typedef struct {
+	char* arg;
+	long at; //offset it would have been written at, -1 if never substituted
+} template_splice;
+typedef struct {
+	struct evbuffer_iovec vec[2];
+	int vec_len;
+	int i; //current chunk
+	unsigned long fill; //of the current chunk
+	unsigned long at; //total written
+} template_out;
+void template_write(template_out* out, char* data, unsigned long len);
+typedef unsigned long (*template_length_fn)(template_args* args, template_splice* splice);
+typedef void (*template_run_fn)(template_out* out, template_args* args, template_splice* splice);
+typedef struct {
+	char* name;
+	uint64_t hash; //of the source, stale entries are ignored
+	template_length_fn length;
+	template_run_fn run;
+} template_compiled;
+typedef struct {
+	vector_t text; //literals, with %% and !!% already unescaped
+	vector_t ops; //template_op
+
+	unsigned long max_args; //required arguments
+	unsigned long max_cond;
+	unsigned long max_loop;
+
+	//generated render functions, NULL to interpret ops
+	template_length_fn length;
+	template_run_fn run;
+} template_t;
+template_t template_new(char* data);
+uint64_t template_hash(char* data);
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "tinydir.h"
+#include "util.h"
+#include "vector.h"
+
+#include "template.h"
+
+//build time step, templates are compiled into render functions registered by main
+//same walk as the interpreter, with literal lengths summed up front and argument slots fixed
+
+const char* GEN_EXT = ".html";
+const char* GEN_GLOBAL = "global"; //split at load instead
+
+//as a c string literal, split after newlines
+void gen_literal(FILE* out, char* data, unsigned long len) {
+	fprintf(out, "\"");
+
+	for (unsigned long i=0; i<len; i++) {
+		unsigned char c = data[i];
+
+		if (c=='"' || c=='\\' || c=='?') fprintf(out, "\\%c", c);
+		else if (c=='\n') fprintf(out, i+1<len ? "\\n\"\n\t\t\"" : "\\n");
+		else if (c=='\t') fprintf(out, "\\t");
+		else if (c<0x20 || c>=0x7f) fprintf(out, "\\%03o", c);
+		else fputc(c, out);
+	}
+
+	fprintf(out, "\"");
+}
+
+void gen_indent(FILE* out, int depth) {
+	for (int i=0; i<depth; i++) fputc('\t', out);
+}
+
+//ops [pc, end), args named args, args1... by loop depth
+void gen_block(FILE* out, template_t* template, unsigned long pc, unsigned long end, int loop_depth, int indent, int length) {
+	template_op* ops = template->ops.data;
+
+	char args[32];
+	if (loop_depth) snprintf(args, 32, "args%i", loop_depth);
+	else snprintf(args, 32, "args");
+
+	if (length) {
+		unsigned long literal_len = 0;
+
+		for (unsigned long i=pc; i<end; i++) {
+			if (ops[i].code == op_literal) literal_len += ops[i].len;
+			else if (ops[i].code == op_cond || ops[i].code == op_loop) i = ops[i].jump-1;
+		}
+
+		if (literal_len) {
+			gen_indent(out, indent);
+			fprintf(out, "len += %lu;\n", literal_len);
+		}
+	}
+
+	while (pc < end) {
+		template_op* op = &ops[pc];
+
+		switch (op->code) {
+			case op_literal: {
+				if (length) break;
+
+				gen_indent(out, indent);
+				fprintf(out, "template_write(out, ");
+				gen_literal(out, (char*)template->text.data + op->offset, op->len);
+				fprintf(out, ", %lu);\n", op->len);
+				break;
+			}
+
+			case op_escape: {
+				gen_indent(out, indent);
+
+				if (length) fprintf(out, "len += escaped_length(%s->sub_args[%lu], %s->sub_args[%lu]+strlen(%s->sub_args[%lu]));\n", args, op->idx, args, op->idx, args, op->idx);
+				else fprintf(out, "template_escape(out, %s->sub_args[%lu]);\n", args, op->idx);
+
+				break;
+			}
+
+			case op_raw: {
+				gen_indent(out, indent);
+				fprintf(out, "if (!splice || %s->sub_args[%lu] != splice->arg) ", args, op->idx);
+
+				if (length) fprintf(out, "len += strlen(%s->sub_args[%lu]);\n", args, op->idx);
+				else fprintf(out, "template_write(out, %s->sub_args[%lu], strlen(%s->sub_args[%lu]));\n", args, op->idx, args, op->idx);
+
+				if (!length) {
+					gen_indent(out, indent);
+					fprintf(out, "else splice->at = (long)out->at;\n");
+				}
+
+				break;
+			}
+
+			case op_cond: {
+				gen_indent(out, indent);
+				fprintf(out, "if (%s%s->cond_args[%lu]) {\n", op->inverted ? "!" : "", args, op->idx);
+
+				gen_block(out, template, pc+1, op->jump, loop_depth, indent+1, length);
+
+				gen_indent(out, indent);
+				fprintf(out, "}\n");
+
+				pc = op->jump;
+				continue;
+			}
+
+			case op_loop: {
+				int item = loop_depth+1;
+
+				gen_indent(out, indent);
+				fprintf(out, "if (%s->loop_args[%lu]) {\n", args, op->idx);
+
+				gen_indent(out, indent+1);
+				fprintf(out, "vector_iterator iter%i = vector_iterate(%s->loop_args[%lu]);\n", item, args, op->idx);
+				gen_indent(out, indent+1);
+				fprintf(out, "while (vector_next(&iter%i)) {\n", item);
+				gen_indent(out, indent+2);
+				fprintf(out, "template_args* args%i = iter%i.x;\n", item, item);
+
+				gen_block(out, template, pc+1, op->jump, item, indent+2, length);
+
+				gen_indent(out, indent+1);
+				fprintf(out, "}\n");
+
+				//items are consumed by the render, as in the interpreter
+				if (!length) {
+					fprintf(out, "\n");
+					gen_indent(out, indent+1);
+					fprintf(out, "vector_free(%s->loop_args[%lu]);\n", args, op->idx);
+				}
+
+				gen_indent(out, indent);
+				fprintf(out, "}\n");
+
+				pc = op->jump;
+				continue;
+			}
+		}
+
+		pc++;
+	}
+}
+
+void gen_template(FILE* out, unsigned long i, template_t* template) {
+	fprintf(out, "unsigned long template_gen%lu_length(template_args* args, template_splice* splice) {\n", i);
+	fprintf(out, "\tunsigned long len = 0;\n");
+	gen_block(out, template, 0, template->ops.length, 0, 1, 1);
+	fprintf(out, "\treturn len;\n}\n\n");
+
+	fprintf(out, "void template_gen%lu_run(template_out* out, template_args* args, template_splice* splice) {\n", i);
+	gen_block(out, template, 0, template->ops.length, 0, 1, 0);
+	fprintf(out, "}\n\n");
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		fprintf(stderr, "need templates directory and output file as arguments\n");
+		return 1;
+	}
+
+	FILE* out = fopen(argv[2], "wb");
+	if (!out) err(1, "couldnt open %s", argv[2]);
+
+	fprintf(out, "// Generated by templategen, do not edit.\n\n");
+	fprintf(out, "#include <string.h>\n\n#include \"vector.h\"\n\n#include \"template.h\"\n#include \"web.h\"\n\n");
+
+	vector_t names = vector_new(sizeof(char*));
+	vector_t hashes = vector_new(sizeof(uint64_t));
+
+	tinydir_dir dir;
+	if (tinydir_open(&dir, argv[1]) == -1) err(1, "couldnt open %s", argv[1]);
+
+	for (;dir.has_next; tinydir_next(&dir)) {
+		tinydir_file file;
+		tinydir_readfile(&dir, &file);
+
+		unsigned long name_len = strlen(file.name);
+		if (file.is_dir || name_len <= strlen(GEN_EXT) || strcmp(file.name + name_len - strlen(GEN_EXT), GEN_EXT) != 0)
+			continue;
+
+		char* name = heapcpy(name_len - strlen(GEN_EXT) + 1, file.name);
+		name[name_len - strlen(GEN_EXT)] = 0;
+
+		if (strcmp(name, GEN_GLOBAL) == 0) {
+			drop(name);
+			continue;
+		}
+
+		FILE* f_in = fopen(file.path, "rb");
+		if (!f_in) err(1, "couldnt open %s", file.path);
+
+		fseek(f_in, 0, SEEK_END);
+		unsigned long len = ftell(f_in);
+		char* data = heap(len+1);
+		fseek(f_in, 0, SEEK_SET);
+		fread(data, len, 1, f_in);
+
+		data[len] = 0;
+		fclose(f_in);
+
+		template_t template = template_new(data);
+		uint64_t hash = template_hash(data);
+
+		gen_template(out, names.length, &template);
+
+		vector_pushcpy(&names, &name);
+		vector_pushcpy(&hashes, &hash);
+
+		vector_free(&template.text);
+		vector_free(&template.ops);
+		drop(data);
+	}
+
+	tinydir_close(&dir);
+
+	fprintf(out, "template_compiled compiled_templates[] = {\n");
+
+	for (unsigned long i=0; i<names.length; i++) {
+		char* name = vector_getstr(&names, i);
+
+		fprintf(out, "\t{.name=");
+		gen_literal(out, name, strlen(name));
+		fprintf(out, ", .hash=0x%llxull, .length=template_gen%lu_length, .run=template_gen%lu_run},\n",
+				(unsigned long long)*(uint64_t*)vector_get(&hashes, i), i, i);
+	}
+
+	//never empty, so the array is valid c
+	fprintf(out, "\t{.name=NULL}\n};\n\n");
+	fprintf(out, "unsigned long compiled_templates_len = %lu;\n", names.length);
+
+	vector_free_strings(&names);
+	vector_free(&hashes);
+
+	if (fclose(out)) err(1, "couldnt write %s", argv[2]);
+
+	return 0;
+}
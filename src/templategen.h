@@ -0,0 +1,18 @@
+// Automatically generated header.
+
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "tinydir.h"
+#include "util.h"
+#include "vector.h"
+#include "template.h"
+extern char* GEN_EXT;
+extern char* GEN_GLOBAL;
+void gen_literal(FILE* out, char* data, unsigned long len);
+void gen_indent(FILE* out, int depth);
+void gen_block(FILE* out, template_t* template, unsigned long pc, unsigned long end, int loop_depth, int indent, int length);
+void gen_template(FILE* out, unsigned long i, template_t* template);
+int main(int argc, char** argv);
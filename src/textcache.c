@@ -0,0 +1,373 @@
+// current text of articles, read by /edit and /wikisrc
+// sharded by name, each shard evicts with clock and admits against a frequency sketch (tinylfu)
+// so a burst of one off reads cant push out articles that are read all the time
+// concurrent misses for the same name wait on a single load
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include <stdatomic.h>
+
+#include "util.h"
+#include "vector.h"
+#include "hashtable.h"
+
+#define TEXTCACHE_SHARDS 16
+#define SKETCH_ROWS 4
+#define SKETCH_WIDTH 4096 //per shard, power of two
+#define SKETCH_MAX 15 //counters saturate, as in a 4 bit sketch
+#define SKETCH_SAMPLE 10*SKETCH_WIDTH //increments before every counter is halved
+
+typedef struct {
+	char* name;
+	char* data;
+	unsigned long len;
+
+	atomic_ulong refs; //readers, plus one while cached
+	atomic_int referenced; //clock bit, set on hits
+} cached;
+
+//a load in progress, freed by whoever leaves it last
+typedef struct {
+	cnd_t done_cnd;
+	int done;
+	cached* result; //referenced for the waiters
+
+	unsigned long waiters; //including the loader
+} textcache_flight;
+
+typedef struct {
+	mtx_t lock;
+	map_t entries; //name -> cached*
+	map_t flights; //name -> textcache_flight*, owned name
+	unsigned long removals; //loads which started before one arent inserted
+	vector_t clock; //cached*, hand sweeps over it
+	unsigned long hand;
+
+	unsigned long size;
+	unsigned long budget;
+
+	unsigned char sketch[SKETCH_ROWS][SKETCH_WIDTH];
+	unsigned long sketch_adds;
+} textcache_shard;
+
+typedef struct {
+	textcache_shard shards[TEXTCACHE_SHARDS];
+
+	atomic_ulong hits;
+	atomic_ulong misses;
+	atomic_ulong evictions;
+	atomic_ulong rejections; //not admitted, read less than what they would replace
+	atomic_ulong coalesced; //misses which waited on another reader's load
+} textcache_t;
+
+//heap text for name, NULL if it cant be read
+typedef char* (*textcache_loader)(char* name, unsigned long* len, void* arg);
+
+//fnv-1a, the high bits pick the shard and the rest index the sketch
+uint64_t textcache_hash(char* name) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+textcache_shard* textcache_shard_of(textcache_t* cache, uint64_t hash) {
+	return &cache->shards[(hash >> 60) % TEXTCACHE_SHARDS];
+}
+
+void textcache_init(textcache_t* cache, unsigned long budget) {
+	for (int i=0; i<TEXTCACHE_SHARDS; i++) {
+		textcache_shard* shard = &cache->shards[i];
+		mtx_init(&shard->lock, mtx_plain);
+
+		shard->entries = map_new();
+		map_configure_string_key(&shard->entries, sizeof(cached*));
+		shard->clock = vector_new(sizeof(cached*));
+		shard->hand = 0;
+
+		shard->flights = map_new();
+		shard->flights.free = free_string;
+		map_configure_string_key(&shard->flights, sizeof(textcache_flight*));
+		shard->removals = 0;
+
+		shard->size = 0;
+		shard->budget = budget/TEXTCACHE_SHARDS;
+
+		memset(shard->sketch, 0, sizeof(shard->sketch));
+		shard->sketch_adds = 0;
+	}
+
+	atomic_init(&cache->hits, 0);
+	atomic_init(&cache->misses, 0);
+	atomic_init(&cache->evictions, 0);
+	atomic_init(&cache->rejections, 0);
+	atomic_init(&cache->coalesced, 0);
+}
+
+//row i uses h1 + i*h2, caller holds the lock
+unsigned long sketch_slot(uint64_t hash, int row) {
+	uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+	return (h1 + row*h2) & (SKETCH_WIDTH-1);
+}
+
+void sketch_add(textcache_shard* shard, uint64_t hash) {
+	for (int row=0; row<SKETCH_ROWS; row++) {
+		unsigned char* counter = &shard->sketch[row][sketch_slot(hash, row)];
+		if (*counter < SKETCH_MAX) (*counter)++;
+	}
+
+	//aging, old popularity fades
+	if (++shard->sketch_adds >= SKETCH_SAMPLE) {
+		for (int row=0; row<SKETCH_ROWS; row++) {
+			for (int i=0; i<SKETCH_WIDTH; i++) shard->sketch[row][i] >>= 1;
+		}
+
+		shard->sketch_adds /= 2;
+	}
+}
+
+unsigned char sketch_estimate(textcache_shard* shard, uint64_t hash) {
+	unsigned char min = SKETCH_MAX;
+
+	for (int row=0; row<SKETCH_ROWS; row++) {
+		unsigned char counter = shard->sketch[row][sketch_slot(hash, row)];
+		if (counter < min) min = counter;
+	}
+
+	return min;
+}
+
+void cached_release(cached* cache) {
+	if (atomic_fetch_sub(&cache->refs, 1) == 1) {
+		drop(cache->name);
+		drop(cache->data);
+		drop(cache);
+	}
+}
+
+//evbuffer cleanup for text queued by reference
+void cached_release_ref(const void* data, size_t len, void* arg) {
+	cached_release(arg);
+}
+
+//caller holds the lock, readers keep their reference
+void textcache_remove_locked(textcache_shard* shard, cached* cache) {
+	map_remove(&shard->entries, &cache->name);
+
+	unsigned long i = vector_search(&shard->clock, &cache);
+	if (i) {
+		vector_remove(&shard->clock, i-1);
+		if (shard->hand >= i && shard->hand > 0) shard->hand--;
+	}
+
+	shard->size -= cache->len;
+	cached_release(cache);
+}
+
+//entries a sweep from the hand would evict to make room for len, without touching the clock
+//unreferenced ones in order first, then the referenced ones it passed, which are added to passed
+void textcache_victims(textcache_shard* shard, unsigned long len, vector_t* victims, vector_t* passed) {
+	unsigned long freed = 0, n = shard->clock.length;
+
+	for (int pass=0; pass<2; pass++) {
+		for (unsigned long i=0; i<n && shard->size - freed + len > shard->budget; i++) {
+			cached* cache = *(cached**)vector_get(&shard->clock, (shard->hand + i) % n);
+			int referenced = atomic_load(&cache->referenced);
+
+			if (pass == 0 && referenced) {
+				vector_pushcpy(passed, &cache);
+				continue;
+			} else if (pass == 1 && !referenced) {
+				continue; //taken on the first pass
+			}
+
+			vector_pushcpy(victims, &cache);
+			freed += cache->len;
+		}
+	}
+}
+
+//caller holds the lock, the returned entry is referenced
+cached* textcache_lookup_locked(textcache_t* cache, textcache_shard* shard, uint64_t hash, char* name) {
+	sketch_add(shard, hash);
+
+	cached** found = map_find(&shard->entries, &name);
+	if (!found) return NULL;
+
+	atomic_fetch_add(&(*found)->refs, 1);
+	atomic_store(&(*found)->referenced, 1);
+	atomic_fetch_add(&cache->hits, 1);
+
+	return *found;
+}
+
+//caller holds the lock, kept if it is read more than what it would replace
+void textcache_admit_locked(textcache_t* cache, textcache_shard* shard, uint64_t hash, cached* entry) {
+	if (entry->len > shard->budget) {
+		atomic_fetch_add(&cache->rejections, 1);
+		return;
+	}
+
+	unsigned char freq = sketch_estimate(shard, hash);
+
+	//either every victim goes and the entry is admitted, or nothing changes
+	vector_t victims = vector_new(sizeof(cached*));
+	vector_t passed = vector_new(sizeof(cached*));
+	textcache_victims(shard, entry->len, &victims, &passed);
+
+	vector_iterator iter = vector_iterate(&victims);
+	while (vector_next(&iter)) {
+		if (sketch_estimate(shard, textcache_hash((*(cached**)iter.x)->name)) >= freq) {
+			atomic_fetch_add(&cache->rejections, 1);
+
+			vector_free(&victims);
+			vector_free(&passed);
+			return;
+		}
+	}
+
+	//second chances the sweep used up
+	iter = vector_iterate(&passed);
+	while (vector_next(&iter)) atomic_store(&(*(cached**)iter.x)->referenced, 0);
+
+	iter = vector_iterate(&victims);
+	while (vector_next(&iter)) {
+		textcache_remove_locked(shard, *(cached**)iter.x);
+		atomic_fetch_add(&cache->evictions, 1);
+	}
+
+	vector_free(&victims);
+	vector_free(&passed);
+
+	atomic_fetch_add(&entry->refs, 1);
+
+	map_insertcpy(&shard->entries, &entry->name, &entry);
+	vector_pushcpy(&shard->clock, &entry);
+	shard->size += entry->len;
+}
+
+//referenced entry, loaded by one reader if missing while the rest wait for it
+//NULL if the load failed, release with cached_release
+cached* textcache_get(textcache_t* cache, char* name, textcache_loader load, void* arg) {
+	uint64_t hash = textcache_hash(name);
+	textcache_shard* shard = textcache_shard_of(cache, hash);
+
+	mtx_lock(&shard->lock);
+
+	cached* entry = textcache_lookup_locked(cache, shard, hash, name);
+	if (entry) {
+		mtx_unlock(&shard->lock);
+		return entry;
+	}
+
+	atomic_fetch_add(&cache->misses, 1);
+
+	textcache_flight** in_flight = map_find(&shard->flights, &name);
+	if (in_flight) {
+		textcache_flight* flight = *in_flight;
+		flight->waiters++;
+		atomic_fetch_add(&cache->coalesced, 1);
+
+		while (!flight->done) cnd_wait(&flight->done_cnd, &shard->lock);
+
+		entry = flight->result;
+		if (entry) atomic_fetch_add(&entry->refs, 1);
+
+		if (--flight->waiters == 0) {
+			if (entry) cached_release(entry);
+			cnd_destroy(&flight->done_cnd);
+			drop(flight);
+		}
+
+		mtx_unlock(&shard->lock);
+		return entry;
+	}
+
+	textcache_flight* flight = heap(sizeof(textcache_flight));
+	cnd_init(&flight->done_cnd);
+	flight->done = 0;
+	flight->result = NULL;
+	flight->waiters = 1;
+
+	char* flight_name = heapcpystr(name);
+	map_insertcpy(&shard->flights, &flight_name, &flight);
+
+	unsigned long removals = shard->removals;
+	mtx_unlock(&shard->lock);
+
+	unsigned long len;
+	char* data = load(name, &len, arg);
+
+	if (data) {
+		entry = heap(sizeof(cached));
+		entry->name = heapcpystr(name);
+		entry->data = data;
+		entry->len = len;
+		atomic_init(&entry->refs, 1);
+		atomic_init(&entry->referenced, 0);
+	}
+
+	mtx_lock(&shard->lock);
+
+	//changed while loading, shared with the waiters but not kept
+	if (entry && shard->removals == removals) textcache_admit_locked(cache, shard, hash, entry);
+
+	//textcache_remove may have detached it, and a newer load taken its place
+	textcache_flight** current = map_find(&shard->flights, &name);
+	if (current && *current == flight) map_remove(&shard->flights, &name);
+
+	flight->done = 1;
+	flight->result = entry;
+	if (entry) atomic_fetch_add(&entry->refs, 1); //for the waiters, dropped by the last
+	cnd_broadcast(&flight->done_cnd);
+
+	if (--flight->waiters == 0) {
+		if (entry) cached_release(entry);
+		cnd_destroy(&flight->done_cnd);
+		drop(flight);
+	}
+
+	mtx_unlock(&shard->lock);
+	return entry;
+}
+
+//call after the article's text changes or it is removed
+//a load already in flight may have read the old text, later misses start their own instead of waiting on it
+void textcache_remove(textcache_t* cache, char* name) {
+	textcache_shard* shard = textcache_shard_of(cache, textcache_hash(name));
+
+	mtx_lock(&shard->lock);
+	shard->removals++;
+
+	map_remove(&shard->flights, &name);
+
+	cached** found = map_find(&shard->entries, &name);
+	if (found) textcache_remove_locked(shard, *found);
+
+	mtx_unlock(&shard->lock);
+}
+
+void textcache_stats(textcache_t* cache, FILE* f) {
+	unsigned long entries = 0, size = 0, budget = 0;
+
+	for (int i=0; i<TEXTCACHE_SHARDS; i++) {
+		textcache_shard* shard = &cache->shards[i];
+
+		mtx_lock(&shard->lock);
+		entries += shard->clock.length;
+		size += shard->size;
+		budget += shard->budget;
+		mtx_unlock(&shard->lock);
+	}
+
+	unsigned long hits = atomic_load(&cache->hits), misses = atomic_load(&cache->misses);
+
+	fprintf(f, "text cache: %lu hits, %lu misses (%.1f%%), %lu coalesced, %lu evictions, %lu rejections, %lu texts, %lu/%lu bytes\n",
+		hits, misses, hits+misses ? 100.0*(double)hits/(double)(hits+misses) : 0.0, atomic_load(&cache->coalesced),
+		atomic_load(&cache->evictions), atomic_load(&cache->rejections), entries, size, budget);
+}
@@ -0,0 +1,61 @@
+// Automatically generated header.
+
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "util.h"
+#include "vector.h"
+#include "hashtable.h"
+#define TEXTCACHE_SHARDS 16
+#define SKETCH_ROWS 4
+#define SKETCH_WIDTH 4096 //per shard, power of two
+#define SKETCH_MAX 15 //counters saturate, as in a 4 bit sketch
+#define SKETCH_SAMPLE 10*SKETCH_WIDTH //increments before every counter is halved
+typedef struct {
+	char* name;
+	char* data;
+	unsigned long len;
+
+	atomic_ulong refs; //readers, plus one while cached
+	atomic_int referenced; //clock bit, set on hits
+} cached;
+typedef struct {
+	cnd_t done_cnd;
+	int done;
+	cached* result; //referenced for the waiters
+
+	unsigned long waiters; //including the loader
+} textcache_flight;
+typedef struct {
+	mtx_t lock;
+	map_t entries; //name -> cached*
+	map_t flights; //name -> textcache_flight*, owned name
+	unsigned long removals; //loads which started before one arent inserted
+	vector_t clock; //cached*, hand sweeps over it
+	unsigned long hand;
+
+	unsigned long size;
+	unsigned long budget;
+
+	unsigned char sketch[SKETCH_ROWS][SKETCH_WIDTH];
+	unsigned long sketch_adds;
+} textcache_shard;
+typedef struct {
+	textcache_shard shards[TEXTCACHE_SHARDS];
+
+	atomic_ulong hits;
+	atomic_ulong misses;
+	atomic_ulong evictions;
+	atomic_ulong rejections; //not admitted, read less than what they would replace
+	atomic_ulong coalesced; //misses which waited on another reader's load
+} textcache_t;
+typedef char* (*textcache_loader)(char* name, unsigned long* len, void* arg);
+void textcache_init(textcache_t* cache, unsigned long budget);
+void cached_release(cached* cache);
+void cached_release_ref(const void* data, size_t len, void* arg);
+cached* textcache_get(textcache_t* cache, char* name, textcache_loader load, void* arg);
+void textcache_remove(textcache_t* cache, char* name);
+void textcache_stats(textcache_t* cache, FILE* f);
@@ -3,8 +3,11 @@
 // https://nghttp2.org/documentation/tutorial-server.html
 // i hope i am not infringing on any licenses
 
+#define _GNU_SOURCE //strptime, timegm
+
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <ctype.h>
 #include <stdio.h>
@@ -18,50 +21,70 @@
 #include "event2/listener.h"
 #include "event2/bufferevent.h"
 
+#include <openssl/rand.h>
+#include <zlib.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <brotli/encode.h>
+
 #include "util.h"
 #include "vector.h"
 #include "hashtable.h"
 #include "threads.h"
 
+#include "template.h"
 #include "context.h"
+#include "wiki.h"
 #include "reasonphrases.h"
 
 #define TIMEOUT 120
+#define EXTRA_HEADERS_MAX 4 //given along with a page or ranges, ie. validators
+
+void multipart_cleanup(session_t* session);
+void eventcb(struct bufferevent *bev, short events, void* ctx);
 
-session_t *create_session(ctx_t *ctx, int fd, struct sockaddr *addr, int addrlen) {
+session_t *create_session(reactor_t *reactor, int fd, struct sockaddr *addr, int addrlen) {
 
 	session_t *session = heap(sizeof(session_t));
 
-	session->ctx = ctx;
+	session->ctx = reactor->ctx;
 
 	session->closed = 0;
+	session->busy = 0;
+	session->continue_pending = 0;
+	atomic_init(&session->refs, 1);
 
 	session->parser.done = 1;
+
+	mtx_init(&session->lock, mtx_plain);
 	session->requests = vector_new(sizeof(request));
 
+	//workers write responses from their own threads
 	session->bev = bufferevent_socket_new(
-				ctx->evbase, fd, BEV_OPT_CLOSE_ON_FREE);
+				reactor->evbase, fd, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
 	bufferevent_enable(session->bev, EV_READ | EV_WRITE);
 
 	session->user_ses = NULL;
 	session->auth_tok = NULL;
 
-	char name[100];
-	if (getnameinfo(addr, addrlen, name, 100, NULL, 0, NI_NUMERICHOST)==0)
-		printf("\nIP %s\n\n", name);
+	//name lookup is left to the log thread
+	memcpy(&session->addr, addr, addrlen);
+	session->addrlen = addrlen;
+
+	atomic_init(&session->status, 0);
+	atomic_init(&session->bytes, 0);
 
 	return session;
 }
 
-void query_free(vector_t* query) {
-	vector_iterator query_iter = vector_iterate(query);
-	while (vector_next(&query_iter)) {
-		char** q = query_iter.x;
-		drop(q[0]);
-		drop(q[1]);
-	}
-
-	vector_free(query);
+//uncommitted spills are removed, names are in the request arena
+void multipart_free(multipart_data* d) {
+	if (d->content) drop(d->content);
+	if (d->spill) unlink(d->spill);
 }
 
 void req_free(request* req) {
@@ -69,47 +92,58 @@ void req_free(request* req) {
 		drop(req->content);
 	}
 
-	query_free(&req->query);
-	query_free(&req->cookies);
+	vector_free(&req->query);
+	vector_free(&req->cookies);
 
 	vector_iterator mdata_iter = vector_iterate(&req->files);
 	while (vector_next(&mdata_iter)) {
-		multipart_data* d = mdata_iter.x;
-		drop(d->name);
-		drop(d->mime);
-		drop(d->content);
-	}
-
-	vector_free_strings(&req->path);
-
-	map_iterator header_iter = map_iterate(&req->headers);
-	while (map_next(&header_iter)) {
-		drop(*(char**)header_iter.key);
-		drop(*(char**)header_iter.x);
+		multipart_free(mdata_iter.x);
 	}
 
+	vector_free(&req->path);
 	vector_free(&req->files);
 	map_free(&req->headers);
+
+	arena_free(&req->arena);
 }
 
 void terminate(session_t *session) {
+	mtx_lock(&session->lock);
+
 	vector_iterator req_iter = vector_iterate(&session->requests);
 	while (vector_next(&req_iter)) {
 		req_free(req_iter.x);
 	}
 
-	if (!session->parser.done)
-		if (session->parser.multipart_boundary)
-			drop(session->parser.multipart_boundary);
+	vector_clear(&session->requests);
+	session->closed = 1;
+
+	mtx_unlock(&session->lock);
+
+	if (!session->parser.done && session->parser.multipart_boundary)
+		multipart_cleanup(session);
 
 	if (!session->parser.done && session->parser.req_parsed) {
 		req_free(&session->parser.req);
+	} else if (!session->parser.done) {
+		arena_free(&session->parser.req.arena);
 	}
 
 	bufferevent_disable(session->bev, EV_READ);
-	
+}
+
+//last reference frees, either the connection closing or a worker finishing
+void session_unref(session_t* session) {
+	if (atomic_fetch_sub(&session->refs, 1) > 1) return;
+
+	bufferevent_free(session->bev);
+
 	if (session->auth_tok) drop(session->auth_tok);
-	session->closed = 1;
+
+	vector_free(&session->requests);
+	mtx_destroy(&session->lock);
+
+	drop(session);
 }
 
 void skip(char** cur) {
@@ -138,15 +172,11 @@ int skip_newline(char** cur) {
 	}
 }
 
-char* parse_name(char** cur, char* delim) {
+char* parse_name(arena_t* arena, char** cur, char* delim) {
 	char* start = *cur;
 	while (!strchr(delim, **cur) && **cur) (*cur)++;
 
-	char *str = heap(*cur - start + 1);
-	memcpy(str, start, *cur - start);
-	str[*cur - start] = 0;
-
-	return str;
+	return arena_cpysubstr(arena, start, *cur - start);
 }
 
 int skip_word(char** cur, const char* word) {
@@ -158,6 +188,64 @@ int skip_word(char** cur, const char* word) {
 	}
 }
 
+//scanning for the few bytes that need escaping, clean runs are copied in bulk
+//sets are at most 8 bytes, none of them zero
+#if defined(__AVX2__)
+#define SCAN_BLOCK 32
+typedef __m256i scan_vec;
+#define scan_load(p) _mm256_loadu_si256((const __m256i*)(p))
+#define scan_set1(c) _mm256_set1_epi8(c)
+#define scan_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define scan_lt(a, b) _mm256_cmpgt_epi8(b, a)
+#define scan_or(a, b) _mm256_or_si256(a, b)
+#define scan_zero() _mm256_setzero_si256()
+#define scan_mask(a) (unsigned)_mm256_movemask_epi8(a)
+#elif defined(__SSE2__)
+#define SCAN_BLOCK 16
+typedef __m128i scan_vec;
+#define scan_load(p) _mm_loadu_si128((const __m128i*)(p))
+#define scan_set1(c) _mm_set1_epi8(c)
+#define scan_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define scan_lt(a, b) _mm_cmplt_epi8(a, b)
+#define scan_or(a, b) _mm_or_si128(a, b)
+#define scan_zero() _mm_setzero_si128()
+#define scan_mask(a) (unsigned)_mm_movemask_epi8(a)
+#endif
+
+//first byte in set or, if ctrl, outside of printable ascii (<33 or >126); end if none
+char* scan_any(char* cur, char* end, const char* set, int ctrl) {
+#ifdef SCAN_BLOCK
+	scan_vec needles[8];
+	int set_len = (int)strlen(set);
+	for (int i=0; i<set_len; i++) needles[i] = scan_set1(set[i]);
+
+	scan_vec low = scan_set1(33), del = scan_set1(127);
+
+	while (end-cur >= SCAN_BLOCK) {
+		scan_vec block = scan_load(cur);
+		scan_vec hits = scan_zero();
+
+		for (int i=0; i<set_len; i++) hits = scan_or(hits, scan_eq(block, needles[i]));
+		//signed compare, so bytes over 127 count as below 33
+		if (ctrl) hits = scan_or(hits, scan_or(scan_lt(block, low), scan_eq(block, del)));
+
+		unsigned mask = scan_mask(hits);
+		if (mask) return cur + __builtin_ctz(mask);
+
+		cur += SCAN_BLOCK;
+	}
+#endif
+
+	for (; cur<end; cur++) {
+		if (strchr(set, *cur) && *cur) return cur;
+		if (ctrl && (*cur < 33 || *cur > 126)) return cur;
+	}
+
+	return end;
+}
+
+#define HTML_SPECIAL "<>&\"'"
+
 //kinda copied from https://nachtimwald.com/2017/09/24/hex-encode-and-decode-in-c/
 //since im too lazy to type all these ifs
 char hexchar(char hex) {
@@ -183,68 +271,198 @@ void charhex(unsigned char chr, char* out) {
 	else out[0] = (chr-10) + 'A';
 }
 
-//frees original string
-char* percent_decode(char* data, unsigned long* sz) {
-	char buffer[strlen(data)+1]; //temporary buffer, at most as long as data
-	memset(buffer, 0, strlen(data)+1);
-
+//out can be data itself, decoding never grows
+unsigned long percent_decode_to(char* data, char* out) {
 	unsigned long cur=0; //write cursor
 
 	char* curdata = data; //copy data ptr
+	char* end = data + strlen(data);
 	
-	while (*curdata) {
+	while (curdata < end) {
+		char* special = scan_any(curdata, end, "%+", 0);
+
+		memmove(out+cur, curdata, special-curdata);
+		cur += special-curdata;
+		curdata = special;
+
+		if (curdata == end) break;
+
 		if (*curdata == '+') {
-			buffer[cur] = ' '; cur++;
-		} else if (*curdata == '%') {
+			out[cur] = ' '; cur++;
+		} else {
 			skip(&curdata);
 			char x = hexchar(*curdata) * 16;
 			skip(&curdata);
 			x += hexchar(*curdata);
 
-			buffer[cur] = x; cur++;
-		} else {
-			buffer[cur] = *curdata; cur++;
+			out[cur] = x; cur++;
 		}
 
-		curdata++;
+		if (*curdata) curdata++;
 	}
 
-	if (sz) *sz = cur;
-
-	return heapcpy(sz ? *sz : strlen(buffer)+1, buffer); //truncate and copy buffer
+	out[cur] = 0;
+	return cur;
 }
 
 char* percent_encode(char* data, unsigned long sz) {
-	char buffer[sz*3];
-	memset(buffer, 0, sz*3);
-
+	char* buffer = heap(sz*3+1);
 	char* cursor = buffer;
 
-	for (unsigned long i=0; i<sz; i++) {
-		if (data[i] == ' ') {
+	char* end = data+sz;
+
+	while (data < end) {
+		//https://developer.mozilla.org/en-US/docs/Web/HTTP/Headers/Set-Cookie
+		char* special = scan_any(data, end, "%+\",;\\", 1);
+
+		memcpy(cursor, data, special-data);
+		cursor += special-data;
+		data = special;
+
+		if (data == end) break;
+
+		if (*data == ' ') {
 			*cursor = '+';
-		} else if (data[i] > 126 || data[i] < 33
-			|| strchr("%+\",;\\", data[i])) { //https://developer.mozilla.org/en-US/docs/Web/HTTP/Headers/Set-Cookie
-			
+		} else {
 			*cursor = '%';
 			cursor++;
-			charhex((unsigned char)data[i], cursor);
+			charhex((unsigned char)*data, cursor);
 			cursor++;
-		} else {
-			*cursor = data[i];
 		}
 
 		cursor++;
+		data++;
 	}
 
-	return heapcpystr(buffer);
+	*cursor = 0;
+	return buffer;
 }
 
-void respond(session_t* session, int stat, char* content, unsigned long len, char* (*headers)[2], int headers_len) {
-	struct evbuffer* evbuf = bufferevent_get_output(session->bev);
+typedef struct {
+	char* data; //raw deflate, see deflate_segment
+	unsigned long len;
+
+	uint32_t crc; //of the uncompressed data
+	unsigned long raw_len;
+} deflated;
+
+//only for static content, dont bother with things that are already compressed
+int compressible(char* mime) {
+	return strncmp(mime, "text/", strlen("text/"))==0;
+}
+
+//compression on the way out, ignoring qvalues except to refuse
+int accepts_encoding(request* req, char* encoding) {
+	const char* accept_name = "Accept-Encoding";
+	char** accept = map_find(&req->headers, &accept_name);
+	if (!accept) return 0;
+
+	char* cur = *accept;
+	while (*cur) {
+		parse_ws(&cur);
+
+		if (skip_word(&cur, encoding) && strchr(" ;,", *cur)) {
+			parse_ws(&cur);
+			if (!skip_word(&cur, ";")) return 1;
+
+			parse_ws(&cur);
+			return !skip_word(&cur, "q=") || strtod(cur, NULL) > 0;
+		}
+
+		skip_until(&cur, ",");
+		skip(&cur);
+	}
+
+	return 0;
+}
+
+char* gzip_compress(char* data, unsigned long len, unsigned long* out_len) {
+	z_stream strm = {.zalloc=Z_NULL, .zfree=Z_NULL, .opaque=Z_NULL};
+	deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS+16, 8, Z_DEFAULT_STRATEGY);
+
+	unsigned long bound = deflateBound(&strm, len);
+	char* out = heap(bound);
+
+	strm.next_in = (unsigned char*)data;
+	strm.avail_in = len;
+	strm.next_out = (unsigned char*)out;
+	strm.avail_out = bound;
+
+	deflate(&strm, Z_FINISH);
+	*out_len = bound - strm.avail_out;
+
+	deflateEnd(&strm);
+	return out;
+}
+
+char* brotli_compress(char* data, unsigned long len, unsigned long* out_len) {
+	size_t bound = BrotliEncoderMaxCompressedSize(len);
+	char* out = heap(bound);
+
+	if (!bound || !BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+			len, (uint8_t*)data, &bound, (uint8_t*)out)) {
+		drop(out);
+		return NULL;
+	}
+
+	*out_len = bound;
+	return out;
+}
+
+//keeps variants only if they are smaller
+void resource_compress(resource* res) {
+	res->gzip = NULL;
+	res->br = NULL;
+
+	//content hash, a reloaded resource gets a new tag
+	snprintf(res->etag, sizeof(res->etag), "\"%08lx\"",
+		crc32(crc32(0, Z_NULL, 0), (unsigned char*)res->content, res->len));
+
+	if (!compressible(res->mime)) return;
+
+	res->gzip = gzip_compress(res->content, res->len, &res->gzip_len);
+	if (res->gzip_len >= res->len) {
+		drop(res->gzip);
+		res->gzip = NULL;
+	}
+
+	res->br = brotli_compress(res->content, res->len, &res->br_len);
+	if (res->br && res->br_len >= res->len) {
+		drop(res->br);
+		res->br = NULL;
+	}
+}
+
+//raw deflate ending in a sync flush, segments are concatenated into one gzip member
+deflated deflate_segment(char* data, unsigned long len) {
+	z_stream strm = {.zalloc=Z_NULL, .zfree=Z_NULL, .opaque=Z_NULL};
+	deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+
+	unsigned long bound = deflateBound(&strm, len) + 16; //room for the flush marker
+	deflated res = {.data=heap(bound), .raw_len=len};
+
+	strm.next_in = (unsigned char*)data;
+	strm.avail_in = len;
+	strm.next_out = (unsigned char*)res.data;
+	strm.avail_out = bound;
+
+	deflate(&strm, Z_SYNC_FLUSH);
+	res.len = bound - strm.avail_out;
+
+	deflateEnd(&strm);
+
+	res.crc = crc32(crc32(0, Z_NULL, 0), (unsigned char*)data, len);
+	return res;
+}
+
+//status line and headers, caller holds the output buffer lock
+void respond_head(session_t* session, struct evbuffer* evbuf, int stat, int has_content, unsigned long len, char* (*headers)[2], int headers_len) {
 	evbuffer_add_printf(evbuf, "HTTP/1.1 %i %s\r\n", stat, reason(stat));
 
-	if (content) {
+	atomic_store(&session->status, stat);
+	atomic_store(&session->bytes, has_content ? len : 0);
+
+	if (has_content) {
 		evbuffer_add_printf(evbuf, "Content-Length: %lu\r\n", len);
 	}
 
@@ -262,351 +480,673 @@ void respond(session_t* session, int stat, char* content, unsigned long len, cha
 	}
 
 	evbuffer_add_printf(evbuf, "\r\n");
+}
+
+//own headers followed by extra, out has room for own_len+EXTRA_HEADERS_MAX
+int headers_join(char* (*out)[2], char* (*own)[2], int own_len, char* (*extra)[2], int extra_len) {
+	if (extra_len > EXTRA_HEADERS_MAX) extra_len = EXTRA_HEADERS_MAX;
+
+	memcpy(out, own, sizeof(char*[2])*own_len);
+	if (extra_len > 0) memcpy(out+own_len, extra, sizeof(char*[2])*extra_len);
+
+	return own_len + extra_len;
+}
+
+//imf-fixdate, out holds at least 32
+void http_date(time_t time, char* out) {
+	struct tm tm;
+	gmtime_r(&time, &tm);
+	strftime(out, 32, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+//if-none-match wins over if-modified-since, weak comparison for both
+//modified is ignored if zero
+int not_modified(request* req, char* etag, time_t modified) {
+	const char* inm_name = "If-None-Match";
+	char** inm = map_find(&req->headers, &inm_name);
+
+	if (inm) {
+		char* tag = etag;
+		skip_word(&tag, "W/");
+
+		char* cur = *inm;
+		while (*cur) {
+			skip_while(&cur, " ,");
+			if (skip_word(&cur, "*")) return 1;
+
+			skip_word(&cur, "W/");
+			if (skip_word(&cur, tag) && strchr(" ,", *cur)) return 1;
+
+			skip_until(&cur, ",");
+		}
+
+		return 0;
+	}
+
+	const char* ims_name = "If-Modified-Since";
+	char** ims = map_find(&req->headers, &ims_name);
+
+	if (ims && modified) {
+		struct tm tm = {0};
+		if (!strptime(*ims, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return 0;
+
+		return modified <= timegm(&tm);
+	}
+
+	return 0;
+}
+
+void respond(session_t* session, int stat, char* content, unsigned long len, char* (*headers)[2], int headers_len) {
+	struct evbuffer* evbuf = bufferevent_get_output(session->bev);
+
+	//loop thread may write an error while a worker responds
+	evbuffer_lock(evbuf);
+	respond_head(session, evbuf, stat, content!=NULL, len, headers, headers_len);
 
 	if (content) {
 		evbuffer_add(evbuf, content, len);
 	}
+
+	evbuffer_unlock(evbuf);
 }
 
-void respond_redirect(session_t* session, char* url) {
-	respond(session, 302, "", 0, &(char*[2]){"Location", url}, 1);
+//content must outlive the response, cleanup (optional) is called once it is sent
+void respond_ref(session_t* session, int stat, char* content, unsigned long len, char* (*headers)[2], int headers_len, evbuffer_ref_cleanup_cb cleanup, void* arg) {
+	struct evbuffer* evbuf = bufferevent_get_output(session->bev);
+
+	evbuffer_lock(evbuf);
+	respond_head(session, evbuf, stat, 1, len, headers, headers_len);
+	evbuffer_add_reference(evbuf, content, len, cleanup, arg);
+	evbuffer_unlock(evbuf);
+}
+
+//takes ownership of fd, sent with sendfile when possible
+void respond_file(session_t* session, int stat, int fd, unsigned long len, char* (*headers)[2], int headers_len) {
+	struct evbuffer* evbuf = bufferevent_get_output(session->bev);
+
+	evbuffer_lock(evbuf);
+	respond_head(session, evbuf, stat, 1, len, headers, headers_len);
+	evbuffer_add_file(evbuf, fd, 0, (ev_off_t)len);
+	evbuffer_unlock(evbuf);
 }
 
-void respond_html(session_t* session, int stat, char* content) {
-	respond(session, stat, content, strlen(content), &(char*[2]){"Content-Type", "text/html; charset=UTF-8"}, 1);
+typedef struct {
+	unsigned long start;
+	unsigned long len;
+} byte_range;
+
+//if-range holds either the strong etag or the last modified date
+int range_current(request* req, char* etag, char* modified) {
+	const char* if_range_name = "If-Range";
+	char** if_range = map_find(&req->headers, &if_range_name);
+	if (!if_range) return 1;
+
+	if (**if_range == '"') return etag && strcmp(*if_range, etag)==0;
+	return modified && strcmp(*if_range, modified)==0;
 }
 
-void escape_html(char** str) {
-	vector_t vec = vector_from_string(*str);
-	vector_iterator iter = vector_iterate(&vec);
-	while (vector_next(&iter)) {
-		char* escaped;
-
-		switch (*(char*)iter.x) {
-			case '<': escaped="&lt;"; break;
-			case '>': escaped="&gt;"; break;
-			case '&': escaped="&amp;"; break;
-			case '"': escaped="&quot;"; break;
-			case '\'': escaped="&#39;"; break;
-			default: escaped=NULL;
+//-1 if the whole thing should be sent, 0 if nothing is satisfiable, else number of ranges
+int parse_ranges(request* req, char* etag, char* modified, unsigned long size, vector_t* ranges) {
+	const char* range_name = "Range";
+	char** range = map_find(&req->headers, &range_name);
+	if (!range || !range_current(req, etag, modified)) return -1;
+
+	char* cur = *range;
+	if (!skip_word(&cur, "bytes=")) return -1;
+
+	while (*cur) {
+		skip_while(&cur, " ,");
+		if (!*cur) break;
+
+		char* end;
+		byte_range r;
+
+		if (*cur == '-') { //suffix
+			unsigned long suffix = strtoul(cur+1, &end, 10);
+			if (end == cur+1) return -1;
+
+			if (suffix > size) suffix = size;
+			r = (byte_range){.start=size-suffix, .len=suffix};
+		} else {
+			unsigned long first = strtoul(cur, &end, 10);
+			if (end == cur || *end != '-') return -1;
+			cur = end+1;
+
+			unsigned long last = size-1;
+			if (isdigit((unsigned char)*cur)) {
+				last = strtoul(cur, &end, 10);
+				if (last < first) return -1;
+				if (last >= size) last = size-1;
+			} else {
+				end = cur;
+			}
+
+			r = (byte_range){.start=first, .len=first < size ? last-first+1 : 0};
 		}
 
-		if (escaped) {
-			vector_remove(&vec, iter.i-1);
-			vector_insert_manycpy(&vec, iter.i-1, strlen(escaped), escaped);
-			iter.i += strlen(escaped);
+		cur = end;
+		skip_while(&cur, " ");
+		if (*cur && *cur != ',') return -1;
+
+		if (r.len > 0) {
+			//many small ranges cost more than the whole thing
+			if (ranges->length == RANGES_MAX) return -1;
+			vector_pushcpy(ranges, &r);
 		}
 	}
 
-	*str = vec.data;
+	return (int)ranges->length;
 }
 
-typedef struct {
-	char* str;
-	unsigned long skip; //if a condition, length, including !%
-	unsigned long max_args; //required arguments
-	unsigned long max_cond;
-	unsigned long max_loop;
-	vector_t substitutions;
-} template_t;
+//either from memory or from fd, which is closed
+void respond_ranges(session_t* session, vector_t* ranges, unsigned long size, char* mime, char* data, int fd, char* (*extra)[2], int extra_len) {
+	struct evbuffer* body = evbuffer_new();
+	struct evbuffer_file_segment* seg = NULL;
 
-typedef struct {
-	unsigned long idx;
-	unsigned long offset;
+	if (!data) {
+		seg = evbuffer_file_segment_new(fd, 0, (ev_off_t)size, EVBUF_FS_CLOSE_ON_FREE);
+		if (!seg) {
+			close(fd);
+			evbuffer_free(body);
 
-	template_t* insertion;
-	char inverted; //inverted condition
-	char loop;
-	char noescape;
-} substitution_t;
+			respond(session, 500, "", 0, NULL, 0);
+			return;
+		}
+	}
 
-typedef struct {
-	int* cond_args;
-	vector_t** loop_args;
-	char** sub_args;
-} template_args;
+	char content_range[64];
+	char content_type[128];
 
-template_t template_new(char* data) {
-	template_t template;
-	
-	//use same cursor method as used in percent parsing
-	unsigned long template_len = strlen(data)+1;
-	template.str = heap(template_len);
-	memset(template.str, 0, template_len);
-
-	template.skip = 0;
-	template.max_args = 0;
-	template.max_cond = 0;
-	template.max_loop = 0;
-
-	template.substitutions = vector_new(sizeof(substitution_t));
-
-	char* write_cursor = template.str;
-	char* read_cursor = data;
-
-	while (*read_cursor) {
-		if (strncmp(read_cursor, "!%", 2)==0) {
-			if (read_cursor > data && *(read_cursor-1)=='!') {
-				read_cursor++;
-				*write_cursor = '%';
-			} else {
-				template.skip = (read_cursor+2)-data;
-				break;
-			}
-			
-		} else if (*read_cursor == '%') {
-			read_cursor++;
+	if (ranges->length == 1) {
+		byte_range* r = vector_get(ranges, 0);
+		snprintf(content_range, 64, "bytes %lu-%lu/%lu", r->start, r->start+r->len-1, size);
+		snprintf(content_type, 128, "%s", mime);
 
-			//escape
-			if (*read_cursor == '%') {
-				*write_cursor = '%';
+		if (seg) evbuffer_add_file_segment(body, seg, (ev_off_t)r->start, (ev_off_t)r->len);
+		else evbuffer_add(body, data+r->start, r->len);
+	} else {
+		unsigned char rand_boundary[8];
+		RAND_bytes(rand_boundary, 8);
 
-			//condition
-			} else if (*read_cursor == '!') {
-				read_cursor++;
+		char boundary[17];
+		for (int i=0; i<8; i++) charhex(rand_boundary[i], &boundary[i*2]);
+		boundary[16] = 0;
 
-				substitution_t* cond = vector_push(&template.substitutions);
-				cond->offset = write_cursor-template.str;
-				
-				cond->inverted = 0;
-				cond->loop = 0;
-
-				if (*read_cursor == '*') {
-					cond->loop = 1;
-					read_cursor++;
-				} else if (*read_cursor == '!') {
-					cond->inverted = 1;
-					read_cursor++;
-				}
+		snprintf(content_type, 128, "multipart/byteranges; boundary=%s", boundary);
 
-				cond->idx = *read_cursor - '0';
-				if (cond->loop && cond->idx >= template.max_loop)
-					template.max_loop = cond->idx+1;
-				else if (cond->idx >= template.max_cond)
-					template.max_cond = cond->idx+1;
+		vector_iterator iter = vector_iterate(ranges);
+		while (vector_next(&iter)) {
+			byte_range* r = iter.x;
 
-				char* cond_start = ++read_cursor;
-				template_t insertion = template_new(cond_start);
+			evbuffer_add_printf(body, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lu-%lu/%lu\r\n\r\n",
+				boundary, mime, r->start, r->start+r->len-1, size);
 
-				if (insertion.max_args > template.max_args)
-					template.max_args = insertion.max_args;
-				
-				if (insertion.max_cond > template.max_cond)
-					template.max_cond = insertion.max_cond;
+			if (seg) evbuffer_add_file_segment(body, seg, (ev_off_t)r->start, (ev_off_t)r->len);
+			else evbuffer_add(body, data+r->start, r->len);
+		}
 
-				if (insertion.max_loop > template.max_loop)
-					template.max_loop = insertion.max_loop;
+		evbuffer_add_printf(body, "\r\n--%s--\r\n", boundary);
+	}
 
-				read_cursor += insertion.skip;
+	//segment stays alive while the body references it
+	if (seg) evbuffer_file_segment_free(seg);
 
-				cond->insertion = heapcpy(sizeof(template_t), &insertion);
-				continue;
-				
-			//index subsitution
-			} else {
-				substitution_t sub = {.offset=write_cursor-template.str};
+	struct evbuffer* evbuf = bufferevent_get_output(session->bev);
 
-				if (*read_cursor == '#') {
-					sub.noescape = 1;
-					read_cursor++;
-				} else {
-					sub.noescape = 0;
-				}
+	char* own[3][2] = {{"Content-Type", content_type}, {"Accept-Ranges", "bytes"}, {"Content-Range", content_range}};
 
-				sub.idx = *read_cursor - '0';
-				if (sub.idx >= template.max_args) template.max_args = sub.idx+1;
+	char* headers[3+EXTRA_HEADERS_MAX][2];
+	int headers_len = headers_join(headers, own, ranges->length == 1 ? 3 : 2, extra, extra_len);
 
-				vector_pushcpy(&template.substitutions, &sub);
+	evbuffer_lock(evbuf);
+	respond_head(session, evbuf, 206, 1, evbuffer_get_length(body), headers, headers_len);
+	evbuffer_add_buffer(evbuf, body);
+	evbuffer_unlock(evbuf);
 
-				read_cursor++;
-				continue;
-			}
-		} else {
-			*write_cursor = *read_cursor;
-		}
-			
-		write_cursor++;
-		read_cursor++;
+	evbuffer_free(body);
+}
+
+void respond_unsatisfiable(session_t* session, unsigned long size) {
+	char content_range[32];
+	snprintf(content_range, 32, "bytes */%lu", size);
+
+	respond(session, 416, "", 0, &(char*[2]){"Content-Range", content_range}, 1);
+}
+
+void respond_redirect(session_t* session, char* url) {
+	respond(session, 302, "", 0, &(char*[2]){"Location", url}, 1);
+}
+
+//NULL if x doesnt need escaping
+char* html_entity(char x) {
+	switch (x) {
+		case '<': return "&lt;";
+		case '>': return "&gt;";
+		case '&': return "&amp;";
+		case '"': return "&quot;";
+		case '\'': return "&#39;";
+		default: return NULL;
+	}
+}
+
+unsigned long escaped_length(char* str, char* end) {
+	unsigned long len = end-str;
+
+	while ((str = scan_any(str, end, HTML_SPECIAL, 0)) < end) {
+		len += strlen(html_entity(*str)) - 1;
+		str++;
 	}
 
-	return template;
+	return len;
 }
 
-void template_length(template_t* template, unsigned long* len, template_args* args) {
-	*len += strlen(template->str);
+//sizing pass, same walk as template_run without writing
+unsigned long template_length(template_t* template, unsigned long pc, unsigned long end, template_args* args, template_splice* splice) {
+	template_op* ops = template->ops.data;
+	unsigned long len = 0;
 
-	vector_iterator iter = vector_iterate(&template->substitutions);
-	while (vector_next(&iter)) {
-		substitution_t* sub = iter.x;
-		if (sub->insertion) {
-			if (sub->loop) {
-				vector_iterator iter = vector_iterate(args->loop_args[sub->idx]);
-				while (vector_next(&iter))
-					template_length(sub->insertion, len, iter.x);
+	while (pc < end) {
+		template_op* op = &ops[pc];
 
-				continue;
+		switch (op->code) {
+			case op_literal: len += op->len; break;
+			case op_escape: {
+				char* arg = args->sub_args[op->idx];
+				len += escaped_length(arg, arg+strlen(arg));
+				break;
 			}
+			case op_raw: {
+				char* arg = args->sub_args[op->idx];
+				if (!splice || arg != splice->arg) len += strlen(arg);
+				break;
+			}
+			case op_cond: {
+				if (op->inverted ^ !args->cond_args[op->idx]) {
+					pc = op->jump;
+					continue;
+				}
 
-			if (sub->inverted ^ !args->cond_args[sub->idx]) continue;
-			template_length(sub->insertion, len, args);
-		} else {
-			char* arg = args->sub_args[sub->idx];
-
-			if (sub->noescape) {
-				*len += strlen(arg);
-				continue;
+				break;
 			}
+			case op_loop: {
+				vector_t* items = args->loop_args[op->idx];
 
-			while (*arg) {
-				switch (*arg) {
-					case '<': *len+=strlen("&lt;"); break;
-					case '>': *len+=strlen("&gt;"); break;
-					case '&': *len+=strlen("&amp;"); break;
-					case '\'': *len+=strlen("&#39;"); break;
-					case '"': *len+=strlen("&quot;"); break;
-					default: (*len)++;
+				if (items) {
+					vector_iterator iter = vector_iterate(items);
+					while (vector_next(&iter))
+						len += template_length(template, pc+1, op->jump, iter.x, splice);
 				}
 
-				arg++;
+				pc = op->jump;
+				continue;
 			}
 		}
+
+		pc++;
 	}
+
+	return len;
 }
 
-void template_substitute(template_t* template, char** out, template_args* args) {
-	char* template_ptr = template->str;
+void template_escape(template_out* out, char* arg) {
+	char* end = arg+strlen(arg);
 
-	vector_iterator iter = vector_iterate(&template->substitutions);
-	while (vector_next(&iter)) {
-		substitution_t* sub = iter.x;
+	while (arg < end) {
+		char* special = scan_any(arg, end, HTML_SPECIAL, 0);
+		template_write(out, arg, special-arg);
 
-		unsigned long sub_before = sub->offset - (template_ptr - template->str);
-		if (sub_before > 0) {
-			memcpy(*out, template_ptr, sub_before);
-			*out += sub_before;
-			template_ptr += sub_before;
-		}
+		if (special == end) break;
+
+		char* entity = html_entity(*special);
+		template_write(out, entity, strlen(entity));
+		arg = special+1;
+	}
+}
 
-		if (sub->insertion) {
-			if (sub->loop) {
-				vector_iterator iter = vector_iterate(args->loop_args[sub->idx]);
-				while (vector_next(&iter)) {
-					template_args* args = iter.x;
-					template_substitute(sub->insertion, out, args);
-					
-					//convenience free
-					if (args->sub_args)
-						drop(args->sub_args);
-					if (args->cond_args)
-						drop(args->cond_args);
-					if (args->loop_args)
-						drop(args->loop_args);
-				 }
-
-				 vector_free(args->loop_args[sub->idx]);
+//runs ops [pc, end)
+void template_run(template_t* template, unsigned long pc, unsigned long end, template_out* out, template_args* args, template_splice* splice) {
+	template_op* ops = template->ops.data;
 
-				continue;
+	while (pc < end) {
+		template_op* op = &ops[pc];
+
+		switch (op->code) {
+			case op_literal: {
+				template_write(out, (char*)template->text.data + op->offset, op->len);
+				break;
 			}
 
-			if (sub->inverted ^ !args->cond_args[sub->idx]) continue;
-			template_substitute(sub->insertion, out, args);
-		} else {
-			char* arg = args->sub_args[sub->idx];
+			case op_escape: {
+				template_escape(out, args->sub_args[op->idx]);
+				break;
+			}
 
-			if (sub->noescape) {
-				while (*arg) *((*out)++) = *(arg++);
-				continue;
+			case op_raw: {
+				char* arg = args->sub_args[op->idx];
+
+				if (splice && arg == splice->arg) splice->at = (long)out->at;
+				else template_write(out, arg, strlen(arg));
+
+				break;
 			}
 
-			while (*arg) {
-				char* escaped;
- 
-				switch (*arg) {
-					case '<': escaped="&lt;"; break;
-					case '>': escaped="&gt;"; break;
-					case '&': escaped="&amp;"; break;
-					case '"': escaped="&quot;"; break;
-					case '\'': escaped="&#39;"; break;
-					default: escaped=NULL;
+			case op_cond: {
+				if (op->inverted ^ !args->cond_args[op->idx]) {
+					pc = op->jump;
+					continue;
 				}
 
-				if (escaped) {
-					memcpy(*out, escaped, strlen(escaped));
-					*out += strlen(escaped);
-				} else {
-					**out = *arg;
-					(*out)++;
+				break;
+			}
+
+			case op_loop: {
+				vector_t* items = args->loop_args[op->idx];
+
+				if (items) {
+					vector_iterator iter = vector_iterate(items);
+					while (vector_next(&iter))
+						template_run(template, pc+1, op->jump, out, iter.x, splice);
+
+					vector_free(items);
 				}
 
-				arg++;
+				pc = op->jump;
+				continue;
 			}
 		}
+
+		pc++;
 	}
+}
+
+//rendering temporaries, reset once the page is queued
+thread_local arena_t template_scratch;
+
+assets_t* assets_read_lock(ctx_t* ctx);
+void assets_read_unlock(ctx_t* ctx);
+
+//template alone, generated functions if there are any
+unsigned long template_size(template_t* template, template_args* args, template_splice* splice) {
+	return template->length ? template->length(args, splice) : template_length(template, 0, template->ops.length, args, splice);
+}
+
+void template_emit(template_t* template, template_out* out, template_args* args, template_splice* splice) {
+	if (template->run) template->run(out, args, splice);
+	else template_run(template, 0, template->ops.length, out, args, splice);
+}
+
+//page is the global prefix, escaped title, global middle, template and global tail
+unsigned long page_length(assets_t* assets, char* title, template_t* template, template_args* args, template_splice* splice) {
+	return assets->global_len + escaped_length(title, title+strlen(title)) + assets->global_mid_len
+		+ template_size(template, args, splice) + assets->global_tail_len;
+}
+
+void page_run(assets_t* assets, char* title, template_t* template, template_out* out, template_args* args, template_splice* splice) {
+	template_write(out, assets->global, assets->global_len);
+	template_escape(out, title);
+	template_write(out, assets->global_mid, assets->global_mid_len);
 
-	unsigned long rest = strlen(template->str) - (template_ptr-template->str);
-	memcpy(*out, template_ptr, rest);
-	*out += rest;
+	template_emit(template, out, args, splice);
+
+	template_write(out, assets->global_tail, assets->global_tail_len);
 }
 
-char* do_template(template_t* template, va_list args) {
-	//allocate arrays on stack, then reference
-	int cond_args[template->max_cond];
+//conditions, loops then substitutions, in the scratch arena
+template_args template_vargs(template_t* template, va_list args) {
+	int* cond_args = arena_alloc(&template_scratch, sizeof(int)*template->max_cond);
 	for (unsigned long i=0; i<template->max_cond; i++) {
 		cond_args[i] = va_arg(args, int);
 	}
 
-	vector_t* loop_args[template->max_loop];
+	vector_t** loop_args = arena_alloc(&template_scratch, sizeof(vector_t*)*template->max_loop);
 	for (unsigned long i=0; i<template->max_loop; i++) {
 		loop_args[i] = va_arg(args, vector_t*);
 	}
 
-	char* sub_args[template->max_args];
+	char** sub_args = arena_alloc(&template_scratch, sizeof(char*)*template->max_args);
 	for (unsigned long i=0; i<template->max_args; i++) {
 		sub_args[i] = va_arg(args, char*);
 	}
 
-	template_args t_args = {.cond_args=cond_args, .loop_args=loop_args, .sub_args=sub_args};
+	return (template_args){.cond_args=cond_args, .loop_args=loop_args, .sub_args=sub_args};
+}
+
+//heap copy of a page, or of the template alone if title is NULL
+//splice (optional) is left out and its offset recorded, NULL if theres no such template
+char* template_vrender(ctx_t* ctx, char* template_name, char* title, template_splice* splice, unsigned long* len, va_list args) {
+	assets_t* assets = assets_read_lock(ctx);
+	template_t* template = map_find(&assets->templates, &template_name);
+
+	if (!template) {
+		assets_read_unlock(ctx);
+		return NULL;
+	}
+
+	template_args t_args = template_vargs(template, args);
 
-	unsigned long len = 0;
-	template_length(template, &len, &t_args);
+	*len = title ? page_length(assets, title, template, &t_args, splice) : template_size(template, &t_args, splice);
+	char* data = heap(*len ? *len : 1);
 
-	char* out = heap(len+1);
-	char* out_ptr = out;
-	template_substitute(template, &out_ptr, &t_args);
-	out[len] = 0;
+	template_out out = {.vec={{.iov_base=data, .iov_len=*len}}, .vec_len=1};
+	if (title) page_run(assets, title, template, &out, &t_args, splice);
+	else template_emit(template, &out, &t_args, splice);
 
-	return out;
+	assets_read_unlock(ctx);
+	arena_reset(&template_scratch);
+
+	return data;
 }
 
-void respond_template(session_t* session, int stat, char* template_name, char* title, ...) {
+char* page_render(ctx_t* ctx, char* template_name, char* title, template_splice* splice, unsigned long* len, ...) {
 	va_list args;
-	
-	template_t* template = map_find(&session->ctx->templates, &template_name);
+	va_start(args, len);
+	char* data = template_vrender(ctx, template_name, title, splice, len, args);
+	va_end(args);
 
-	va_start(args, title);
-	
-	char* template_output = do_template(template, args);
-	
+	return data;
+}
+
+//for fragments, without the global template
+char* template_render(ctx_t* ctx, char* template_name, unsigned long* len, ...) {
+	va_list args;
+	va_start(args, len);
+	char* data = template_vrender(ctx, template_name, NULL, NULL, len, args);
 	va_end(args);
 
-	char* escaped_title = heapcpystr(title);
-	escape_html(&escaped_title);
+	return data;
+}
 
-	char* global_output = heapstr(session->ctx->global, escaped_title, template_output);
+void respond_vtemplate(session_t* session, int stat, char* template_name, char* title, va_list args) {
+	ctx_t* ctx = session->ctx;
 
-	respond_html(session, stat, global_output);
+	//held until the page is rendered, a reload cant free the template under us
+	assets_t* assets = assets_read_lock(ctx);
+	template_t* template = map_find(&assets->templates, &template_name);
 
-	drop(escaped_title);
-	drop(template_output);
-	drop(global_output);
-}
+	if (!template) {
+		assets_read_unlock(ctx);
+		respond(session, 500, "", 0, NULL, 0);
+		return;
+	}
 
-void respond_error(session_t* session, int stat, char* err) {
-	respond_template(session, stat, ERROR_TEMPLATE, err, err);
-}
+	template_args t_args = template_vargs(template, args);
 
-// vector_t parse_list(char* data, char* delim) {
-//	 vector_t list = vector_new(sizeof(char*));
+	unsigned long len = page_length(assets, title, template, &t_args, NULL);
+
+	//written once into chains that are then moved onto the output, like respond_ranges
+	struct evbuffer* body = evbuffer_new();
+	template_out out = {0};
+	out.vec_len = len ? evbuffer_reserve_space(body, len, out.vec, 2) : 0;
+
+	if (out.vec_len < 0) {
+		assets_read_unlock(ctx);
+		arena_reset(&template_scratch);
+		evbuffer_free(body);
+
+		respond(session, 500, "", 0, NULL, 0);
+		return;
+	}
+
+	page_run(assets, title, template, &out, &t_args, NULL);
+
+	//only the chunks written to are committed, trimmed to what was written
+	if (out.vec_len > 0) {
+		out.vec[out.i].iov_len = out.fill;
+		evbuffer_commit_space(body, out.vec, out.i+1);
+	}
+
+	assets_read_unlock(ctx);
+
+	//everything is copied into the body by now
+	arena_reset(&template_scratch);
+
+	struct evbuffer* evbuf = bufferevent_get_output(session->bev);
+
+	evbuffer_lock(evbuf);
+	respond_head(session, evbuf, stat, 1, len, &(char*[2]){"Content-Type", "text/html; charset=UTF-8"}, 1);
+	evbuffer_add_buffer(evbuf, body);
+	evbuffer_unlock(evbuf);
+
+	evbuffer_free(body);
+}
+
+void respond_template(session_t* session, int stat, char* template_name, char* title, ...) {
+	va_list args;
+	va_start(args, title);
+	respond_vtemplate(session, stat, template_name, title, args);
+	va_end(args);
+}
+
+//raw deflate stored blocks, which follow a sync flush as is
+deflated deflate_stored(char* data, unsigned long len) {
+	deflated res = {.data=NULL, .len=0, .crc=crc32(0, Z_NULL, 0), .raw_len=len};
+	if (len == 0) return res;
+
+	res.data = heap(len + (len/0xffff + 1)*5);
+	unsigned char* out = (unsigned char*)res.data;
+
+	for (unsigned long pos=0; pos<len;) {
+		unsigned long block = len-pos > 0xffff ? 0xffff : len-pos;
+
+		//BFINAL and BTYPE unset, rest of the byte is padding
+		out[0] = 0;
+		out[1] = (unsigned char)block;
+		out[2] = (unsigned char)(block >> 8);
+		out[3] = (unsigned char)~block;
+		out[4] = (unsigned char)(~block >> 8);
+
+		memcpy(out+5, data+pos, block);
+		out += 5+block;
+		pos += block;
+	}
+
+	res.len = out - (unsigned char*)res.data;
+	res.crc = crc32(res.crc, (unsigned char*)data, len);
+	return res;
+}
+
+//takes ownership of body and fragments, which may be NULL if empty
+//both encodings are prepared so hits only queue references
+cached_page* page_new(char* body, unsigned long len, unsigned long split, char** fragments, unsigned long* fragment_lens, unsigned long page_version) {
+	const unsigned char gzip_header[10] = {0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 0x03};
+	const unsigned char final_block[2] = {0x03, 0x00}; //empty fixed block with BFINAL set
+
+	cached_page* page = heap(sizeof(cached_page));
+	page->body = body;
+	page->split = split;
+	page->len = len;
+	page->page_version = page_version;
+	atomic_init(&page->refs, 1);
+
+	deflated head = deflate_segment(body, split);
+	page->zhead_len = sizeof(gzip_header) + head.len;
+	page->zhead = heap(page->zhead_len);
+	memcpy(page->zhead, gzip_header, sizeof(gzip_header));
+	memcpy(page->zhead + sizeof(gzip_header), head.data, head.len);
+	page->head_crc = head.crc;
+	drop(head.data);
+
+	deflated tail = deflate_segment(body+split, len-split);
+	page->ztail_len = tail.len + sizeof(final_block);
+	page->ztail = heap(page->ztail_len);
+	memcpy(page->ztail, tail.data, tail.len);
+	memcpy(page->ztail + tail.len, final_block, sizeof(final_block));
+	page->tail_crc = tail.crc;
+	drop(tail.data);
+
+	page->size = len + page->zhead_len + page->ztail_len;
+
+	for (int i=0; i<PAGE_FRAGMENTS; i++) {
+		page->fragments[i] = fragments[i];
+		page->fragment_lens[i] = fragments[i] ? fragment_lens[i] : 0;
+
+		deflated stored = deflate_stored(fragments[i], page->fragment_lens[i]);
+		page->zfragments[i] = stored.data;
+		page->zfragment_lens[i] = stored.len;
+		page->fragment_crcs[i] = stored.crc;
+
+		page->size += page->fragment_lens[i] + stored.len;
+	}
+
+	return page;
+}
+
+//caller holds the output buffer lock
+void respond_page_part(struct evbuffer* evbuf, cached_page* page, char* data, unsigned long len) {
+	if (len == 0) return;
+
+	atomic_fetch_add(&page->refs, 1);
+	evbuffer_add_reference(evbuf, data, len, cached_page_release_ref, page);
+}
+
+//queues the body around the viewer's fragment without copying, gzip only adds a trailer
+void respond_page(session_t* session, int stat, cached_page* page, int fragment, int gzip, char* (*extra)[2], int extra_len) {
+	char* own[3][2] = {{"Content-Type", "text/html; charset=UTF-8"}, {"Vary", "Accept-Encoding"}, {"Content-Encoding", "gzip"}};
+
+	char* headers[3+EXTRA_HEADERS_MAX][2];
+	int headers_len = headers_join(headers, own, gzip ? 3 : 2, extra, extra_len);
+
+	unsigned long fragment_len = page->fragment_lens[fragment];
+
+	struct evbuffer* evbuf = bufferevent_get_output(session->bev);
+	evbuffer_lock(evbuf);
+
+	if (gzip) {
+		uint32_t crc = crc32_combine(page->head_crc, page->fragment_crcs[fragment], fragment_len);
+		crc = crc32_combine(crc, page->tail_crc, page->len - page->split);
+
+		unsigned long raw_len = page->len + fragment_len;
+
+		unsigned char trailer[8];
+		for (int i=0; i<4; i++) {
+			trailer[i] = (unsigned char)(crc >> (8*i));
+			trailer[4+i] = (unsigned char)(raw_len >> (8*i));
+		}
+
+		respond_head(session, evbuf, stat, 1,
+			page->zhead_len + page->zfragment_lens[fragment] + page->ztail_len + sizeof(trailer), headers, headers_len);
+
+		respond_page_part(evbuf, page, page->zhead, page->zhead_len);
+		respond_page_part(evbuf, page, page->zfragments[fragment], page->zfragment_lens[fragment]);
+		respond_page_part(evbuf, page, page->ztail, page->ztail_len);
+		evbuffer_add(evbuf, trailer, sizeof(trailer));
+	} else {
+		respond_head(session, evbuf, stat, 1, page->len + fragment_len, headers, headers_len);
+
+		respond_page_part(evbuf, page, page->body, page->split);
+		respond_page_part(evbuf, page, page->fragments[fragment], fragment_len);
+		respond_page_part(evbuf, page, page->body + page->split, page->len - page->split);
+	}
+
+	evbuffer_unlock(evbuf);
+}
+
+void respond_error(session_t* session, int stat, char* err) {
+	respond_template(session, stat, ERROR_TEMPLATE, err, err);
+}
+
+// vector_t parse_list(char* data, char* delim) {
+//	 vector_t list = vector_new(sizeof(char*));
 
 //	 while (*data) {
 //		 parse_name(&data, delim);
@@ -615,17 +1155,15 @@ void respond_error(session_t* session, int stat, char* err) {
 	
 // }
 
-void parse_querystring(char* line, vector_t* vec) {
+void parse_querystring(arena_t* arena, char* line, vector_t* vec) {
 	while (*line) {
-		char* key_hex = parse_name(&line, "=");
-		char* key = percent_decode(key_hex, NULL);
-		drop(key_hex);
+		char* key = parse_name(arena, &line, "=");
+		percent_decode_to(key, key);
 		
 		skip(&line);
 		
-		char* val_hex = parse_name(&line, "& ");
-		char* val = percent_decode(val_hex, NULL);
-		drop(val_hex);
+		char* val = parse_name(arena, &line, "& ");
+		percent_decode_to(val, val);
 		
 		vector_pushcpy(vec, &(char*[2]){key, val});
 
@@ -675,6 +1213,23 @@ vector_t multipart_find(vector_t *vec, char **params, int num_params, int strict
 	return res;
 }
 
+//empty containers, the arena is set up by the parser
+void request_init(request* req) {
+	req->path = vector_new(sizeof(char*));
+	req->query = vector_new(sizeof(char*[2]));
+	req->cookies = vector_new(sizeof(char*[2]));
+	req->files = vector_new(sizeof(multipart_data));
+
+	req->headers = map_new();
+	map_configure_string_key(&req->headers, sizeof(char*));
+
+	req->content = NULL;
+	req->content_length = 0;
+
+	req->err_stat = 0;
+	req->err = NULL;
+}
+
 int request_parse(char* line, request* req) {
 	parse_ws(&line);
 
@@ -688,13 +1243,11 @@ int request_parse(char* line, request* req) {
 
 	parse_ws(&line);
 	
-	req->path = vector_new(sizeof(char*));
-	req->query = vector_new(sizeof(char*[2]));
-	req->cookies = vector_new(sizeof(char*[2]));
-	req->files = vector_new(sizeof(multipart_data));
-	
-	req->content = NULL;
-	req->content_length = 0;
+	request_init(req);
+
+	char* target = line;
+	if (*target == '/') target++;
+	req->target = parse_name(&req->arena, &target, " ?");
 
 	if (*line == '*') {
 		line++;
@@ -706,42 +1259,40 @@ int request_parse(char* line, request* req) {
 				char* top = vector_popptr(&req->path);
 				if (!top) {
 
-					vector_free_strings(&req->path);
+					vector_free(&req->path);
 					vector_free(&req->query);
+					vector_free(&req->cookies);
+					vector_free(&req->files);
+					map_free(&req->headers);
 
 					return 0;
-				} else {
-					drop(top);
 				}
 			} else {
-				char* segment = parse_name(&line, " /?");
+				char* segment = parse_name(&req->arena, &line, " /?");
 				vector_pushcpy(&req->path, &segment);
 
 				if (*line == '/') line++;
 				if (*line == '?') {
 					skip(&line); //skip ?
-					parse_querystring(line, &req->query);
+					parse_querystring(&req->arena, line, &req->query);
 					break;
 				}
 			}
 		}
 	}
 
-	req->headers = map_new();
-	map_configure_string_key(&req->headers, sizeof(char*));
-
 	return 1;
 }
 
-vector_t parse_header_value(char* val) {
+vector_t parse_header_value(arena_t* arena, char* val) {
 	vector_t vec = vector_new(sizeof(char*[2]));
 
 	parse_ws(&val);
 	
 	while (*val) {
-		char* name = parse_name(&val, "=;,");
+		char* name = parse_name(arena, &val, "=;,");
 		if (*val != '=') {
-			vector_pushcpy(&vec, &(char*[]){heapcpystr(""), name}); //cmon its easy to free
+			vector_pushcpy(&vec, &(char*[]){"", name});
 			
 			val++;
 			parse_ws(&val);
@@ -754,16 +1305,15 @@ vector_t parse_header_value(char* val) {
 			//skip quotes
 			if (*val=='"') {
 				val++;
-				vector_pushcpy(&vec, &(char*[]){heapcpystr(name), parse_name(&val, "\"")});
+				vector_pushcpy(&vec, &(char*[]){name, parse_name(arena, &val, "\"")});
 				if (*val=='"') val++;
 			} else {
-				vector_pushcpy(&vec, &(char*[]){heapcpystr(name), parse_name(&val, ",;")});
+				vector_pushcpy(&vec, &(char*[]){name, parse_name(arena, &val, ",;")});
 			}
 		}
 		
 		if (*val == ';') val++;
 		
-		drop(name);
 		parse_ws(&val);
 	}
 
@@ -777,13 +1327,7 @@ char* query_extract_value(vector_t* val, char* key) {
 	char* res = NULL;
 	while (vector_next(&iter)) {
 		char** assoc = iter.x;
-		if (strcmp(assoc[0], key)==0) {
-			res = assoc[1];
-		} else {
-			drop(assoc[1]);
-		}
-
-		drop(assoc[0]);
+		if (strcmp(assoc[0], key)==0) res = assoc[1];
 	}
 
 	vector_free(val);
@@ -791,84 +1335,271 @@ char* query_extract_value(vector_t* val, char* key) {
 	return res;
 }
 
-int parse_content(session_t* session, struct evbuffer* evbuf) {
-	if (evbuffer_get_length(evbuf) >= session->parser.req.content_length) {
-		if (evbuffer_remove(evbuf, session->parser.req.content, session->parser.req.content_length)==-1) {
-			respond_error(session, 500, "Buffer error");
-			terminate(session);
+void session_push(session_t* session, request* req) {
+	mtx_lock(&session->lock);
+	vector_pushcpy(&session->requests, req);
+	session->continue_pending = 0; //its content is all here, the client didnt wait
+	mtx_unlock(&session->lock);
+}
+
+//crlf line copied into the arena, NULL until one is complete
+char* readln_arena(arena_t* arena, struct evbuffer* evbuf) {
+	size_t eol_len;
+	struct evbuffer_ptr eol = evbuffer_search_eol(evbuf, NULL, &eol_len, EVBUFFER_EOL_CRLF);
+	if (eol.pos < 0) return NULL;
+
+	char* line = arena_alloc(arena, eol.pos+1);
+	evbuffer_remove(evbuf, line, eol.pos);
+	line[eol.pos] = 0;
+
+	evbuffer_drain(evbuf, eol_len);
+	return line;
+}
+
+//writes n bytes of input to the current part without copying them out first
+int multipart_write(session_t* session, struct evbuffer* evbuf, unsigned long n) {
+	session->parser.remaining -= n;
+
+	while (n > 0) {
+		struct evbuffer_iovec vec[16];
+		int vecs = evbuffer_peek(evbuf, (ev_ssize_t)n, NULL, vec, 16);
+		if (vecs > 16) vecs = 16;
+
+		unsigned long written = 0;
+		for (int i=0; i<vecs && written<n; i++) {
+			unsigned long len = vec[i].iov_len;
+			if (len > n-written) len = n-written;
+
+			if (session->parser.spill) {
+				if (fwrite(vec[i].iov_base, len, 1, session->parser.spill) < 1) return 0;
+			} else {
+				if (session->parser.field.length + len > FIELD_MAX) return 0;
+				vector_stockcpy(&session->parser.field, len, vec[i].iov_base);
+			}
+
+			written += len;
+		}
+
+		session->parser.part.len += written;
+		evbuffer_drain(evbuf, written);
+		n -= written;
+	}
+
+	return 1;
+}
+
+int multipart_header(session_t* session, char* line) {
+	multipart_data* part = &session->parser.part;
+	char* cur = line;
+
+	if (skip_word(&cur, "Content-Type:")) {
+		parse_ws(&cur);
+		if (!part->mime) part->mime = parse_name(&session->parser.req.arena, &cur, "");
+	} else if (skip_word(&cur, "Content-Disposition:")) {
+		parse_ws(&cur);
+		if (!part->name) {
+			vector_t val = parse_header_value(&session->parser.req.arena, cur);
+			part->name = query_extract_value(&val, "name");
+		}
+	}
+
+	return 1;
+}
+
+//files spill to disk as they arrive, fields stay in memory
+int multipart_part_begin(session_t* session) {
+	multipart_data* part = &session->parser.part;
+	if (!part->name) return 0;
+
+	if (part->mime) {
+		part->spill = arena_cpystr(&session->parser.req.arena, DATA_PATH ".upload-XXXXXX");
+
+		int fd = mkstemp(part->spill);
+		if (fd < 0) {
+			part->spill = NULL;
 			return 0;
 		}
-		
-		//handle supported formats
-		if (session->parser.req.ctype == url_formdata) {
-			parse_querystring(session->parser.req.content, &session->parser.req.query);
-		} else if (session->parser.req.ctype == multipart_formdata) {
-			char* content = session->parser.req.content;
-
-			while (!skip_word(&content, session->parser.multipart_boundary) && *content) content++;
-			skip_newline(&content);
-			
-			while (*content) {
-				//parse preamble
-				char* disposition=NULL, *mime=NULL;
-				while (*content && !skip_newline(&content)) {
-					if (skip_word(&content, "Content-Type:")) {
-						parse_ws(&content);
-						if (!mime) mime = parse_name(&content, "\r\n");
-						skip_newline(&content);
-					} else if (skip_word(&content, "Content-Disposition:")) {
-						parse_ws(&content);
-						if (!disposition) disposition = parse_name(&content, "\r\n");
-						skip_newline(&content);
-					} else {
-						skip_until(&content, "\r\n");
-						skip_newline(&content);
-					}
+
+		session->parser.spill = fdopen(fd, "wb");
+		if (!session->parser.spill) {
+			close(fd);
+			return 0;
+		}
+	} else {
+		session->parser.field = vector_new(1);
+	}
+
+	return 1;
+}
+
+int multipart_part_end(session_t* session) {
+	multipart_data* part = &session->parser.part;
+
+	if (session->parser.spill) {
+		int err = fclose(session->parser.spill);
+		session->parser.spill = NULL;
+		if (err) return 0;
+	} else {
+		vector_pushcpy(&session->parser.field, "\0");
+		part->content = session->parser.field.data;
+		session->parser.field.data = NULL;
+	}
+
+	vector_pushcpy(&session->parser.req.files, part);
+	*part = (multipart_data){0};
+
+	return 1;
+}
+
+//scan of the input up to what belongs to the body
+ev_ssize_t multipart_search(session_t* session, struct evbuffer* evbuf, char* what, unsigned long avail) {
+	struct evbuffer_ptr end;
+	evbuffer_ptr_set(evbuf, &end, avail, EVBUFFER_PTR_SET);
+
+	return evbuffer_search_range(evbuf, what, strlen(what), NULL, &end).pos;
+}
+
+//returns 1 once the body is consumed, 0 if it needs more, -1 if malformed
+int parse_multipart(session_t* session, struct evbuffer* evbuf) {
+	char* delim = session->parser.multipart_boundary;
+	unsigned long delim_len = strlen(delim);
+
+	while (1) {
+		unsigned long avail = evbuffer_get_length(evbuf);
+		if (avail > session->parser.remaining) avail = session->parser.remaining;
+
+		if (session->parser.remaining == 0)
+			return session->parser.mstate == multipart_epilogue ? 1 : -1;
+
+		switch (session->parser.mstate) {
+			case multipart_preamble: {
+				//first boundary may not be preceded by a newline
+				ev_ssize_t pos = multipart_search(session, evbuf, delim+2, avail);
+				if (pos < 0) {
+					if (avail == session->parser.remaining) return -1;
+					if (avail <= delim_len) return 0;
+
+					evbuffer_drain(evbuf, avail-delim_len);
+					session->parser.remaining -= avail-delim_len;
+					return 0;
 				}
 
-				if (!disposition) {
-					if (disposition) drop(disposition);
-					if (mime) drop(mime);
+				evbuffer_drain(evbuf, pos+delim_len-2);
+				session->parser.remaining -= pos+delim_len-2;
+				session->parser.mstate = multipart_delim;
+				break;
+			}
+
+			case multipart_delim: {
+				if (avail < 2) return 0;
 
-					respond_error(session, 500, "No disposition or mime");
-					terminate(session);
+				char tail[2];
+				evbuffer_remove(evbuf, tail, 2);
+				session->parser.remaining -= 2;
+
+				if (memcmp(tail, "--", 2)==0) session->parser.mstate = multipart_epilogue;
+				else if (memcmp(tail, "\r\n", 2)==0) session->parser.mstate = multipart_headers;
+				else return -1;
+
+				break;
+			}
+
+			case multipart_headers: {
+				size_t eol_len;
+				struct evbuffer_ptr eol = evbuffer_search_eol(evbuf, NULL, &eol_len, EVBUFFER_EOL_CRLF);
+
+				if (eol.pos < 0 || (unsigned long)eol.pos+eol_len > avail) {
+					if (avail == session->parser.remaining || avail >= FIELD_MAX) return -1;
 					return 0;
 				}
 
-				vector_t val = parse_header_value(disposition);
-				char* disposition_name = query_extract_value(&val, "name");
-				drop(disposition);
-				
-				char* data_start = content;
-				
-				unsigned long len = strlen(session->parser.multipart_boundary);
-				while (strncmp(content, session->parser.multipart_boundary, len)!=0
-							 && content - session->parser.req.content < session->parser.req.content_length)
-					content++;
-				
-				unsigned long content_len = content-data_start;
-				
-				//shrink non-mime content
-				if (!mime && *(content-1) == '\n') {
-					content_len--;
-					if (*(content-2) == '\r') content_len--;
+				char* line = readln_arena(&session->parser.req.arena, evbuf);
+				session->parser.remaining -= eol.pos+eol_len;
+
+				int res;
+				if (eol.pos == 0) {
+					res = multipart_part_begin(session);
+					session->parser.mstate = multipart_body;
+				} else {
+					res = multipart_header(session, line);
 				}
-				
-				multipart_data data = {.name=disposition_name, .mime=mime,
-					.content=heapcpy(content_len, data_start), .len=content_len};
-				vector_pushcpy(&session->parser.req.files, &data);
-
-				if (*content) {
-					content += strlen(session->parser.multipart_boundary);
-					if (skip_word(&content, "--")) break;
-					skip_newline(&content);
+
+				if (!res) return -1;
+
+				break;
+			}
+
+			case multipart_body: {
+				ev_ssize_t pos = multipart_search(session, evbuf, delim, avail);
+
+				if (pos < 0) {
+					if (avail == session->parser.remaining) return -1;
+					//keep what could be the start of a boundary
+					if (avail > delim_len && !multipart_write(session, evbuf, avail-delim_len)) return -1;
+					return 0;
 				}
+
+				if (!multipart_write(session, evbuf, pos) || !multipart_part_end(session)) return -1;
+
+				evbuffer_drain(evbuf, delim_len);
+				session->parser.remaining -= delim_len;
+				session->parser.mstate = multipart_delim;
+				break;
 			}
 
-			drop(session->parser.multipart_boundary);
+			case multipart_epilogue: {
+				evbuffer_drain(evbuf, avail);
+				session->parser.remaining -= avail;
+
+				if (session->parser.remaining > 0) return 0;
+				break;
+			}
 		}
+	}
+}
+
+void multipart_cleanup(session_t* session) {
+	if (session->parser.spill) fclose(session->parser.spill);
+	session->parser.spill = NULL;
+
+	if (session->parser.field.data) vector_free(&session->parser.field);
+	session->parser.field.data = NULL;
+
+	multipart_free(&session->parser.part);
+	session->parser.part = (multipart_data){0};
+
+	session->parser.multipart_boundary = NULL;
+}
+
+void session_fail(session_t* session, int stat, char* err);
+
+int parse_content(session_t* session, struct evbuffer* evbuf) {
+	if (session->parser.req.ctype == multipart_formdata) {
+		int res = parse_multipart(session, evbuf);
 
-		vector_pushcpy(&session->requests, &session->parser.req);
+		if (res == -1) {
+			session_fail(session, 400, "Malformed multipart content");
+			return 0;
+		} else if (res == 0) {
+			return 0; //wait for more to arrive
+		}
+
+		multipart_cleanup(session);
+
+		session_push(session, &session->parser.req);
+		session->parser.done = 1;
+
+		return 1;
+
+	} else if (evbuffer_get_length(evbuf) >= session->parser.req.content_length) {
+		if (evbuffer_remove(evbuf, session->parser.req.content, session->parser.req.content_length)==-1) {
+			session_fail(session, 500, "Buffer error");
+			return 0;
+		}
+		
+		parse_querystring(&session->parser.req.arena, session->parser.req.content, &session->parser.req.query);
+
+		session_push(session, &session->parser.req);
 		session->parser.done = 1;
 
 		return 1;
@@ -877,8 +1608,258 @@ int parse_content(session_t* session, struct evbuffer* evbuf) {
 	}
 }
 
+//moves a spilled file part into place
+int multipart_commit(request* req, char* name, char* path) {
+	vector_iterator iter = vector_iterate(&req->files);
+	while (vector_next(&iter)) {
+		multipart_data* d = iter.x;
+		if (strcmp(d->name, name)!=0 || !d->spill) continue;
+
+		if (rename(d->spill, path)!=0) return 0;
+
+		d->spill = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+//after the handler, status and size are whatever it last responded with
+void log_request(session_t* session, request* req) {
+	log_record rec = {.addrlen=session->addrlen, .time=time(NULL),
+		.status=atomic_load(&session->status), .bytes=atomic_load(&session->bytes)};
+
+	memcpy(&rec.addr, &session->addr, session->addrlen);
+	strcpy(rec.method, req->method==GET ? "GET" : "POST");
+
+	strncpy(rec.path, req->target, LOG_PATH_MAX-1);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rec.latency = (unsigned long)((now.tv_sec - req->start.tv_sec)*1000000
+		+ (now.tv_nsec - req->start.tv_nsec)/1000);
+
+	accesslog_push(&session->ctx->log, &rec);
+
+	//arena use by route, resources all count as one
+	char kind[32];
+	char* seg = req->target + (*req->target == '/');
+	int seg_len = (int)strcspn(seg, "/");
+
+	if (req->err_stat) snprintf(kind, sizeof(kind), "%s error", rec.method);
+	else if (memchr(seg, '.', seg_len)) snprintf(kind, sizeof(kind), "%s resource", rec.method);
+	else snprintf(kind, sizeof(kind), "%s /%.*s", rec.method, seg_len > 16 ? 16 : seg_len, seg);
+
+	arena_count(kind, &req->arena);
+}
 
 void route(session_t* session, request* req);
+int route_static(session_t* session, request* req);
+
+void handle_request(session_t* session, request* req) {
+	//initialize/find user session
+	vector_t auth = query_find(&req->cookies, (char*[]){"ranchsession"}, 1, 1);
+
+	if (auth.length==1) {
+		char* strkey = vector_getstr(&auth, 0);
+
+		map_sized_t key;
+		key.bin = arena_alloc(&req->arena, strlen(strkey)+1);
+		key.size = percent_decode_to(strkey, key.bin);
+
+		if (key.size==AUTH_KEYSZ) {
+			user_session** ses = map_find(&session->ctx->user_sessions, &key);
+			if (ses) {
+				session->user_ses = *ses;
+				mtx_lock(&session->user_ses->lock);
+			}
+		}
+	}
+
+	vector_free(&auth);
+
+	route(session, req);
+
+	//store last access for session expiry
+	if (session->user_ses) {
+		atomic_store(&session->user_ses->last_access, (unsigned long)time(NULL));
+		mtx_unlock(&session->user_ses->lock);
+		session->user_ses = NULL;
+	}
+}
+
+void work_push(ctx_t* ctx, work_t* work) {
+	mtx_lock(&ctx->work.lock);
+	vector_pushcpy(&ctx->work.queue, work);
+	cnd_signal(&ctx->work.cnd);
+	mtx_unlock(&ctx->work.lock);
+}
+
+//hand the next pending request to a worker; one in flight per session keeps responses in order
+//the error response is out, close like the peer hung up
+void close_drained(struct bufferevent *bev, void* ctx) {
+	session_t *session = (session_t *)ctx;
+
+	if (evbuffer_get_length(bufferevent_get_output(bev)) > 0) return;
+
+	bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+	session_unref(session);
+}
+
+void session_dispatch(session_t* session) {
+	mtx_lock(&session->lock);
+
+	while (!session->busy && !session->closed && session->requests.length > 0) {
+		work_t work = {.session=session, .req=*(request*)vector_get(&session->requests, 0)};
+		vector_remove(&session->requests, 0);
+
+		//a parse error ends the connection once it is answered
+		if (work.req.err_stat) {
+			//a peer that never reads it is dropped after the timeout
+			struct timeval tout = {.tv_sec=TIMEOUT, .tv_usec=0};
+			bufferevent_set_timeouts(session->bev, NULL, &tout);
+			bufferevent_setcb(session->bev, NULL, close_drained, eventcb, session);
+
+			respond_error(session, work.req.err_stat, work.req.err);
+			log_request(session, &work.req);
+			req_free(&work.req);
+
+			session->closed = 1;
+			break;
+		}
+
+		//static resources dont block, answer them here
+		if (route_static(session, &work.req)) {
+			log_request(session, &work.req);
+			req_free(&work.req);
+			continue;
+		}
+
+		session->busy = 1;
+		atomic_fetch_add(&session->refs, 1);
+
+		work_push(session->ctx, &work);
+	}
+
+	//request being read asked to continue, everything before it has been answered
+	if (session->continue_pending && !session->busy && !session->closed && session->requests.length == 0) {
+		struct evbuffer* out = bufferevent_get_output(session->bev);
+
+		evbuffer_lock(out);
+		evbuffer_add_printf(out, "HTTP/1.1 100 %s\r\n\r\n", reason(100));
+		evbuffer_unlock(out);
+
+		session->continue_pending = 0;
+	}
+
+	mtx_unlock(&session->lock);
+}
+
+//the error is answered once earlier requests are, nothing after it is read
+void session_fail(session_t* session, int stat, char* err) {
+	request* req = &session->parser.req;
+
+	if (!session->parser.done && session->parser.multipart_boundary)
+		multipart_cleanup(session);
+
+	//whatever was parsed is kept for the log
+	if (!session->parser.req_parsed) {
+		req->method = GET;
+		req->target = "";
+		request_init(req);
+		clock_gettime(CLOCK_MONOTONIC, &req->start);
+	}
+
+	req->err_stat = stat;
+	req->err = err;
+
+	session_push(session, req);
+	session->parser.done = 1;
+
+	bufferevent_disable(session->bev, EV_READ);
+	session_dispatch(session);
+}
+
+int worker_loop(void* arg) {
+	ctx_t* ctx = arg;
+
+	while (1) {
+		mtx_lock(&ctx->work.lock);
+		while (ctx->work.queue.length == 0 && !ctx->work.stop)
+			cnd_wait(&ctx->work.cnd, &ctx->work.lock);
+
+		if (ctx->work.stop) {
+			mtx_unlock(&ctx->work.lock);
+			break;
+		}
+
+		work_t work = *(work_t*)vector_get(&ctx->work.queue, 0);
+		vector_remove(&ctx->work.queue, 0);
+
+		mtx_unlock(&ctx->work.lock);
+
+		session_t* session = work.session;
+
+		mtx_lock(&session->lock);
+		int closed = session->closed;
+		mtx_unlock(&session->lock);
+
+		if (!closed) {
+			handle_request(session, &work.req);
+			log_request(session, &work.req);
+		}
+
+		req_free(&work.req);
+
+		mtx_lock(&session->lock);
+		session->busy = 0;
+		mtx_unlock(&session->lock);
+
+		session_dispatch(session);
+		session_unref(session);
+	}
+
+	return 0;
+}
+
+void start_workers(ctx_t* ctx) {
+	mtx_init(&ctx->work.lock, mtx_plain);
+	cnd_init(&ctx->work.cnd);
+
+	ctx->work.queue = vector_new(sizeof(work_t));
+	ctx->work.threads = vector_new(sizeof(thrd_t));
+	ctx->work.stop = 0;
+
+	for (int i=0; i<WORKERS; i++) {
+		thrd_t* thrd = vector_push(&ctx->work.threads);
+		thrd_create(thrd, worker_loop, ctx);
+	}
+}
+
+//pending work is dropped, connections are going away anyways
+void stop_workers(ctx_t* ctx) {
+	mtx_lock(&ctx->work.lock);
+	ctx->work.stop = 1;
+	cnd_broadcast(&ctx->work.cnd);
+	mtx_unlock(&ctx->work.lock);
+
+	vector_iterator iter = vector_iterate(&ctx->work.threads);
+	while (vector_next(&iter)) {
+		thrd_join(*(thrd_t*)iter.x, NULL);
+	}
+
+	vector_iterator work_iter = vector_iterate(&ctx->work.queue);
+	while (vector_next(&work_iter)) {
+		req_free(&((work_t*)work_iter.x)->req);
+	}
+
+	vector_free(&ctx->work.queue);
+	vector_free(&ctx->work.threads);
+
+	cnd_destroy(&ctx->work.cnd);
+	mtx_destroy(&ctx->work.lock);
+}
 
 /* readcb for bufferevent after client connection header was
 	 checked. */
@@ -895,9 +1876,7 @@ void readcb(struct bufferevent *bev, void* ctx) {
 	}
 
 	//parse request lines
-	while ((line = evbuffer_readln(evbuf, NULL, EVBUFFER_EOL_CRLF))) {
-		printf("%s\n", line); //log req
-
+	while (1) {
 		//parse new request or finish old one
 		if (session->parser.done) {
 			session->parser.done = 0;
@@ -905,11 +1884,17 @@ void readcb(struct bufferevent *bev, void* ctx) {
 			session->parser.has_content = 0;
 			session->parser.content_parsing = 0;
 			session->parser.multipart_boundary = NULL;
+			session->parser.spill = NULL;
+			session->parser.req.arena = arena_new();
 		}
+
+		//lines live as long as the request
+		line = readln_arena(&session->parser.req.arena, evbuf);
+		if (!line) break;
 		
 		if (strlen(line) == 0 && session->parser.req_parsed) {
 			if (!session->parser.has_content) {
-				vector_pushcpy(&session->requests, &session->parser.req);
+				session_push(session, &session->parser.req);
 				session->parser.done = 1;
 			} else {
 				const char* clength_name = "Content-Type";
@@ -923,26 +1908,42 @@ void readcb(struct bufferevent *bev, void* ctx) {
 				} else if (ctype && strncmp(*ctype, multipart_name, strlen(multipart_name))==0) {
 					session->parser.req.ctype = multipart_formdata;
 
-					vector_t ctype_val = parse_header_value(*ctype);
-					session->parser.multipart_boundary = query_extract_value(&ctype_val, "boundary");
-
-					char* prefixed = heapstr("--%s", session->parser.multipart_boundary);
-					drop(session->parser.multipart_boundary);
-					session->parser.multipart_boundary = prefixed;
+					vector_t ctype_val = parse_header_value(&session->parser.req.arena, *ctype);
+					char* boundary = query_extract_value(&ctype_val, "boundary");
 
-					if (!session->parser.multipart_boundary) {
-						respond_error(session, 400, "no boundary provided with multipart request");
-						terminate(session);
+					if (!boundary) {
+						session_fail(session, 400, "no boundary provided with multipart request");
 						return;
 					}
+
+					session->parser.multipart_boundary = arena_str(&session->parser.req.arena, "\r\n--%s", boundary);
+
+					session->parser.mstate = multipart_preamble;
+					session->parser.remaining = session->parser.req.content_length;
+					session->parser.part = (multipart_data){0};
+					session->parser.field.data = NULL;
 				} else {
-					respond_error(session, 400, "unsupported body format");
-					terminate(session);
+					session_fail(session, 400, "unsupported body format");
 					return;
 				}
 
-				session->parser.req.content = heap(session->parser.req.content_length + 1);
-				session->parser.req.content[session->parser.req.content_length] = 0;
+				//only urlencoded bodies are held whole
+				if (session->parser.req.ctype == url_formdata) {
+					session->parser.req.content = heap(session->parser.req.content_length + 1);
+					session->parser.req.content[session->parser.req.content_length] = 0;
+				}
+
+				const char* expect_name = "Expect";
+				char** expect = map_find(&session->parser.req.headers, &expect_name);
+
+				//the interim response cant go out before earlier final ones, dispatch sends it once they are done
+				if (expect && strcasecmp(*expect, "100-continue")==0) {
+					mtx_lock(&session->lock);
+					session->continue_pending = 1;
+					mtx_unlock(&session->lock);
+
+					session_dispatch(session);
+				}
 
 				session->parser.content_parsing = 1;
 				
@@ -953,9 +1954,9 @@ void readcb(struct bufferevent *bev, void* ctx) {
 		} else if (!session->parser.req_parsed) {
 			if (request_parse(line, &session->parser.req)) {
 				session->parser.req_parsed = 1;
+				clock_gettime(CLOCK_MONOTONIC, &session->parser.req.start);
 			} else {
-				respond_error(session, 400, "Malformed request");
-				terminate(session);
+				session_fail(session, 400, "Malformed request");
 				return;
 			}
 		} else {
@@ -965,73 +1966,28 @@ void readcb(struct bufferevent *bev, void* ctx) {
 				session->parser.has_content = 1;
 
 				if (session->parser.req.content_length > CONTENT_MAX) {
-					respond_error(session, 400, "Oversized content");
-					terminate(session);
+					session_fail(session, 400, "Oversized content");
 					return;
 				}
 			} else if (skip_word(&cur, "Cookie:")) {
 				parse_ws(&cur);
-				query_free(&session->parser.req.cookies);
-				session->parser.req.cookies = parse_header_value(cur);
+				vector_free(&session->parser.req.cookies);
+				session->parser.req.cookies = parse_header_value(&session->parser.req.arena, cur);
 			} else {
-				char* name = parse_name(&cur, ":");
-				skip(&cur);
+				//line is already in the arena, split it in place
+				char* name = cur;
+				skip_until(&cur, ":");
+				if (*cur) *(cur++) = 0;
+
 				parse_ws(&cur);
-				char* val = parse_name(&cur, "");
 
 				map_insert_result res = map_insert(&session->parser.req.headers, &name);
-				if (res.exists) {
-					drop(name);
-					drop(*(char**)res.val);
-				}
-
-				*(char**)res.val = val;
+				*(char**)res.val = cur;
 			}
 		}
-
-		drop(line);
 	}
 
-	//respond to pending requests
-	vector_iterator req_iter = vector_iterate(&session->requests);
-	while (vector_next(&req_iter)) {
-		request* req = req_iter.x;
-
-		//initialize/find user session
-		vector_t auth = query_find(&req->cookies, (char*[]){"ranchsession"}, 1, 1);
-
-		if (auth.length==1) {
-			char* strkey = vector_getstr(&auth, 0);
-
-			map_sized_t key;
-			key.bin = percent_decode(strkey, &key.size);
-
-			if (key.size==AUTH_KEYSZ) {
-				user_session** ses = map_find(&session->ctx->user_sessions, &key);
-				if (ses) {
-					session->user_ses = *ses;
-					mtx_lock(&session->user_ses->lock);
-				}
-			}
-
-			drop(key.bin);
-		}
-
-		vector_free(&auth);
-
-		route(session, req);
-
-		//store last access for session expiry
-		if (session->user_ses) {
-			atomic_store(&session->user_ses->last_access, (unsigned long)time(NULL));
-			mtx_unlock(&session->user_ses->lock);
-			session->user_ses = NULL;
-		}
-
-		req_free(req_iter.x);
-	}
-
-	vector_clear(&session->requests);
+	session_dispatch(session);
 }
 
 void listen_error(struct evconnlistener* listener, void* ctx) {
@@ -1047,30 +2003,53 @@ void eventcb(struct bufferevent *bev, short events, void* ctx) {
 	session_t *session = (session_t *)ctx;
 	
 	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT)) {
-		if (session->user_ses) mtx_lock(&session->user_ses->lock);
-		
-		bufferevent_free(session->bev);
-		if (!session->closed) terminate(session);
-		if (session->user_ses) mtx_unlock(&session->user_ses->lock);
+		bufferevent_setcb(session->bev, NULL, NULL, NULL, NULL);
 
-		drop(session);
+		if (!session->closed) terminate(session);
+		session_unref(session); //worker may still hold it
 	}
 }
 
 void acceptcb(struct evconnlistener *listener, int fd, struct sockaddr *addr,
 							int addrlen, void *arg) {
 
-	ctx_t *ctx = (ctx_t *)arg;
+	reactor_t *reactor = (reactor_t *)arg;
 	session_t *session;
 
-	session = create_session(ctx, fd, addr, addrlen);
+	session = create_session(reactor, fd, addr, addrlen);
 
 	struct timeval tout = {.tv_sec=TIMEOUT, .tv_usec=0};
 	bufferevent_set_timeouts(session->bev, &tout, NULL);
 	bufferevent_setcb(session->bev, readcb, NULL, eventcb, session);
 }
 
-void start_listen(ctx_t* ctx, const char *port) {
+int reactor_loop(void* arg) {
+	reactor_t* reactor = arg;
+	event_base_loop(reactor->evbase, EVLOOP_NO_EXIT_ON_EMPTY);
+
+	return 0;
+}
+
+struct evconnlistener* listen_bind(reactor_t* reactor, struct addrinfo* res, unsigned flags) {
+	//search for viable address
+	for (struct addrinfo* cur = res; cur; cur = cur->ai_next) {
+		struct evconnlistener *listener;
+
+		listener = evconnlistener_new_bind(
+				reactor->evbase, acceptcb, reactor, flags, 16,
+				cur->ai_addr, (int)cur->ai_addrlen);
+
+		if (listener) {
+			evconnlistener_set_error_cb(listener, listen_error);
+			return listener;
+		}
+	}
+
+	return NULL;
+}
+
+//first reactor runs on ctx->evbase, others get their own thread and base
+void start_listen(ctx_t* ctx, const char *port, unsigned long reactors) {
 	struct addrinfo hints;
 
 	memset(&hints, 0, sizeof(hints));
@@ -1087,21 +2066,44 @@ void start_listen(ctx_t* ctx, const char *port) {
 		errx(1, "could not resolve server address");
 	}
 
-	//search for viable address
-	for (struct addrinfo* cur = res; cur; cur = cur->ai_next) {
-		struct evconnlistener *listener;
-		
-		listener = evconnlistener_new_bind(
-				ctx->evbase, acceptcb, ctx, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 16,
-				cur->ai_addr, (int)cur->ai_addrlen);
+	unsigned flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE;
+	if (reactors > 1) flags |= LEV_OPT_REUSEABLE_PORT;
 
-		if (listener) {
-			evconnlistener_set_error_cb(listener, listen_error);
-			freeaddrinfo(res);
+	ctx->reactors = vector_new(sizeof(reactor_t*));
 
-			return;
+	for (unsigned long i=0; i<reactors; i++) {
+		reactor_t* reactor = heap(sizeof(reactor_t));
+		reactor->ctx = ctx;
+		reactor->evbase = i==0 ? ctx->evbase : event_base_new();
+
+		reactor->listener = listen_bind(reactor, res, flags);
+		if (!reactor->listener) {
+			errx(1, "could not start listener %i", errno);
 		}
+
+		vector_pushcpy(&ctx->reactors, &reactor);
+
+		if (i>0) thrd_create(&reactor->thread, reactor_loop, reactor);
+	}
+
+	freeaddrinfo(res);
+}
+
+void stop_listen(ctx_t* ctx) {
+	vector_iterator iter = vector_iterate(&ctx->reactors);
+	while (vector_next(&iter)) {
+		reactor_t* reactor = *(reactor_t**)iter.x;
+
+		if (iter.i > 1) {
+			event_base_loopbreak(reactor->evbase);
+			thrd_join(reactor->thread, NULL);
+		}
+
+		evconnlistener_free(reactor->listener);
+		if (iter.i > 1) event_base_free(reactor->evbase);
+
+		drop(reactor);
 	}
 
-	errx(1, "could not start listener %i", errno);
+	vector_free(&ctx->reactors);
 }
@@ -12,33 +12,60 @@
 #include "event2/buffer.h"
 #include "event2/listener.h"
 #include "event2/bufferevent.h"
+#include <openssl/rand.h>
+#include <zlib.h>
+#include <brotli/encode.h>
 #include "util.h"
 #include "vector.h"
 #include "hashtable.h"
 #include "threads.h"
 #include "reasonphrases.h"
 int skip_newline(char** cur);
-char* percent_decode(char* data, unsigned long* sz);
+char hexchar(char hex);
+void charhex(unsigned char chr, char* out);
+unsigned long percent_decode_to(char* data, char* out);
+char* percent_encode(char* data, unsigned long sz);
+#include "template.h"
 #include "context.h"
-void respond(session_t* session, int stat, char* content, unsigned long len, char* (*headers)[2], int headers_len);
-void respond_redirect(session_t* session, char* url);
-void escape_html(char** str);
+#define EXTRA_HEADERS_MAX 4 //given along with a page or ranges, ie. validators
 typedef struct {
-	char* str;
-	unsigned long skip; //if a condition, length, including !%
-	unsigned long max_args; //required arguments
-	unsigned long max_cond;
-	unsigned long max_loop;
-	vector_t substitutions;
-} template_t;
+	char* data; //raw deflate, see deflate_segment
+	unsigned long len;
+
+	uint32_t crc; //of the uncompressed data
+	unsigned long raw_len;
+} deflated;
+int accepts_encoding(request* req, char* encoding);
+void resource_compress(resource* res);
+deflated deflate_segment(char* data, unsigned long len);
+int headers_join(char* (*out)[2], char* (*own)[2], int own_len, char* (*extra)[2], int extra_len);
+void http_date(time_t time, char* out);
+int not_modified(request* req, char* etag, time_t modified);
+void respond(session_t* session, int stat, char* content, unsigned long len, char* (*headers)[2], int headers_len);
+void respond_ref(session_t* session, int stat, char* content, unsigned long len, char* (*headers)[2], int headers_len, evbuffer_ref_cleanup_cb cleanup, void* arg);
+void respond_file(session_t* session, int stat, int fd, unsigned long len, char* (*headers)[2], int headers_len);
 typedef struct {
-	int* cond_args;
-	vector_t** loop_args;
-	char** sub_args;
-} template_args;
-template_t template_new(char* data);
+	unsigned long start;
+	unsigned long len;
+} byte_range;
+int parse_ranges(request* req, char* etag, char* modified, unsigned long size, vector_t* ranges);
+void respond_ranges(session_t* session, vector_t* ranges, unsigned long size, char* mime, char* data, int fd, char* (*extra)[2], int extra_len);
+void respond_unsatisfiable(session_t* session, unsigned long size);
+void respond_redirect(session_t* session, char* url);
+char* html_entity(char x);
+unsigned long escaped_length(char* str, char* end);
+void template_escape(template_out* out, char* arg);
+char* page_render(ctx_t* ctx, char* template_name, char* title, template_splice* splice, unsigned long* len, ...);
+char* template_render(ctx_t* ctx, char* template_name, unsigned long* len, ...);
 void respond_template(session_t* session, int stat, char* template_name, char* title, ...);
+deflated deflate_stored(char* data, unsigned long len);
+cached_page* page_new(char* body, unsigned long len, unsigned long split, char** fragments, unsigned long* fragment_lens, unsigned long page_version);
+void respond_page(session_t* session, int stat, cached_page* page, int fragment, int gzip, char* (*extra)[2], int extra_len);
 void respond_error(session_t* session, int stat, char* err);
 vector_t query_find(vector_t *vec, char **params, int num_params, int strict);
 vector_t multipart_find(vector_t *vec, char **params, int num_params, int strict);
-void start_listen(ctx_t* ctx, const char *port);
+int multipart_commit(request* req, char* name, char* path);
+void start_workers(ctx_t* ctx);
+void stop_workers(ctx_t* ctx);
+void start_listen(ctx_t* ctx, const char *port, unsigned long reactors);
+void stop_listen(ctx_t* ctx);
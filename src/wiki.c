@@ -2,6 +2,12 @@
 #include "stdio.h"
 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <threads.h>
+#include <stdatomic.h>
 
 #include "vector.h"
 #include "hashtable.h"
@@ -10,6 +16,22 @@
 #include "context.h"
 
 #define DATA_PATH "./data/"
+#define TXT_MAPS 64 //diff files kept mapped, oldest unmapped first
+#define DIFF_MAX_COST 1024 //edits searched for a middle snake before settling for a good enough split
+
+//revision index and keyframes, next to the diff file (article names cant have dots)
+#define REV_EXT ".rev"
+#define KEY_EXT ".key"
+#define REV_KEYFRAME_REVS 32 //diffs between keyframes at most
+#define REV_KEYFRAME_BYTES 64*1024 //or diff bytes, whichever comes first
+#define REV_NO_KEYFRAME UINT64_MAX
+
+//v2 diff files: magic | newest diff, then records appended after it and never rewritten
+//v1 files start with a prefixed offset of the current text instead, so a 1
+#define TXT_MAGIC "\0ranchd2"
+#define TXT_HEADER 16
+#define TXT_RECORD_DIFF 1 //kind | varint body length | body | crc32c of all before it
+#define CUR_EXT ".cur" //current text, newest diff | crc32c | text
 
 typedef struct {
 	uint64_t pos;
@@ -31,45 +53,47 @@ typedef struct {
 } diff_t;
 
 typedef struct {
-	FILE* file;
+	int fd; //-1 if opened for reading
+	char* filename;
 
 	char* current;
 	vector_t diffs;
 } text_t;
 
-int skipline(char** str) {
-	while (**str != '\n' && **str != '\r' && **str) (*str)++;
-	if (!**str) return 0;
-	
-	(*str)++;
-	if (**str=='\n') (*str)++;
-	
-	return 1;
-}
+//read only mapping of a diff file, replaced once the file grows
+typedef struct {
+	char* filename;
+	char* data;
+	uint64_t len;
 
-size_t skipline_i(char* str) {
-	size_t i=0;
+	dev_t dev;
+	ino_t ino;
 
-	while (*str != '\r' && *str != '\n' && *str) {
-		i++;
-		str++;
-	}
-	
-	return i;
-}
+	atomic_ulong refs; //readers, plus one while in txt_maps
+} txt_map;
 
-//returns beginning of matching line
-char* search_line(char* search, char* line, size_t linelen) {
-	size_t len;
-	while (*search && (len = skipline_i(search))) {
-		if (len == linelen && strncmp(search, line, len)==0) return search;
-		search += len;
-		
-		skipline(&search);
-	}
+//one per diff, oldest first, entry i takes revision i to i+1
+typedef struct {
+	uint64_t diff; //offset of it in the diff file
+	uint64_t keyframe; //offset of the text of revision i+1 in the key file, or REV_NO_KEYFRAME
 
-	return NULL;
-}
+	//since the last keyframe (revision 0 is an empty one), 0 if this is one
+	uint64_t since_revs;
+	uint64_t since_bytes;
+} rev_entry;
+
+//what a history page shows of a diff
+typedef struct {
+	uint64_t rev; //made by the diff
+	uint64_t author;
+	uint64_t time;
+
+	uint64_t added; //bytes
+	uint64_t deleted;
+} rev_summary;
+
+void rev_append(char* filename, uint64_t diff, uint64_t prev, uint64_t size, char* current_str);
+int txt_convert(char* filename);
 
 //copies (obv...)
 int parse_wiki_path(char* path, vector_t* vec) {
@@ -115,7 +139,214 @@ int parse_wiki_path(char* path, vector_t* vec) {
 	return 1;
 }
 
-//may keep references to "to"
+//lines of both texts interned to ids, so the diff compares integers
+typedef struct {
+	char* str;
+	unsigned long len;
+	uint64_t hash;
+	uint32_t id;
+} diff_line;
+
+typedef struct {
+	uint32_t* a; //ids of the old text's lines
+	uint32_t* b;
+	char* a_changed; //deleted lines
+	char* b_changed; //inserted lines
+
+	long* v; //forward and backward paths of bisect, 2*(2*max_d+2)
+} diff_ctx;
+
+//lines include their newline, so a missing one at the end is a change
+vector_t diff_split_lines(char* text, unsigned long text_len) {
+	vector_t lines = vector_new(sizeof(diff_line));
+	char* end = text + text_len;
+
+	while (text < end) {
+		char* nl = memchr(text, '\n', (size_t)(end - text));
+		unsigned long len = nl ? (unsigned long)(nl - text) + 1 : (unsigned long)(end - text);
+
+		//a word at a time, equal hashes are compared anyway
+		uint64_t hash = len;
+		unsigned long i=0;
+		for (; i+8<=len; i+=8) {
+			uint64_t word;
+			memcpy(&word, text+i, 8);
+
+			hash = (hash ^ word) * 0x9e3779b97f4a7c15;
+			hash ^= hash >> 29;
+		}
+
+		for (; i<len; i++) hash = (hash ^ (unsigned char)text[i]) * 0x100000001b3;
+
+		vector_pushcpy(&lines, &(diff_line){.str=text, .len=len, .hash=hash});
+		text += len;
+	}
+
+	return lines;
+}
+
+//equal lines get equal ids, open addressing over both texts at once
+void diff_intern(vector_t* a_lines, vector_t* b_lines) {
+	unsigned long size = 16;
+	while (size < 2*(a_lines->length + b_lines->length)) size *= 2;
+
+	diff_line** table = heap(sizeof(diff_line*)*size);
+	memset(table, 0, sizeof(diff_line*)*size);
+
+	uint32_t next_id = 0;
+	vector_t* texts[2] = {a_lines, b_lines};
+
+	for (int t=0; t<2; t++) {
+		vector_iterator iter = vector_iterate(texts[t]);
+		while (vector_next(&iter)) {
+			diff_line* line = iter.x;
+			unsigned long slot = line->hash & (size-1);
+
+			while (table[slot] && (table[slot]->hash != line->hash || table[slot]->len != line->len
+					|| memcmp(table[slot]->str, line->str, line->len)!=0)) {
+				slot = (slot+1) & (size-1);
+			}
+
+			if (!table[slot]) {
+				line->id = next_id++;
+				table[slot] = line;
+			} else {
+				line->id = table[slot]->id;
+			}
+		}
+	}
+
+	drop(table);
+}
+
+void diff_compare(diff_ctx* ctx, long a0, long a1, long b0, long b1);
+
+//splits at the middle snake of a[a0,a1) b[b0,b1), after myers
+//past DIFF_MAX_COST edits the furthest reaching forward path is taken instead, not minimal but bounded
+void diff_bisect(diff_ctx* ctx, long a0, long a1, long b0, long b1) {
+	uint32_t* a = ctx->a + a0;
+	uint32_t* b = ctx->b + b0;
+	long n = a1-a0, m = b1-b0;
+
+	long max_d = (n+m+1)/2;
+	long v_offset = max_d, v_length = 2*max_d+2;
+	long* v1 = ctx->v;
+	long* v2 = ctx->v + v_length;
+
+	for (long i=0; i<v_length; i++) {
+		v1[i] = -1;
+		v2[i] = -1;
+	}
+
+	v1[v_offset+1] = 0;
+	v2[v_offset+1] = 0;
+
+	long delta = n-m;
+	int front = delta % 2 != 0;
+	long k1start=0, k1end=0, k2start=0, k2end=0;
+
+	for (long d=0; d<max_d; d++) {
+		if (d > DIFF_MAX_COST) {
+			long best_x = -1, best_y = 0;
+
+			for (long k=-d+1+k1start; k<d-k1end; k+=2) {
+				long x = v1[v_offset+k], y = x-k;
+				if (x >= 0 && x <= n && y >= 0 && y <= m && x+y > best_x+best_y) {
+					best_x = x;
+					best_y = y;
+				}
+			}
+
+			if (best_x+best_y > 0 && best_x+best_y < n+m) {
+				diff_compare(ctx, a0, a0+best_x, b0, b0+best_y);
+				diff_compare(ctx, a0+best_x, a1, b0+best_y, b1);
+				return;
+			}
+
+			break;
+		}
+
+		for (long k1=-d+k1start; k1<=d-k1end; k1+=2) {
+			long k1_offset = v_offset+k1, x1;
+
+			if (k1 == -d || (k1 != d && v1[k1_offset-1] < v1[k1_offset+1])) x1 = v1[k1_offset+1];
+			else x1 = v1[k1_offset-1]+1;
+
+			long y1 = x1-k1;
+			while (x1 < n && y1 < m && a[x1] == b[y1]) {
+				x1++;
+				y1++;
+			}
+
+			v1[k1_offset] = x1;
+
+			if (x1 > n) k1end += 2;
+			else if (y1 > m) k1start += 2;
+			else if (front) {
+				long k2_offset = v_offset+delta-k1;
+				if (k2_offset >= 0 && k2_offset < v_length && v2[k2_offset] != -1 && x1 >= n-v2[k2_offset]) {
+					diff_compare(ctx, a0, a0+x1, b0, b0+y1);
+					diff_compare(ctx, a0+x1, a1, b0+y1, b1);
+					return;
+				}
+			}
+		}
+
+		for (long k2=-d+k2start; k2<=d-k2end; k2+=2) {
+			long k2_offset = v_offset+k2, x2;
+
+			if (k2 == -d || (k2 != d && v2[k2_offset-1] < v2[k2_offset+1])) x2 = v2[k2_offset+1];
+			else x2 = v2[k2_offset-1]+1;
+
+			long y2 = x2-k2;
+			while (x2 < n && y2 < m && a[n-x2-1] == b[m-y2-1]) {
+				x2++;
+				y2++;
+			}
+
+			v2[k2_offset] = x2;
+
+			if (x2 > n) k2end += 2;
+			else if (y2 > m) k2start += 2;
+			else if (!front) {
+				long k1_offset = v_offset+delta-k2;
+				if (k1_offset >= 0 && k1_offset < v_length && v1[k1_offset] != -1) {
+					long x1 = v1[k1_offset], y1 = v_offset+x1-k1_offset;
+
+					if (x1 >= n-x2) {
+						diff_compare(ctx, a0, a0+x1, b0, b0+y1);
+						diff_compare(ctx, a0+x1, a1, b0+y1, b1);
+						return;
+					}
+				}
+			}
+		}
+	}
+
+	//nothing in common
+	memset(ctx->a_changed + a0, 1, (size_t)n);
+	memset(ctx->b_changed + b0, 1, (size_t)m);
+}
+
+//marks the lines that differ between a[a0,a1) and b[b0,b1)
+void diff_compare(diff_ctx* ctx, long a0, long a1, long b0, long b1) {
+	while (a0 < a1 && b0 < b1 && ctx->a[a0] == ctx->b[b0]) {
+		a0++;
+		b0++;
+	}
+
+	while (a0 < a1 && b0 < b1 && ctx->a[a1-1] == ctx->b[b1-1]) {
+		a1--;
+		b1--;
+	}
+
+	if (a0 == a1) memset(ctx->b_changed + b0, 1, (size_t)(b1-b0));
+	else if (b0 == b1) memset(ctx->a_changed + a0, 1, (size_t)(a1-a0));
+	else diff_bisect(ctx, a0, a1, b0, b1);
+}
+
+//line diff of from against to, positions are in from
+//changed runs become an addition and a deletion at the same position
 diff_t find_changes(char* from, char* to) {
 	diff_t d;
 	d.additions = vector_new(sizeof(add_t));
@@ -126,59 +357,89 @@ diff_t find_changes(char* from, char* to) {
 		return d;
 	}
 
-	char* from_start = from;
+	//whole lines in common at either end are skipped before anything is split or hashed
+	unsigned long from_len = strlen(from), to_len = strlen(to);
+	unsigned long prefix = 0, suffix = 0;
 
-	char* insertion=to, *deletion=from;
+	while (prefix < from_len && prefix < to_len && from[prefix] == to[prefix]) prefix++;
+	while (prefix > 0 && from[prefix-1] != '\n') prefix--;
 
-	while (*to || *from) {
-		size_t from_skip_len = skipline_i(from);
-		size_t to_skip_len = skipline_i(to);
+	while (suffix < from_len-prefix && suffix < to_len-prefix && from[from_len-suffix-1] == to[to_len-suffix-1]) suffix++;
 
-		if (from_skip_len != to_skip_len || strncmp(from, to, from_skip_len)!=0) {
-			while (1) {
-				deletion = search_line(from, to, to_skip_len); //includes newline at start of line
+	//has to start a line in both, otherwise from just after a newline they share
+	int from_line = from_len-suffix == prefix || from[from_len-suffix-1] == '\n';
+	int to_line = to_len-suffix == prefix || to[to_len-suffix-1] == '\n';
 
-				if (deletion || !*to) { //EOF or skip
-					if (!*to) {
-						deletion = from + strlen(from); //delete and insert to EOF, if EOF
-					}
+	if (suffix && !(from_line && to_line)) {
+		char* suffix_nl = memchr(from+from_len-suffix, '\n', suffix);
+		suffix = suffix_nl ? from_len - (unsigned long)(suffix_nl+1 - from) : 0;
+	}
 
-					if (to > insertion) {
-						add_t* add = vector_pushcpy(&d.additions, &(add_t){.pos=from-from_start, .txt=heap(to-insertion+1)});
-						strncpy(add->txt, insertion, to-insertion);
-						add->txt[to-insertion] = 0;
-					}
+	vector_t a_lines = diff_split_lines(from+prefix, from_len-prefix-suffix);
+	vector_t b_lines = diff_split_lines(to+prefix, to_len-prefix-suffix);
+	diff_intern(&a_lines, &b_lines);
 
-					if (deletion > from) {
-						del_t* del = vector_pushcpy(&d.deletions, &(del_t){.pos=from-from_start, .txt=heap(deletion-from+1)});
-						strncpy(del->txt, from, deletion-from);
-						del->txt[deletion-from] = 0;
-						from = deletion;
-					}
-					
-					break;
-				}
+	long n = (long)a_lines.length, m = (long)b_lines.length;
 
-				to += to_skip_len;
-				skipline(&to);
-				
-				to_skip_len = skipline_i(to);
-			}
-		} else {
-			from += from_skip_len;
-			to += to_skip_len;
-			
-			//match newline inclusion
-			if (!skipline(&from)) {
-				insertion = to;
-				skipline(&to);
-			} else {
-				skipline(&to);
-				insertion = to;
-			}
+	diff_ctx ctx;
+	ctx.a = heap(sizeof(uint32_t)*(n+1));
+	ctx.b = heap(sizeof(uint32_t)*(m+1));
+	ctx.a_changed = heap(n+1);
+	ctx.b_changed = heap(m+1);
+	ctx.v = heap(sizeof(long)*2*(n+m+4));
+
+	memset(ctx.a_changed, 0, n+1);
+	memset(ctx.b_changed, 0, m+1);
+
+	for (long i=0; i<n; i++) ctx.a[i] = ((diff_line*)vector_get(&a_lines, i))->id;
+	for (long i=0; i<m; i++) ctx.b[i] = ((diff_line*)vector_get(&b_lines, i))->id;
+
+	diff_compare(&ctx, 0, n, 0, m);
+
+	long i=0, j=0;
+	uint64_t pos=prefix;
+
+	while (i < n || j < m) {
+		if (i < n && j < m && !ctx.a_changed[i] && !ctx.b_changed[j]) {
+			pos += ((diff_line*)vector_get(&a_lines, i))->len;
+			i++;
+			j++;
+			continue;
+		}
+
+		uint64_t del_len = 0;
+		while (i < n && ctx.a_changed[i]) del_len += ((diff_line*)vector_get(&a_lines, i++))->len;
+
+		char* add_start = j < m ? ((diff_line*)vector_get(&b_lines, j))->str : NULL;
+		uint64_t add_len = 0;
+		while (j < m && ctx.b_changed[j]) add_len += ((diff_line*)vector_get(&b_lines, j++))->len;
+
+		//unchanged lines pair up, so this only ends a broken marking
+		if (!del_len && !add_len) break;
+
+		if (add_len) {
+			add_t* add = vector_pushcpy(&d.additions, &(add_t){.pos=pos, .txt=heap(add_len+1)});
+			memcpy(add->txt, add_start, add_len);
+			add->txt[add_len] = 0;
+		}
+
+		if (del_len) {
+			del_t* del = vector_pushcpy(&d.deletions, &(del_t){.pos=pos, .txt=heap(del_len+1)});
+			memcpy(del->txt, from+pos, del_len);
+			del->txt[del_len] = 0;
+			pos += del_len;
 		}
 	}
 
+	drop(ctx.a);
+	drop(ctx.b);
+	drop(ctx.a_changed);
+	drop(ctx.b_changed);
+	drop(ctx.v);
+
+	vector_free(&a_lines);
+	vector_free(&b_lines);
+
 	return d;
 }
 
@@ -210,311 +471,1330 @@ vector_t make_path(vector_t* path) {
 	return out_path;
 }
 
+uint32_t crc32c_table[256];
+once_flag crc32c_once = ONCE_FLAG_INIT;
+
+void crc32c_init() {
+	for (uint32_t i=0; i<256; i++) {
+		uint32_t crc = i;
+		for (int j=0; j<8; j++) crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+		crc32c_table[i] = crc;
+	}
+}
+
+uint32_t crc32c(char* data, uint64_t len) {
+	call_once(&crc32c_once, crc32c_init);
+
+	uint32_t crc = 0xFFFFFFFF;
+	for (uint64_t i=0; i<len; i++) {
+		crc = crc32c_table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+//bytes of x as a varint, seven bits each
+unsigned txt_u64_size(uint64_t x) {
+	unsigned size = 1;
+	for (; x >= 0x80; x >>= 7) size++;
+	return size;
+}
+
+void txt_put_u64(vector_t* buf, uint64_t x) {
+	for (; x >= 0x80; x >>= 7) vector_pushcpy(buf, &(char){(char)(x | 0x80)});
+	vector_pushcpy(buf, &(char){(char)x});
+}
+
+//appends the whole record for d, prev being the offset of the diff before it or 0
+void txt_put_diff(vector_t* buf, diff_t* d, uint64_t prev) {
+	uint64_t len = txt_u64_size(prev) + txt_u64_size(d->author) + txt_u64_size(d->time)
+		+ txt_u64_size(d->additions.length) + txt_u64_size(d->deletions.length);
+
+	vector_t* changes[2] = {&d->additions, &d->deletions};
+	for (int i=0; i<2; i++) {
+		vector_iterator iter = vector_iterate(changes[i]);
+		while (vector_next(&iter)) {
+			add_t* add = iter.x; //same layout as del_t
+			uint64_t add_len = strlen(add->txt);
+			len += txt_u64_size(add->pos) + txt_u64_size(add_len) + add_len;
+		}
+	}
+
+	unsigned long start = buf->length;
+	vector_pushcpy(buf, &(char){TXT_RECORD_DIFF});
+	txt_put_u64(buf, len);
+
+	txt_put_u64(buf, prev);
+	txt_put_u64(buf, d->author);
+	txt_put_u64(buf, d->time);
+
+	for (int i=0; i<2; i++) {
+		txt_put_u64(buf, changes[i]->length);
+
+		vector_iterator iter = vector_iterate(changes[i]);
+		while (vector_next(&iter)) {
+			add_t* add = iter.x;
+			uint64_t add_len = strlen(add->txt);
+
+			txt_put_u64(buf, add->pos);
+			txt_put_u64(buf, add_len);
+			vector_stockcpy(buf, add_len, add->txt);
+		}
+	}
+
+	uint32_t crc = crc32c((char*)buf->data + start, buf->length - start);
+	vector_stockcpy(buf, sizeof(uint32_t), &crc);
+}
+
+//written to a temporary and renamed over, so it is either the old text or the new one
+int txt_cur_write(char* filename, uint64_t head, char* text) {
+	char* cur_path = heapstr("%s" CUR_EXT, filename);
+	char* cur_tmp = heapstr("%s" CUR_EXT ".tmp", filename);
+
+	uint64_t len = strlen(text);
+	char head_buf[12];
+	memcpy(head_buf, &head, 8);
+
+	uint32_t crc = crc32c(text, len);
+	memcpy(head_buf+8, &crc, 4);
+
+	int fd = open(cur_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	int ok = fd >= 0 && write(fd, head_buf, 12) == 12 && write(fd, text, len) == (ssize_t)len;
+	if (fd >= 0) close(fd);
+
+	if (ok) ok = rename(cur_tmp, cur_path)==0;
+	else unlink(cur_tmp);
+
+	drop(cur_path);
+	drop(cur_tmp);
+	return ok;
+}
+
+//older files are rewritten in the current format before anything is added to them
 text_t txt_new(char* filename) {
 	text_t txt;
 
-	txt.file = fopen(filename, "rb+");
-	if (!txt.file) {
-		txt.file = fopen(filename, "wb+");
-	}
+	txt_convert(filename);
+	txt.fd = open(filename, O_RDWR | O_CREAT, 0664);
 
+	txt.filename = heapcpystr(filename);
+	txt.current = NULL;
 	txt.diffs = vector_new(sizeof(diff_t));
 	return txt;
 }
 
-void add_diff(text_t* txt, diff_t* d, char* current_str) {
-	char one = 1;	 //prefix uint64s with one for a prefix encoding of diff separators
+//for read_txt only, nothing is opened or created
+text_t txt_open(char* filename) {
+	return (text_t){.fd=-1, .filename=heapcpystr(filename), .current=NULL, .diffs=vector_new(sizeof(diff_t))};
+}
+
+//the record goes at the end in one write and is synced before the header points at it
+//a crash leaves the old chain, at worst with an unreferenced record after it
+//0 if nothing was saved, then the edit shouldnt be applied anywhere else
+int add_diff(text_t* txt, diff_t* d, char* current_str) {
+	struct stat st;
+	if (txt->fd < 0 || fstat(txt->fd, &st) != 0) return 0;
 
-	uint64_t current = 9;
-	fseek(txt->file, 1, SEEK_SET);
-	if (fread(&current, 8, 1, txt->file) < 1) {
-		fseek(txt->file, 0, SEEK_SET);
-		fwrite(&one, 1, 1, txt->file);
-		fwrite(&current, 8, 1, txt->file); //pad beginning, we will rewrite later
-	}
-	
-	uint64_t len, prev;
+	uint64_t end = (uint64_t)st.st_size, prev = 0;
+	char header[TXT_HEADER];
 
-	fseek(txt->file, current+1, SEEK_SET);
-	
-	//replace current with diff
-	
-	if (fread(&prev, 8, 1, txt->file) < 1)
-		prev = 0;
+	//an older file that couldnt be converted is left alone
+	if (end >= TXT_HEADER && (pread(txt->fd, header, TXT_HEADER, 0) != TXT_HEADER || memcmp(header, TXT_MAGIC, 8)!=0))
+		return 0;
 
-	fseek(txt->file, current, SEEK_SET);
-	
-	char sep[10] = {1, 0}; //separate diff
-	fwrite(sep, 10, 1, txt->file);
-	
-	fwrite(&one, 1, 1, txt->file);
-	fwrite(&prev, 8, 1, txt->file);
-	
-	fwrite(&one, 1, 1, txt->file);
-	fwrite(&d->author, 8, 1, txt->file);
+	vector_t buf = vector_new(1);
 
-	fwrite(&one, 1, 1, txt->file);
-	fwrite(&d->time, 8, 1, txt->file);
+	if (end < TXT_HEADER) {
+		end = 0;
 
-	len = (uint64_t)d->additions.length;
-	fwrite(&one, 1, 1, txt->file);
-	fwrite(&len, 8, 1, txt->file);
+		vector_stockcpy(&buf, 8, TXT_MAGIC);
+		vector_stockcpy(&buf, 8, &prev);
+	} else {
+		memcpy(&prev, header+8, 8);
+	}
 
-	vector_iterator add_iter = vector_iterate(&d->additions);
-	while (vector_next(&add_iter)) {
-		add_t* add = add_iter.x;
-		fwrite(&one, 1, 1, txt->file);
-		fwrite(&add->pos, 8, 1, txt->file);
+	uint64_t at = end + buf.length;
+	txt_put_diff(&buf, d, prev);
 
-		len = strlen(add->txt);
-		fwrite(&one, 1, 1, txt->file);
-		fwrite(&len, 8, 1, txt->file);
+	int ok = pwrite(txt->fd, buf.data, buf.length, (off_t)end) == (ssize_t)buf.length
+		&& fdatasync(txt->fd)==0
+		&& pwrite(txt->fd, &at, 8, 8) == 8; //aligned and within a sector, so it lands whole
 
-		fwrite(add->txt, len, 1, txt->file);
+	if (ok) {
+		txt_cur_write(txt->filename, at, current_str);
+		rev_append(txt->filename, at, prev, end + buf.length - at, current_str);
 	}
 
-	len = (uint64_t)d->deletions.length;
-	fwrite(&one, 1, 1, txt->file);
-	fwrite(&len, 8, 1, txt->file);
+	vector_free(&buf);
+	return ok;
+}
+
+void diff_free(diff_t* d) {
+	vector_iterator add_iter = vector_iterate(&d->additions);
+	while (vector_next(&add_iter)) {
+		drop(((add_t*)add_iter.x)->txt);
+	}
 
 	vector_iterator del_iter = vector_iterate(&d->deletions);
 	while (vector_next(&del_iter)) {
-		del_t* del = del_iter.x;
-		fwrite(&one, 1, 1, txt->file);
-		fwrite(&del->pos, 8, 1, txt->file);
+		drop(((del_t*)del_iter.x)->txt);
+	}
+	
+	vector_free(&d->additions);
+	vector_free(&d->deletions);
+}
 
-		len = strlen(del->txt);
-		fwrite(&one, 1, 1, txt->file);
-		fwrite(&len, 8, 1, txt->file);
+mtx_t txt_maps_lock;
+vector_t txt_maps; //txt_map*, oldest first
+once_flag txt_maps_once = ONCE_FLAG_INIT;
 
-		fwrite(del->txt, len, 1, txt->file);
+void txt_maps_init() {
+	mtx_init(&txt_maps_lock, mtx_plain);
+	txt_maps = vector_new(sizeof(txt_map*));
+}
+
+void txt_map_release(txt_map* map) {
+	if (atomic_fetch_sub(&map->refs, 1) == 1) {
+		munmap(map->data, map->len);
+		drop(map->filename);
+		drop(map);
 	}
+}
 
-	uint64_t new_current = ftell(txt->file);
+//referenced mapping of the file as it is now, NULL if it is missing or empty
+//one stat per call, files are only appended to or replaced so size and inode tell if it is current
+txt_map* txt_map_get(char* filename) {
+	call_once(&txt_maps_once, txt_maps_init);
 
-	fwrite(&one, 1, 1, txt->file);
-	fwrite(&current, 8, 1, txt->file); //write prev
+	struct stat st;
+	if (stat(filename, &st) != 0 || st.st_size == 0) return NULL;
 
-	len = strlen(current_str);
-	fwrite(&one, 1, 1, txt->file);
-	fwrite(&len, 8, 1, txt->file);
+	mtx_lock(&txt_maps_lock);
 
-	fwrite(current_str, len, 1, txt->file);
+	vector_iterator iter = vector_iterate(&txt_maps);
+	while (vector_next(&iter)) {
+		txt_map* map = *(txt_map**)iter.x;
+		if (strcmp(map->filename, filename) != 0) continue;
 
-	fseek(txt->file, 0, SEEK_SET);
-	fwrite(&one, 1, 1, txt->file);
-	fwrite(&new_current, 8, 1, txt->file);
-}
+		if (map->dev == st.st_dev && map->ino == st.st_ino && map->len == (uint64_t)st.st_size) {
+			atomic_fetch_add(&map->refs, 1);
+			mtx_unlock(&txt_maps_lock);
+			return map;
+		}
 
-void read_txt(text_t* txt, uint64_t start, uint64_t max) {
-	fseek(txt->file, 1, SEEK_SET);
-	
-	uint64_t current, length, prev;
-	if (fread(&current, 8, 1, txt->file)<1) {
-		txt->current = NULL;
-		return;
+		vector_remove(&txt_maps, iter.i-1);
+		txt_map_release(map);
+		break;
 	}
 
-	fseek(txt->file, current+1, SEEK_SET);
+	mtx_unlock(&txt_maps_lock);
 
-	//prev diff | length | data
-	fread(&prev, 8, 1, txt->file);
-	fseek(txt->file, 1, SEEK_CUR);
-	fread(&length, 8, 1, txt->file);
-	
-	txt->current = heap(length+1);
-	txt->current[length] = 0;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return NULL;
 
-	fread(txt->current, length, 1, txt->file);
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
 
-	for (uint64_t i=0; prev>0 && i<max; i++) {
-		if (start>0 && i==0) {
-			fseek(txt->file, 0, SEEK_END);
-			if (start >= ftell(txt->file)) return;
+	char* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
 
-			fseek(txt->file, start, SEEK_SET);
+	if (data == MAP_FAILED) return NULL;
 
-			char pre[10];
-			if (fread(pre, 10, 1, txt->file)<1) return;
-			if (memcmp(pre, (char[10]){1, 0}, 10)!=0) return;
-		
-			fseek(txt->file, 1, SEEK_CUR);
-		} else {
-			fseek(txt->file, prev+10+1, SEEK_SET); //skip prefix and one
-		}
-		
-		fread(&prev, 8, 1, txt->file);
+	txt_map* map = heap(sizeof(txt_map));
+	map->filename = heapcpystr(filename);
+	map->data = data;
+	map->len = (uint64_t)st.st_size;
+	map->dev = st.st_dev;
+	map->ino = st.st_ino;
+	atomic_init(&map->refs, 2);
 
-		diff_t* d = vector_push(&txt->diffs);
-		d->additions = vector_new(sizeof(add_t));
-		d->deletions = vector_new(sizeof(del_t));
-		d->prev = prev;
+	mtx_lock(&txt_maps_lock);
 
-		fseek(txt->file, 1, SEEK_CUR);
-		fread(&d->author, 8, 1, txt->file);
+	if (txt_maps.length == TXT_MAPS) {
+		txt_map* oldest = *(txt_map**)vector_get(&txt_maps, 0);
+		vector_remove(&txt_maps, 0);
+		txt_map_release(oldest);
+	}
 
-		fseek(txt->file, 1, SEEK_CUR);
-		fread(&d->time, 8, 1, txt->file);
+	vector_pushcpy(&txt_maps, &map);
+	mtx_unlock(&txt_maps_lock);
 
-		fseek(txt->file, 1, SEEK_CUR);
-		fread(&length, 8, 1, txt->file); //length of additions
+	return map;
+}
 
-		uint64_t length2;
+typedef struct {
+	char* pos;
+	char* end;
+	int version; //of the file, v1 prefixes raw uint64s and v2 uses varints
+} txt_cursor;
+
+//0 if the file ends first
+int txt_read_u64(txt_cursor* cur, uint64_t* out) {
+	if (cur->version == 1) {
+		if (cur->end - cur->pos < 9) return 0;
+
+		memcpy(out, cur->pos+1, 8);
+		cur->pos += 9;
+		return 1;
+	}
 
-		for (uint64_t i=0; i<length; i++) {
-			add_t* add = vector_push(&d->additions);
-			
-			fseek(txt->file, 1, SEEK_CUR);
-			fread(&add->pos, 8, 1, txt->file);
-			fseek(txt->file, 1, SEEK_CUR);
-			fread(&length2, 8, 1, txt->file);
-			
-			add->txt = heap(length2+1);
-			add->txt[length2] = 0;
+	uint64_t x = 0;
+	for (unsigned shift=0; shift<64 && cur->pos < cur->end; shift+=7) {
+		unsigned char b = (unsigned char)*cur->pos++;
+		x |= (uint64_t)(b & 0x7F) << shift;
 
-			fread(add->txt, length2, 1, txt->file);
+		if (!(b & 0x80)) {
+			*out = x;
+			return 1;
 		}
+	}
 
-		fseek(txt->file, 1, SEEK_CUR);
-		fread(&length, 8, 1, txt->file); //length of deletions
+	return 0;
+}
 
-		//same fokin thing
-		for (uint64_t i=0; i<length; i++) {
-			del_t* del = vector_push(&d->deletions);
-			
-			fseek(txt->file, 1, SEEK_CUR);
-			fread(&del->pos, 8, 1, txt->file);
-			fseek(txt->file, 1, SEEK_CUR);
-			fread(&length2, 8, 1, txt->file);
+//length then data, copied out since the file is rewritten under the mapping
+char* txt_read_str(txt_cursor* cur) {
+	uint64_t len;
+	if (!txt_read_u64(cur, &len) || len > (uint64_t)(cur->end - cur->pos)) return NULL;
 
-			del->txt = heap(length2+1);
-			del->txt[length2] = 0;
+	char* str = heap(len+1);
+	memcpy(str, cur->pos, len);
+	str[len] = 0;
 
-			fread(del->txt, length2, 1, txt->file);
-		}
-	}
+	cur->pos += len;
+	return str;
 }
 
-typedef struct {
-	char* str;
-	unsigned long len;
+//diff at cur, after its separator
+int txt_read_diff(txt_cursor* cur, diff_t* d) {
+	d->additions = vector_new(sizeof(add_t));
+	d->deletions = vector_new(sizeof(del_t));
 
-	enum {dseg_add, dseg_del, dseg_current} ty;
-	unsigned long diff;
-} dseg;
+	uint64_t length;
+	if (!txt_read_u64(cur, &d->prev) || !txt_read_u64(cur, &d->author)
+			|| !txt_read_u64(cur, &d->time) || !txt_read_u64(cur, &length))
+		return 0;
 
-//origin comes before, new overlaps/is adjacent in order
-void split_dseg(vector_t* segs, dseg new_seg, unsigned long last_segi, unsigned long start) {
-	unsigned long slen=0;
+	for (uint64_t i=0; i<length; i++) {
+		add_t add;
+		if (!txt_read_u64(cur, &add.pos) || !(add.txt = txt_read_str(cur))) return 0;
+		vector_pushcpy(&d->additions, &add);
+	}
 
-	vector_iterator iter = vector_iterate(segs);
-	iter.i = last_segi;
+	if (!txt_read_u64(cur, &length)) return 0;
 
-	while (slen < new_seg.len+start) {
-		vector_next(&iter);
-		
-		dseg* seg = iter.x;
-		slen += seg->len;
+	for (uint64_t i=0; i<length; i++) {
+		del_t del;
+		if (!txt_read_u64(cur, &del.pos) || !(del.txt = txt_read_str(cur))) return 0;
+		vector_pushcpy(&d->deletions, &del);
 	}
 
-	unsigned long remove_from = last_segi;
-	
-	if (start!=0) {
-		dseg* first = vector_get(segs, last_segi);
-		first->len = start;
-		
-		slen -= start;
-		
-		remove_from++;
+	return 1;
+}
+
+//0 if it isnt a diff file at all
+int txt_version(txt_map* map) {
+	if (map->len >= TXT_HEADER && memcmp(map->data, TXT_MAGIC, 8)==0) return 2;
+	return map->data[0] == 1 ? 1 : 0;
+}
+
+//cur over the fields of the diff at, 0 if there is none or it fails its checksum
+int txt_record_at(txt_map* map, uint64_t at, txt_cursor* cur) {
+	if (txt_version(map) == 1) {
+		if (at >= map->len || map->len - at < 10 || memcmp(map->data + at, (char[10]){1, 0}, 10)!=0) return 0;
+
+		*cur = (txt_cursor){.pos=map->data + at + 10, .end=map->data + map->len, .version=1};
+		return 1;
 	}
-	
-	dseg last = *(dseg*)vector_get(segs, iter.i-1);
 
-	if (slen > new_seg.len) {
-		last.str += last.len - (slen-new_seg.len);
-		last.len = slen-new_seg.len;
-		
-		vector_insertcpy(segs, iter.i, &last);
+	if (at < TXT_HEADER || at >= map->len || map->data[at] != TXT_RECORD_DIFF) return 0;
+
+	txt_cursor len_cur = {.pos=map->data + at + 1, .end=map->data + map->len, .version=2};
+
+	uint64_t len;
+	if (!txt_read_u64(&len_cur, &len) || (uint64_t)(len_cur.end - len_cur.pos) < 4 || len > (uint64_t)(len_cur.end - len_cur.pos) - 4)
+		return 0;
+
+	char* body_end = len_cur.pos + len;
+
+	uint32_t crc;
+	memcpy(&crc, body_end, 4);
+	if (crc32c(map->data + at, (uint64_t)(body_end - (map->data + at))) != crc) return 0;
+
+	*cur = (txt_cursor){.pos=len_cur.pos, .end=body_end, .version=2};
+	return 1;
+}
+
+//diff at offset at, vectors are set up even if it fails
+int txt_diff_at(txt_map* map, uint64_t at, diff_t* d) {
+	txt_cursor cur;
+	if (!txt_record_at(map, at, &cur)) {
+		d->additions = vector_new(sizeof(add_t));
+		d->deletions = vector_new(sizeof(del_t));
+		return 0;
 	}
 
-	//remove everything in between and insert new seg at beginning
-		
-	if (iter.i > remove_from)
-		vector_removemany(segs, remove_from, iter.i-remove_from);
-	
-	vector_insertcpy(segs, remove_from, &new_seg);
+	return txt_read_diff(&cur, d);
+}
 
-	iter = vector_iterate(segs);
-	while (vector_next(&iter)) {
-		dseg* s = iter.x;
-		if (!s->str) abort();
+//v1 only, where the current text is and the newest diff, cur is left at the text's length
+int txt_read_head(txt_map* map, txt_cursor* cur, uint64_t* current, uint64_t* prev) {
+	*cur = (txt_cursor){.pos=map->data, .end=map->data + map->len, .version=1};
+	if (!txt_read_u64(cur, current) || *current >= map->len) return 0;
+
+	//prev diff | length | data
+	cur->pos = map->data + *current;
+	return txt_read_u64(cur, prev);
+}
+
+//offset of the newest diff, 0 if there are none
+int txt_head(txt_map* map, uint64_t* head) {
+	if (txt_version(map) == 1) {
+		txt_cursor cur;
+		uint64_t current;
+		return txt_read_head(map, &cur, &current, head);
 	}
+
+	if (txt_version(map) == 0) return 0;
+
+	memcpy(head, map->data + 8, 8);
+	return *head < map->len;
 }
 
-vector_t display_diffs(text_t* txt) {
-	vector_t segs = vector_new(sizeof(dseg));
-	vector_pushcpy(&segs, &(dseg){.len=strlen(txt->current), .ty=dseg_current, .str=txt->current});
+//mapping along with its newest diff, the header can be ahead of a mapping made before the last append
+txt_map* txt_map_head(char* filename, uint64_t* head) {
+	for (int tries=0; tries<3; tries++) {
+		txt_map* map = txt_map_get(filename);
+		if (!map) return NULL;
 
-	vector_iterator iter = vector_iterate(&txt->diffs);
-	while (vector_next(&iter)) {
-		diff_t* d = iter.x;
-		
-		//process removes first
-		int iteradd=0;
-		vector_iterator d_iter = vector_iterate(&d->deletions);
-
-		while (1) {
-			if (!vector_next(&d_iter)) {
-				if (iteradd) break;
-				
-				d_iter = vector_iterate(&d->additions);
-				iteradd=1;
-				continue;
-			}
-			
-			//i know theyre the same thing but when i find a gullible contributor there will be changes
-			add_t* add = d_iter.x;
-			del_t* del = d_iter.x;
-			//i know i am
+		if (txt_head(map, head)) return map;
+		txt_map_release(map);
+	}
 
-			//ehhhhh
-			vector_iterator segiter = vector_iterate(&segs);
-			unsigned long pos=0;
+	return NULL;
+}
 
-			dseg* seg;
+//offsets of every diff in the chain, oldest first
+vector_t txt_diff_offsets(txt_map* map, uint64_t prev) {
+	vector_t newest = vector_new(sizeof(uint64_t));
 
-			while (vector_next(&segiter)) {
-				if (pos > (iteradd ? add->pos : del->pos)) break;
+	txt_cursor cur;
+	while (prev > 0 && txt_record_at(map, prev, &cur)) {
+		vector_pushcpy(&newest, &prev);
 
-				seg = segiter.x;
-				if (seg->ty == dseg_add) continue;
+		//chains only go back, anything else is a broken file
+		uint64_t older;
+		if (!txt_read_u64(&cur, &older) || older >= prev) break;
 
-				pos += seg->len;
-			}
+		prev = older;
+	}
 
-			split_dseg(&segs,
-				(dseg){.diff=iter.i-1, .len=strlen(add->txt), .ty=iteradd ? dseg_add : dseg_del,
-					.str=iteradd ? add->txt : del->txt}, segiter.i-2,
-					seg->ty==dseg_add ? 0 : add->pos-(pos-seg->len));
-		}
+	vector_t offsets = vector_new(sizeof(uint64_t));
+	for (unsigned long i=newest.length; i>0; i--) {
+		vector_pushcpy(&offsets, vector_get(&newest, i-1));
 	}
 
-	return segs;
+	vector_free(&newest);
+	return offsets;
 }
 
-void diff_free(diff_t* d) {
-	vector_iterator add_iter = vector_iterate(&d->additions);
-	while (vector_next(&add_iter)) {
-		drop(((add_t*)add_iter.x)->txt);
-	}
+//events of a diff in position order, additions before deletions at the same position
+typedef struct {
+	vector_iterator adds;
+	vector_iterator dels;
+	add_t* add;
+	del_t* del;
+} diff_events;
+
+diff_events diff_events_start(diff_t* d) {
+	diff_events ev = {.adds=vector_iterate(&d->additions), .dels=vector_iterate(&d->deletions)};
+	ev.add = vector_next(&ev.adds) ? ev.adds.x : NULL;
+	ev.del = vector_next(&ev.dels) ? ev.dels.x : NULL;
+	return ev;
+}
 
-	vector_iterator del_iter = vector_iterate(&d->deletions);
-	while (vector_next(&del_iter)) {
-		drop(((del_t*)del_iter.x)->txt);
+//next event, sets *is_add, NULL when done
+char* diff_events_next(diff_events* ev, uint64_t* pos, int* is_add) {
+	if (ev->add && (!ev->del || ev->add->pos <= ev->del->pos)) {
+		add_t* add = ev->add;
+		ev->add = vector_next(&ev->adds) ? ev->adds.x : NULL;
+
+		*pos = add->pos;
+		*is_add = 1;
+		return add->txt;
+	} else if (ev->del) {
+		del_t* del = ev->del;
+		ev->del = vector_next(&ev->dels) ? ev->dels.x : NULL;
+
+		*pos = del->pos;
+		*is_add = 0;
+		return del->txt;
 	}
-	
-	vector_free(&d->additions);
-	vector_free(&d->deletions);
+
+	return NULL;
+}
+
+//text after d, from the text before it (positions are in the old text)
+char* diff_apply(char* old, diff_t* d) {
+	vector_t out = vector_new(1);
+	uint64_t len = strlen(old), at = 0, pos;
+	int is_add;
+
+	diff_events ev = diff_events_start(d);
+	char* str;
+
+	while ((str = diff_events_next(&ev, &pos, &is_add))) {
+		if (pos > len) pos = len;
+
+		if (pos > at) {
+			vector_stockcpy(&out, pos-at, old+at);
+			at = pos;
+		}
+
+		if (is_add) {
+			vector_stockstr(&out, str);
+		} else {
+			at += strlen(str);
+			if (at > len) at = len;
+		}
+	}
+
+	vector_stockcpy(&out, len-at, old+at);
+	vector_pushcpy(&out, "\0");
+	return out.data;
+}
+
+//text before d, from the text after it
+char* diff_revert(char* new, diff_t* d) {
+	vector_t out = vector_new(1);
+	uint64_t len = strlen(new), at = 0, old_at = 0, pos;
+	int is_add;
+
+	diff_events ev = diff_events_start(d);
+	char* str;
+
+	while ((str = diff_events_next(&ev, &pos, &is_add))) {
+		//unchanged text is the same length in both
+		if (pos > old_at) {
+			uint64_t same = pos - old_at;
+			if (same > len-at) same = len-at;
+
+			vector_stockcpy(&out, same, new+at);
+			at += same;
+			old_at = pos;
+		}
+
+		if (is_add) {
+			at += strlen(str);
+			if (at > len) at = len;
+		} else {
+			vector_stockstr(&out, str);
+			old_at += strlen(str);
+		}
+	}
+
+	vector_stockcpy(&out, len-at, new+at);
+	vector_pushcpy(&out, "\0");
+	return out.data;
+}
+
+//text of the .cur file and the diff it follows, NULL if it is missing or fails its checksum
+char* txt_cur_read(char* filename, uint64_t* head) {
+	char* cur_path = heapstr("%s" CUR_EXT, filename);
+	int fd = open(cur_path, O_RDONLY);
+	drop(cur_path);
+
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < 12) {
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+
+	uint64_t len = (uint64_t)st.st_size - 12;
+	char* text = heap(len+1);
+
+	char head_buf[12];
+	uint32_t crc;
+
+	int ok = pread(fd, head_buf, 12, 0) == 12 && pread(fd, text, len, 12) == (ssize_t)len;
+	close(fd);
+
+	text[len] = 0;
+	memcpy(head, head_buf, 8);
+	memcpy(&crc, head_buf+8, 4);
+
+	if (!ok || crc32c(text, len) != crc) {
+		drop(text);
+		return NULL;
+	}
+
+	return text;
+}
+
+//heap copy of the text after diff head, NULL if the file is cut short
+//v2 keeps it in the .cur file, which is written after the header
+//so a reader between the two is one diff behind, anything else means rebuilding from the chain
+char* txt_current(txt_map* map, uint64_t head) {
+	if (txt_version(map) == 1) {
+		txt_cursor cur;
+		uint64_t current, prev;
+		if (!txt_read_head(map, &cur, &current, &prev)) return NULL;
+
+		return txt_read_str(&cur);
+	}
+
+	if (head == 0) return NULL;
+
+	uint64_t cur_head;
+	char* text = txt_cur_read(map->filename, &cur_head);
+
+	if (text && cur_head == head) return text;
+
+	diff_t d;
+	if (text && txt_diff_at(map, head, &d) && d.prev == cur_head) {
+		char* newer = diff_apply(text, &d);
+		drop(text);
+		diff_free(&d);
+		return newer;
+	}
+
+	if (text) {
+		drop(text);
+		diff_free(&d);
+	}
+
+	vector_t offsets = txt_diff_offsets(map, head);
+	text = heapcpystr("");
+
+	vector_iterator iter = vector_iterate(&offsets);
+	while (text && vector_next(&iter)) {
+		//the oldest has to start the chain, otherwise part of it is missing
+		if (txt_diff_at(map, *(uint64_t*)iter.x, &d) && (iter.i > 1 || d.prev == 0)) {
+			char* newer = diff_apply(text, &d);
+			drop(text);
+			text = newer;
+		} else {
+			drop(text);
+			text = NULL;
+		}
+
+		diff_free(&d);
+	}
+
+	if (text && offsets.length == 0) {
+		drop(text);
+		text = NULL;
+	}
+
+	vector_free(&offsets);
+	return text;
+}
+
+//parsed in place from a mapping, anything past the end of the file stops the read
+void read_txt(text_t* txt, uint64_t start, uint64_t max) {
+	txt->current = NULL;
+
+	uint64_t prev;
+	txt_map* map = txt_map_head(txt->filename, &prev);
+	if (!map) return;
+
+	if (!(txt->current = txt_current(map, prev))) {
+		txt_map_release(map);
+		return;
+	}
+
+	for (uint64_t i=0; prev>0 && i<max; i++) {
+		//user given offsets have to land on a diff too
+		diff_t d;
+		if (!txt_diff_at(map, start>0 && i==0 ? start : prev, &d)) {
+			diff_free(&d);
+			break;
+		}
+
+		prev = d.prev;
+		vector_pushcpy(&txt->diffs, &d);
+	}
+
+	txt_map_release(map);
+}
+
+int rev_read(int fd, uint64_t i, rev_entry* entry) {
+	return pread(fd, entry, sizeof(rev_entry), (off_t)(i*sizeof(rev_entry))) == sizeof(rev_entry);
+}
+
+//keyframe record is revision | length | text
+int rev_write_keyframe(int fd, uint64_t rev, char* text) {
+	uint64_t head[2] = {rev, strlen(text)};
+	return write(fd, head, sizeof(head)) == sizeof(head) && write(fd, text, head[1]) == (ssize_t)head[1];
+}
+
+//NULL if it isnt revision rev, ie. the key file was rebuilt since the index was read
+char* rev_read_keyframe(int fd, uint64_t at, uint64_t rev) {
+	uint64_t head[2];
+	if (pread(fd, head, sizeof(head), (off_t)at) != sizeof(head) || head[0] != rev) return NULL;
+
+	char* text = heap(head[1]+1);
+	if (pread(fd, text, head[1], (off_t)(at+sizeof(head))) != (ssize_t)head[1]) {
+		drop(text);
+		return NULL;
+	}
+
+	text[head[1]] = 0;
+	return text;
+}
+
+//writes the index and keyframes for the whole chain, for files from before the index or after a failed append
+void rev_index_build(char* filename) {
+	uint64_t prev;
+	txt_map* map = txt_map_head(filename, &prev);
+	if (!map) return;
+
+	char* text = txt_current(map, prev);
+	if (!text) {
+		txt_map_release(map);
+		return;
+	}
+
+	//where the newest diff ends, v1 has the current text right after it
+	uint64_t current = 0, newest;
+	txt_cursor cur;
+
+	if (txt_version(map) == 1) txt_read_head(map, &cur, &current, &newest);
+	else if (txt_record_at(map, prev, &cur)) current = (uint64_t)(cur.end - map->data) + 4;
+
+	vector_t offsets = txt_diff_offsets(map, prev);
+	vector_t entries = vector_new(sizeof(rev_entry));
+
+	//keyframes are placed going forward, same as rev_append would have
+	rev_entry last = {.since_revs=0, .since_bytes=0};
+
+	vector_iterator iter = vector_iterate(&offsets);
+	while (vector_next(&iter)) {
+		uint64_t diff = *(uint64_t*)iter.x;
+		uint64_t end = iter.i < offsets.length ? *(uint64_t*)vector_get(&offsets, iter.i) : current;
+
+		rev_entry entry = {.diff=diff, .keyframe=REV_NO_KEYFRAME,
+			.since_revs=last.since_revs+1, .since_bytes=last.since_bytes + (end-diff)};
+
+		if (entry.since_revs >= REV_KEYFRAME_REVS || entry.since_bytes >= REV_KEYFRAME_BYTES) {
+			entry.keyframe = 0; //placeholder, offset is set once written
+			entry.since_revs = 0;
+			entry.since_bytes = 0;
+		}
+
+		vector_pushcpy(&entries, &entry);
+		last = entry;
+	}
+
+	char* key_path = heapstr("%s" KEY_EXT, filename);
+	char* rev_path = heapstr("%s" REV_EXT, filename);
+	char* key_tmp = heapstr("%s" KEY_EXT ".tmp", filename);
+	char* rev_tmp = heapstr("%s" REV_EXT ".tmp", filename);
+
+	int key_fd = open(key_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	int ok = key_fd >= 0;
+
+	//walk back from the current text, writing keyframes as their revisions come up
+	uint64_t key_at = 0;
+	for (unsigned long i=entries.length; ok && i>0; i--) {
+		rev_entry* entry = vector_get(&entries, i-1);
+
+		if (entry->keyframe != REV_NO_KEYFRAME) {
+			entry->keyframe = key_at;
+			ok = rev_write_keyframe(key_fd, i, text);
+			key_at += 2*sizeof(uint64_t) + strlen(text);
+		}
+
+		diff_t d;
+		if (!txt_diff_at(map, entry->diff, &d)) ok = 0;
+		else {
+			char* older = diff_revert(text, &d);
+			drop(text);
+			text = older;
+		}
+
+		diff_free(&d);
+	}
+
+	if (key_fd >= 0) close(key_fd);
+
+	if (ok) {
+		int rev_fd = open(rev_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+		ok = rev_fd >= 0 && write(rev_fd, entries.data, entries.length*sizeof(rev_entry)) == (ssize_t)(entries.length*sizeof(rev_entry));
+		if (rev_fd >= 0) close(rev_fd);
+	}
+
+	//keyframes first, readers check the revision of a keyframe against the index
+	if (ok && rename(key_tmp, key_path)==0) rename(rev_tmp, rev_path);
+	else {
+		unlink(key_tmp);
+		unlink(rev_tmp);
+	}
+
+	drop(key_path);
+	drop(rev_path);
+	drop(key_tmp);
+	drop(rev_tmp);
+
+	drop(text);
+	vector_free(&entries);
+	vector_free(&offsets);
+	txt_map_release(map);
+}
+
+//called by add_diff once the file is flushed, rebuilds the index if it doesnt end with prev
+void rev_append(char* filename, uint64_t diff, uint64_t prev, uint64_t size, char* current_str) {
+	char* rev_path = heapstr("%s" REV_EXT, filename);
+	int fd = open(rev_path, O_RDWR | O_CREAT, 0664);
+	drop(rev_path);
+
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0) close(fd);
+		return;
+	}
+
+	uint64_t n = (uint64_t)st.st_size / sizeof(rev_entry);
+	rev_entry last = {.diff=0, .since_revs=0, .since_bytes=0};
+
+	int valid = (uint64_t)st.st_size % sizeof(rev_entry) == 0
+		&& (n==0 ? prev==0 : rev_read(fd, n-1, &last) && last.diff==prev);
+
+	if (!valid) {
+		close(fd);
+		rev_index_build(filename);
+		return;
+	}
+
+	rev_entry entry = {.diff=diff, .keyframe=REV_NO_KEYFRAME,
+		.since_revs=last.since_revs+1, .since_bytes=last.since_bytes+size};
+
+	if (entry.since_revs >= REV_KEYFRAME_REVS || entry.since_bytes >= REV_KEYFRAME_BYTES) {
+		char* key_path = heapstr("%s" KEY_EXT, filename);
+		int key_fd = open(key_path, O_WRONLY | O_APPEND | O_CREAT, 0664);
+		drop(key_path);
+
+		struct stat key_st;
+		if (key_fd >= 0 && fstat(key_fd, &key_st)==0 && rev_write_keyframe(key_fd, n+1, current_str)) {
+			entry.keyframe = (uint64_t)key_st.st_size;
+			entry.since_revs = 0;
+			entry.since_bytes = 0;
+		}
+
+		if (key_fd >= 0) close(key_fd);
+	}
+
+	pwrite(fd, &entry, sizeof(rev_entry), (off_t)(n*sizeof(rev_entry)));
+	close(fd);
+}
+
+//revision rev forward from the keyframe before it, NULL if anything is missing
+char* rev_from_keyframe(char* filename, txt_map* map, int fd, uint64_t rev, uint64_t key_rev) {
+	char* text = NULL;
+	rev_entry entry;
+
+	if (key_rev == 0) text = heapcpystr("");
+	else if (rev_read(fd, key_rev-1, &entry) && entry.keyframe != REV_NO_KEYFRAME) {
+		char* key_path = heapstr("%s" KEY_EXT, filename);
+		int key_fd = open(key_path, O_RDONLY);
+		drop(key_path);
+
+		if (key_fd >= 0) {
+			text = rev_read_keyframe(key_fd, entry.keyframe, key_rev);
+			close(key_fd);
+		}
+	}
+
+	for (uint64_t i=key_rev; text && i<rev; i++) {
+		diff_t d;
+		if (rev_read(fd, i, &entry) && txt_diff_at(map, entry.diff, &d)) {
+			char* newer = diff_apply(text, &d);
+			drop(text);
+			text = newer;
+		} else {
+			drop(text);
+			text = NULL;
+		}
+
+		diff_free(&d);
+	}
+
+	return text;
+}
+
+//heap text of revision rev, 0 being before the first diff, NULL if there is no such revision
+//starts from whichever of the keyframe before it and the current text is closer, so few diffs are read
+//walks the whole chain if the index doesnt match the file
+char* txt_revision(char* filename, uint64_t rev) {
+	uint64_t prev;
+	txt_map* map = txt_map_head(filename, &prev);
+	if (!map) return NULL;
+
+	char* text = txt_current(map, prev);
+
+	char* rev_path = heapstr("%s" REV_EXT, filename);
+	int fd = open(rev_path, O_RDONLY);
+	drop(rev_path);
+
+	struct stat st;
+	uint64_t n = 0;
+	rev_entry entry;
+
+	int indexed = fd >= 0 && fstat(fd, &st)==0 && (n = (uint64_t)st.st_size / sizeof(rev_entry)) > 0
+		&& rev_read(fd, n-1, &entry) && entry.diff == prev;
+
+	vector_t offsets = indexed ? vector_new(sizeof(uint64_t)) : txt_diff_offsets(map, prev);
+	if (!indexed) n = offsets.length;
+
+	if (text && rev > n) {
+		drop(text);
+		text = NULL;
+	}
+
+	if (text && indexed && rev < n && rev_read(fd, rev > 0 ? rev-1 : 0, &entry)) {
+		uint64_t key_rev = rev > 0 ? rev - entry.since_revs : 0;
+
+		char* key_text = key_rev <= rev && rev-key_rev < n-rev ? rev_from_keyframe(filename, map, fd, rev, key_rev) : NULL;
+		if (key_text) {
+			drop(text);
+			text = key_text;
+			n = rev;
+		}
+	}
+
+	//back from the current text
+	for (uint64_t i=n; text && i>rev; i--) {
+		uint64_t at = 0;
+		if (!indexed) at = *(uint64_t*)vector_get(&offsets, i-1);
+		else if (rev_read(fd, i-1, &entry)) at = entry.diff;
+
+		diff_t d;
+		if (txt_diff_at(map, at, &d)) {
+			char* older = diff_revert(text, &d);
+			drop(text);
+			text = older;
+		} else {
+			drop(text);
+			text = NULL;
+		}
+
+		diff_free(&d);
+	}
+
+	if (fd >= 0) close(fd);
+	vector_free(&offsets);
+	txt_map_release(map);
+
+	return text;
+}
+
+//sums the changes of the diff at without copying them
+int txt_diff_summary(txt_map* map, uint64_t at, rev_summary* summary) {
+	txt_cursor cur;
+	if (!txt_record_at(map, at, &cur)) return 0;
+
+	uint64_t prev, length;
+	if (!txt_read_u64(&cur, &prev) || !txt_read_u64(&cur, &summary->author)
+			|| !txt_read_u64(&cur, &summary->time))
+		return 0;
+
+	uint64_t* sums[2] = {&summary->added, &summary->deleted};
+	for (int i=0; i<2; i++) {
+		*sums[i] = 0;
+		if (!txt_read_u64(&cur, &length)) return 0;
+
+		for (uint64_t j=0; j<length; j++) {
+			uint64_t pos, len;
+			if (!txt_read_u64(&cur, &pos) || !txt_read_u64(&cur, &len) || len > (uint64_t)(cur.end - cur.pos)) return 0;
+
+			*sums[i] += len;
+			cur.pos += len;
+		}
+	}
+
+	return 1;
+}
+
+//up to count rev_summary into out, newest first after skipping the newest skip, revs is set to the number of revisions
+//one read of the index for the page, so deep pages cost the same as the first
+//0 if the index doesnt match the file, rebuild it under the article's lock and try again
+int txt_history(char* filename, uint64_t skip, uint64_t count, vector_t* out, uint64_t* revs) {
+	*revs = 0;
+
+	uint64_t prev;
+	txt_map* map = txt_map_head(filename, &prev);
+	if (!map) return 1;
+
+	char* rev_path = heapstr("%s" REV_EXT, filename);
+	int fd = open(rev_path, O_RDONLY);
+	drop(rev_path);
+
+	struct stat st;
+	uint64_t n = 0;
+	rev_entry last;
+
+	int valid = fd >= 0 && fstat(fd, &st)==0 && (uint64_t)st.st_size % sizeof(rev_entry) == 0
+		&& ((n = (uint64_t)st.st_size / sizeof(rev_entry)) == 0 ? prev==0 : rev_read(fd, n-1, &last) && last.diff==prev);
+
+	if (valid && skip < n) {
+		uint64_t newest = n - skip, oldest = newest > count ? newest - count : 0;
+
+		rev_entry* entries = heap(sizeof(rev_entry)*(newest-oldest));
+		size_t size = sizeof(rev_entry)*(newest-oldest);
+
+		valid = pread(fd, entries, size, (off_t)(oldest*sizeof(rev_entry))) == (ssize_t)size;
+
+		for (uint64_t i=newest; valid && i>oldest; i--) {
+			rev_summary summary = {.rev=i};
+			valid = txt_diff_summary(map, entries[i-1-oldest].diff, &summary);
+
+			vector_pushcpy(out, &summary);
+		}
+
+		drop(entries);
+	}
+
+	if (valid) *revs = n;
+	else vector_clear(out);
+
+	if (fd >= 0) close(fd);
+	txt_map_release(map);
+
+	return valid;
+}
+
+//moves a diff file along with its current text, index and keyframes
+int txt_rename(char* from, char* to) {
+	if (rename(from, to) != 0) return -1;
+
+	char* exts[] = {CUR_EXT, REV_EXT, KEY_EXT};
+	for (int i=0; i<3; i++) {
+		char* from_side = heapstr("%s%s", from, exts[i]);
+		char* to_side = heapstr("%s%s", to, exts[i]);
+
+		//a missing index is rebuilt on the next edit, and the current text from the chain
+		if (rename(from_side, to_side) != 0) unlink(to_side);
+
+		drop(from_side);
+		drop(to_side);
+	}
+
+	return 0;
+}
+
+//rewrites a v1 diff file in the current format, then its current text and index
+//1 if it was converted, 0 if there was nothing to do or the file is left as it was
+int txt_convert(char* filename) {
+	uint64_t prev;
+	txt_map* map = txt_map_head(filename, &prev);
+	if (!map) return 0;
+
+	if (txt_version(map) != 1) {
+		txt_map_release(map);
+		return 0;
+	}
+
+	char* text = txt_current(map, prev);
+	if (!text) {
+		fprintf(stderr, "couldnt read the current text of %s, left unconverted\n", filename);
+		txt_map_release(map);
+		return 0;
+	}
+
+	vector_t offsets = txt_diff_offsets(map, prev);
+
+	char* tmp = heapstr("%s.tmp", filename);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+
+	uint64_t head = 0, written = 0;
+	vector_t buf = vector_new(1);
+	vector_stockcpy(&buf, 8, TXT_MAGIC);
+	vector_stockcpy(&buf, 8, &head);
+
+	int ok = fd >= 0, walked = offsets.length > 0;
+
+	//offsets change, so every record is written again with its new prev
+	vector_iterator iter = vector_iterate(&offsets);
+	while (ok && walked && vector_next(&iter)) {
+		diff_t d;
+		walked = txt_diff_at(map, *(uint64_t*)iter.x, &d) && (iter.i > 1 || d.prev == 0);
+
+		if (walked) {
+			uint64_t at = written + buf.length;
+			txt_put_diff(&buf, &d, head);
+			head = at;
+
+			ok = write(fd, buf.data, buf.length) == (ssize_t)buf.length;
+			written += buf.length;
+			vector_clear(&buf);
+		}
+
+		diff_free(&d);
+	}
+
+	//a chain that doesnt reach back to the start keeps only the current text, as one diff by nobody
+	//the old file stays beside it so the history can still be recovered by hand
+	char* old = NULL;
+	if (ok && !walked) {
+		fprintf(stderr, "history of %s is broken, converting the current text only\n", filename);
+
+		diff_t d = {.additions=vector_new(sizeof(add_t)), .deletions=vector_new(sizeof(del_t)),
+			.author=0, .time=(uint64_t)time(NULL)};
+		if (*text) vector_pushcpy(&d.additions, &(add_t){.pos=0, .txt=heapcpystr(text)});
+
+		vector_clear(&buf);
+		head = 0;
+		vector_stockcpy(&buf, 8, TXT_MAGIC);
+		vector_stockcpy(&buf, 8, &head);
+
+		head = buf.length;
+		txt_put_diff(&buf, &d, 0);
+		diff_free(&d);
+
+		ok = ftruncate(fd, 0)==0 && pwrite(fd, buf.data, buf.length, 0) == (ssize_t)buf.length;
+
+		old = heapstr("%s.v1", filename);
+		unlink(old);
+		ok = ok && link(filename, old)==0;
+	}
+
+	ok = ok && pwrite(fd, &head, 8, 8) == 8 && fsync(fd)==0;
+	if (fd >= 0) close(fd);
+
+	//v1 readers dont look at the current text file, so it goes first
+	ok = ok && txt_cur_write(filename, head, text) && rename(tmp, filename)==0;
+	if (!ok) {
+		fprintf(stderr, "couldnt convert %s\n", filename);
+		unlink(tmp);
+		if (old) unlink(old);
+	}
+
+	drop(tmp);
+	if (old) drop(old);
+	drop(text);
+	vector_free(&buf);
+	vector_free(&offsets);
+	txt_map_release(map);
+
+	if (ok) rev_index_build(filename);
+	return ok;
+}
+
+typedef struct {
+	char* str;
+	unsigned long len;
+
+	enum {dseg_add, dseg_del, dseg_current} ty;
+	unsigned long diff;
+} dseg;
+
+//segments in display order as an implicit treap, so placing one is logarithmic however long the history
+typedef struct {
+	dseg seg;
+
+	long left; //-1 if none
+	long right;
+	uint32_t priority;
+
+	unsigned long len; //of the subtree
+	unsigned long counted; //of the subtree, without additions
+} dseg_node;
+
+dseg_node* dseg_get(vector_t* nodes, long i) {
+	return vector_get(nodes, (unsigned long)i);
+}
+
+//xorshift, only has to be spread out
+long dseg_node_new(vector_t* nodes, dseg seg, uint32_t* seed) {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+
+	vector_pushcpy(nodes, &(dseg_node){.seg=seg, .left=-1, .right=-1, .priority=*seed,
+		.len=seg.len, .counted=seg.ty == dseg_add ? 0 : seg.len});
+
+	return (long)nodes->length-1;
+}
+
+void dseg_update(vector_t* nodes, long i) {
+	dseg_node* node = dseg_get(nodes, i);
+	node->len = node->seg.len;
+	node->counted = node->seg.ty == dseg_add ? 0 : node->seg.len;
+
+	if (node->left >= 0) {
+		node->len += dseg_get(nodes, node->left)->len;
+		node->counted += dseg_get(nodes, node->left)->counted;
+	}
+
+	if (node->right >= 0) {
+		node->len += dseg_get(nodes, node->right)->len;
+		node->counted += dseg_get(nodes, node->right)->counted;
+	}
+}
+
+long dseg_merge(vector_t* nodes, long a, long b) {
+	if (a < 0) return b;
+	if (b < 0) return a;
+
+	if (dseg_get(nodes, a)->priority > dseg_get(nodes, b)->priority) {
+		long right = dseg_merge(nodes, dseg_get(nodes, a)->right, b);
+		dseg_get(nodes, a)->right = right;
+		dseg_update(nodes, a);
+		return a;
+	} else {
+		long left = dseg_merge(nodes, a, dseg_get(nodes, b)->left);
+		dseg_get(nodes, b)->left = left;
+		dseg_update(nodes, b);
+		return b;
+	}
+}
+
+//l gets the first off characters, cutting a segment in two if it has to
+//empty segments at off go left if empty_left, otherwise right
+void dseg_split(vector_t* nodes, long t, unsigned long off, int empty_left, long* l, long* r, uint32_t* seed) {
+	if (t < 0) {
+		*l = -1;
+		*r = -1;
+		return;
+	}
+
+	dseg_node* node = dseg_get(nodes, t);
+	unsigned long before = node->left >= 0 ? dseg_get(nodes, node->left)->len : 0;
+	unsigned long seg_len = node->seg.len;
+
+	if (off < before || (off == before && !(empty_left && seg_len == 0))) {
+		long left_r;
+		dseg_split(nodes, node->left, off, empty_left, l, &left_r, seed);
+
+		dseg_get(nodes, t)->left = left_r;
+		dseg_update(nodes, t);
+		*r = t;
+	} else if (off >= before + seg_len) {
+		long right_l;
+		dseg_split(nodes, node->right, off - before - seg_len, empty_left, &right_l, r, seed);
+
+		dseg_get(nodes, t)->right = right_l;
+		dseg_update(nodes, t);
+		*l = t;
+	} else {
+		unsigned long cut = off - before;
+
+		dseg tail = node->seg;
+		tail.str += cut;
+		tail.len -= cut;
+
+		long tail_i = dseg_node_new(nodes, tail, seed);
+		node = dseg_get(nodes, t); //pushing may have moved it
+
+		dseg_get(nodes, tail_i)->right = node->right;
+		node->right = -1;
+		node->seg.len = cut;
+
+		dseg_update(nodes, tail_i);
+		dseg_update(nodes, t);
+
+		*l = t;
+		*r = tail_i;
+	}
+}
+
+//where a change at pos goes, in the first segment whose text before it (without additions) passes pos
+//past the end, the last segment, before it if it is empty
+unsigned long dseg_find(vector_t* nodes, long t, uint64_t pos, int* empty_end) {
+	unsigned long display = 0;
+	*empty_end = 0;
+
+	while (t >= 0) {
+		dseg_node* node = dseg_get(nodes, t);
+		unsigned long left_len = 0, left_counted = 0;
+
+		if (node->left >= 0) {
+			left_len = dseg_get(nodes, node->left)->len;
+			left_counted = dseg_get(nodes, node->left)->counted;
+		}
+
+		if (pos < left_counted) {
+			t = node->left;
+			continue;
+		}
+
+		pos -= left_counted;
+		display += left_len;
+
+		int counted = node->seg.ty != dseg_add;
+		if (counted && pos < node->seg.len) return display + pos;
+
+		//additions at the end are overlaid from their start
+		if (node->right < 0) {
+			*empty_end = node->seg.len == 0;
+			return counted ? display + pos : display;
+		}
+
+		if (counted) pos -= node->seg.len;
+		display += node->seg.len;
+		t = node->right;
+	}
+
+	return display;
+}
+
+void dseg_collect(vector_t* nodes, long t, vector_t* segs) {
+	while (t >= 0) {
+		dseg_node* node = dseg_get(nodes, t);
+
+		dseg_collect(nodes, node->left, segs);
+		vector_pushcpy(segs, &node->seg);
+
+		t = node->right;
+	}
+}
+
+//current text with every diff's changes laid over it, newest first
+//each change covers as much of the display as its length, starting where its position falls in the text without additions
+vector_t display_diffs(text_t* txt) {
+	vector_t nodes = vector_new(sizeof(dseg_node));
+	uint32_t seed = 0x9e3779b9;
+
+	long root = dseg_node_new(&nodes, (dseg){.len=strlen(txt->current), .ty=dseg_current, .str=txt->current}, &seed);
+
+	vector_iterator iter = vector_iterate(&txt->diffs);
+	while (vector_next(&iter)) {
+		diff_t* d = iter.x;
+
+		//removes first
+		for (int iteradd=0; iteradd<2; iteradd++) {
+			vector_iterator d_iter = vector_iterate(iteradd ? &d->additions : &d->deletions);
+
+			while (vector_next(&d_iter)) {
+				//same layout
+				add_t* change = d_iter.x;
+
+				dseg seg = {.diff=iter.i-1, .len=strlen(change->txt), .ty=iteradd ? dseg_add : dseg_del, .str=change->txt};
+
+				unsigned long total = dseg_get(&nodes, root)->len;
+				int empty_end;
+				unsigned long at = dseg_find(&nodes, root, change->pos, &empty_end);
+				if (at > total) at = total;
+
+				unsigned long end = at + seg.len > total ? total : at + seg.len;
+
+				long before, rest, covered, after;
+				dseg_split(&nodes, root, at, !empty_end, &before, &rest, &seed);
+				dseg_split(&nodes, rest, end-at, 0, &covered, &after, &seed);
+
+				long new_i = dseg_node_new(&nodes, seg, &seed);
+				root = dseg_merge(&nodes, dseg_merge(&nodes, before, new_i), after);
+			}
+		}
+	}
+
+	vector_t segs = vector_new(sizeof(dseg));
+	dseg_collect(&nodes, root, &segs);
+
+	vector_free(&nodes);
+	return segs;
 }
 
 void txt_free(text_t* txt) {
@@ -525,6 +1805,7 @@ void txt_free(text_t* txt) {
 	
 	vector_free(&txt->diffs);
 
-	drop(txt->current);
-	fclose(txt->file);
+	if (txt->current) drop(txt->current);
+	if (txt->fd >= 0) close(txt->fd);
+	drop(txt->filename);
 }
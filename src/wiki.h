@@ -4,9 +4,26 @@
 #include "stdlib.h"
 #include "stdio.h"
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <threads.h>
+#include <stdatomic.h>
 #include "vector.h"
 #include "hashtable.h"
 #define DATA_PATH "./data/"
+#define TXT_MAPS 64 //diff files kept mapped, oldest unmapped first
+#define DIFF_MAX_COST 1024 //edits searched for a middle snake before settling for a good enough split
+#define REV_EXT ".rev"
+#define KEY_EXT ".key"
+#define REV_KEYFRAME_REVS 32 //diffs between keyframes at most
+#define REV_KEYFRAME_BYTES 64*1024 //or diff bytes, whichever comes first
+#define REV_NO_KEYFRAME UINT64_MAX
+#define TXT_MAGIC "\0ranchd2"
+#define TXT_HEADER 16
+#define TXT_RECORD_DIFF 1 //kind | varint body length | body | crc32c of all before it
+#define CUR_EXT ".cur" //current text, newest diff | crc32c | text
 typedef struct {
 	uint64_t pos;
 	char* txt;
@@ -24,17 +41,55 @@ typedef struct {
 	uint64_t prev; //only returned, otherwise garbage
 } diff_t;
 typedef struct {
-	FILE* file;
+	int fd; //-1 if opened for reading
+	char* filename;
 
 	char* current;
 	vector_t diffs;
 } text_t;
+typedef struct {
+	char* filename;
+	char* data;
+	uint64_t len;
+
+	dev_t dev;
+	ino_t ino;
+
+	atomic_ulong refs; //readers, plus one while in txt_maps
+} txt_map;
+typedef struct {
+	uint64_t diff; //offset of it in the diff file
+	uint64_t keyframe; //offset of the text of revision i+1 in the key file, or REV_NO_KEYFRAME
+
+	//since the last keyframe (revision 0 is an empty one), 0 if this is one
+	uint64_t since_revs;
+	uint64_t since_bytes;
+} rev_entry;
+typedef struct {
+	uint64_t rev; //made by the diff
+	uint64_t author;
+	uint64_t time;
+
+	uint64_t added; //bytes
+	uint64_t deleted;
+} rev_summary;
 int parse_wiki_path(char* path, vector_t* vec);
 diff_t find_changes(char* from, char* to);
 vector_t make_path(vector_t* path);
 text_t txt_new(char* filename);
-void add_diff(text_t* txt, diff_t* d, char* current_str);
+text_t txt_open(char* filename);
+int add_diff(text_t* txt, diff_t* d, char* current_str);
+void diff_free(diff_t* d);
+void txt_map_release(txt_map* map);
+txt_map* txt_map_get(char* filename);
 void read_txt(text_t* txt, uint64_t start, uint64_t max);
+char* diff_apply(char* old, diff_t* d);
+char* diff_revert(char* new, diff_t* d);
+void rev_index_build(char* filename);
+char* txt_revision(char* filename, uint64_t rev);
+int txt_history(char* filename, uint64_t skip, uint64_t count, vector_t* out, uint64_t* revs);
+int txt_rename(char* from, char* to);
+int txt_convert(char* filename);
 typedef struct {
 	char* str;
 	unsigned long len;
@@ -43,5 +98,4 @@ typedef struct {
 	unsigned long diff;
 } dseg;
 vector_t display_diffs(text_t* txt);
-void diff_free(diff_t* d);
 void txt_free(text_t* txt);